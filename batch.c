@@ -0,0 +1,177 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include "machine.h"
+
+// The scripts one worker has left to run. The worker takes them from the
+// tail, other workers steal from the head once their own run out.
+struct batchQueue {
+  pthread_mutex_t lock; // Guards head and tail
+  unsigned *jobs;       // Indexes into the batch's scripts
+  unsigned head;        // The next job to steal
+  unsigned tail;        // One past the next job the owner runs
+};
+
+// A thread of the pool with its queue
+struct batchWorker {
+  pthread_t thread;         // The thread running the worker
+  struct batchQueue queue;  // The worker's own jobs
+  unsigned id;              // The worker's index in the pool
+  struct batch *batch;      // The batch the worker belongs to
+};
+
+// A set of scripts run on a pool of workers
+struct batch {
+  char **scripts;               // The paths of the scripts
+  struct batchWorker *workers;  // The pool
+  unsigned workerCount;         // Workers in the pool
+  unsigned failed;              // Scripts that could not be run
+  pthread_mutex_t failedLock;   // Guards failed
+};
+
+// Take a job from the tail of the worker's own queue
+static bool batchPop(struct batchQueue *queue, unsigned *job) {
+  bool found = false;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) {
+    *job = queue->jobs[--queue->tail];
+    found = true;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return found;
+}
+
+// Take a job from the head of another worker's queue
+static bool batchSteal(struct batchQueue *queue, unsigned *job) {
+  bool found = false;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) {
+    *job = queue->jobs[queue->head++];
+    found = true;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return found;
+}
+
+// Run one script on a machine of its own, writing its output to the
+// script's path with ".out" added
+static bool batchRunScript(const char *script) {
+  char outName[PATH_MAX + 5]; // The path of the output file
+  FILE *infile; // The script
+  FILE *outfile; // Where the machine prints
+
+  infile = fopen(script, "r");
+  if (NULL == infile) {
+    fprintf(stderr, "Cannot open %s\n", script);
+    return false;
+  }
+
+  snprintf(outName, sizeof(outName), "%s.out", script);
+  outfile = fopen(outName, "w");
+  if (NULL == outfile) {
+    fprintf(stderr, "Cannot create %s\n", outName);
+    fclose(infile);
+    return false;
+  }
+
+  struct machine *m = machineCreate(outfile);
+  machineRunScript(m, infile);
+  machineDestroy(m);
+
+  fclose(outfile);
+  fclose(infile);
+  return true;
+}
+
+// Run the worker's own jobs, then steal from the others until every
+// queue is empty. No job makes new ones, so one pass over the others
+// finding nothing means the batch is done.
+static void *batchWork(void *arg) {
+  struct batchWorker *worker = arg;
+  struct batch *batch = worker->batch;
+  unsigned job; // The index of the script to run
+
+  while (true) {
+    bool found = batchPop(&worker->queue, &job);
+
+    // Look for work at the other workers, starting with the next one
+    for (unsigned i = 1; !found && i < batch->workerCount; i++) {
+      struct batchWorker *victim = &batch->workers[(worker->id + i) % batch->workerCount];
+      found = batchSteal(&victim->queue, &job);
+    }
+    if (!found) {
+      break;
+    }
+
+    if (!batchRunScript(batch->scripts[job])) {
+      pthread_mutex_lock(&batch->failedLock);
+      batch->failed++;
+      pthread_mutex_unlock(&batch->failedLock);
+    }
+  }
+
+  return NULL;
+}
+
+// Run count scripts on a pool of threads, each on a machine of its own.
+// The scripts are dealt out in runs of neighbours so each worker starts on
+// its own share. Returns the number of scripts that could not be run.
+int batchRun(char **scripts, unsigned count, unsigned threads) {
+  struct batch batch; // The scripts and the pool
+
+  if (threads > count) {
+    threads = count;
+  }
+  if (0 == threads) {
+    return 0;
+  }
+
+  batch.scripts = scripts;
+  batch.workerCount = threads;
+  batch.failed = 0;
+  batch.workers = calloc(threads, sizeof(struct batchWorker));
+  pthread_mutex_init(&batch.failedLock, NULL);
+
+  // Give each worker an even share of the scripts
+  for (unsigned w = 0; w < threads; w++) {
+    struct batchWorker *worker = &batch.workers[w];
+    unsigned first = (unsigned long)count * w / threads; // The worker's first script
+    unsigned last = (unsigned long)count * (w + 1) / threads; // One past its last
+
+    worker->id = w;
+    worker->batch = &batch;
+    worker->queue.jobs = malloc((last - first + 1) * sizeof(unsigned));
+    worker->queue.head = 0;
+    worker->queue.tail = last - first;
+    pthread_mutex_init(&worker->queue.lock, NULL);
+
+    // The owner takes from the tail, so put the first script there
+    for (unsigned i = first; i < last; i++) {
+      worker->queue.jobs[last - 1 - i] = i;
+    }
+  }
+
+  // Start the pool and wait for it to finish
+  for (unsigned w = 0; w < threads; w++) {
+    pthread_create(&batch.workers[w].thread, NULL, batchWork, &batch.workers[w]);
+  }
+  for (unsigned w = 0; w < threads; w++) {
+    pthread_join(batch.workers[w].thread, NULL);
+  }
+
+  for (unsigned w = 0; w < threads; w++) {
+    pthread_mutex_destroy(&batch.workers[w].queue.lock);
+    free(batch.workers[w].queue.jobs);
+  }
+  pthread_mutex_destroy(&batch.failedLock);
+  free(batch.workers);
+
+  return batch.failed;
+}
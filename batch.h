@@ -0,0 +1,6 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+int batchRun(char **scripts, unsigned count, unsigned threads);
+
+#endif
@@ -1,180 +1,1352 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "memory.h"
+#include "imemory.h"
+#include "cache.h"
+#include "cpu.h"
+#include "iodev.h"
+#include "snapshot.h"
 
-#define cacheSize 8
-static bool isOn; // Flag that is true when the cache is on, false when off
-static uint8_t clo; // Cache line offset
-static uint8_t cacheData[cacheSize]; // The cache's main storage
-static uint8_t fetchData[cacheSize]; // Temp array for holding data during memory fetch
-static uint8_t *writeData; // Temp variable for the data to write to cache after a cache flush
-enum cacheDataFlags { INVALID, VALID, WRITTEN };
-static enum cacheDataFlags cacheFlags[cacheSize]; // Flag indicators of the state of each byte in the cache
-static bool cacheDataWritten[cacheSize]; // Boolean list that indicates which bytes have been written
-static unsigned cacheAddress;
-static uint8_t* cacheAnswerPtr; 
-static bool* cacheDonePtr; // Indicates when the cache is done with its task
-static bool cacheFetchDone = false; // Indicates when the cache has completed a fetch from memory
-static bool cacheStoreDone = false; // Indicates when the cache has completed the store to memory
+#define maxLineSize 64 // The longest line, so a line's byte flags fit in a uint64_t
+#define maxCacheLines 65536 // The most lines (sets times ways) a cache can have
+#define maxStoreBuffer 8 // The most entries the store buffer can have
+#define maxMshrs 8 // The most miss status holding registers non-blocking loads can use
+#define maxMshrTargets 8 // The most loads one MSHR can hold
+enum cachePolicies { LRU, FIFO, RANDOM };
+enum prefetchModes { PREFETCH_OFF, PREFETCH_NEXT, PREFETCH_STRIDE };
+
+// What the cache is waiting on memory for
+enum cacheRequests { NO_REQUEST, FILL, FLUSH_THEN_FILL, FLUSH_THEN_WRITE, FLUSH_ALL };
+
+// What an L2 is doing with the request from the cache above it
+enum levelStates { LEVEL_IDLE, LEVEL_LOOKUP, LEVEL_WRITEBACK, LEVEL_FILL, LEVEL_FORWARD };
+enum levelRequests { LEVEL_FETCH, LEVEL_STORE, LEVEL_FLUSH_ALL };
+
+// One way of one set. A byte is INVALID when its valid bit is clear,
+// VALID when only its valid bit is set and WRITTEN when its dirty bit is
+// set too.
+struct cacheLine {
+  unsigned tag;   // The line's number in memory, its address over the line size
+  uint64_t valid; // Bit mask of the bytes holding memory's or written data
+  uint64_t dirty; // Bit mask of the bytes written and not yet stored to memory
+  unsigned age;   // The way's rank in its set, 0 for the most recently used (LRU) or filled (FIFO)
+};
+
+// Bytes of one line waiting in the store buffer to be stored to memory
+struct storeEntry {
+  unsigned tag;               // The line's number in memory
+  uint64_t written;           // Bit mask of the bytes to store
+  uint8_t data[maxLineSize];  // The bytes
+};
+
+// A miss status holding register: a line non-blocking loads missed on
+// and the loads waiting for it
+struct mshr {
+  unsigned tag;                           // The line's number in memory
+  unsigned targetCount;                   // The loads waiting
+  unsigned addresses[maxMshrTargets];     // The byte each load reads
+  uint8_t *answerPtrs[maxMshrTargets];    // Where each load's byte goes
+  bool *donePtrs[maxMshrTargets];         // Set when each load is answered
+};
+
+// The state of one machine's cache
+struct cacheContext {
+  bool isOn; // Flag that is true when the cache is on, false when off
+  unsigned sets; // Sets in the cache, a power of two
+  unsigned ways; // Lines in each set
+  unsigned lineSize; // Bytes in a line, a power of two
+  unsigned lineBits; // log2 of lineSize
+  enum cachePolicies policy; // Picks the way a miss replaces
+  uint32_t randomState; // Drives the RANDOM policy
+  struct cacheLine *lines; // sets * ways lines, a set's ways together
+  uint8_t *data; // lineSize bytes for each line
+  uint8_t fetchData[maxLineSize]; // Temp array for holding data during memory fetch
+  uint8_t flushData[maxLineSize]; // Temp array for a line being stored to memory
+  bool flushWritten[maxLineSize]; // The bytes of flushData memory should write
+  uint8_t *writeData; // Temp variable for the data to write to cache after a cache flush
+  enum cacheRequests request; // The request memory is working on for the cache
+  unsigned pendingLine; // The index of the line the request is for
+  unsigned cacheAddress;
+  uint8_t* cacheAnswerPtr;
+  bool* cacheDonePtr; // Indicates when the cache is done with its task
+  bool cacheFetchDone; // Indicates when the cache has completed a fetch from memory
+  bool cacheStoreDone; // Indicates when the cache has completed the store to memory
+  unsigned specialAddress; // The address that flushes or invalidates the cache, the highest one
+  unsigned version; // Bumped whenever the lines change, for the clock's fingerprint
+  struct cacheCounters counters; // Hits, misses and memory traffic
+  enum prefetchModes prefetchMode; // How the prefetcher predicts the next line, if at all
+  uint8_t prefetchData[maxLineSize]; // The prefetch buffer, a line fetched ahead of use
+  unsigned prefetchTag; // The line in the prefetch buffer
+  bool prefetchValid; // Indicates the prefetch buffer holds prefetchTag
+  bool prefetchBusy; // Indicates memory is fetching prefetchTag into the buffer
+  bool prefetchDone; // Set by memory when the prefetch is fetched
+  bool prefetchJoined; // Indicates a load miss waits for the prefetch in flight
+  bool prefetchPredicted; // Indicates prefetchNext holds a prediction
+  unsigned prefetchNext; // The line predicted to miss next
+  unsigned lastMissTag; // The line of the last load miss, for stride mode
+  int lastStride; // The distance between the last two load misses, in lines
+  bool writeThrough; // Stores go on to memory as well as into their line
+  bool noAllocate; // A store miss goes to memory without taking a line
+  unsigned storeBufferSize; // The entries the store buffer may hold, 0 when it is off
+  struct storeEntry storeBuffer[maxStoreBuffer]; // Stores waiting for memory, oldest first
+  unsigned storeCount; // The entries in storeBuffer
+  bool drainBusy; // Indicates memory is storing the oldest entry
+  bool drainDone; // Set by memory when the oldest entry is stored
+  unsigned mshrSize; // The MSHRs loads may use without blocking the cpu, 0 when loads block
+  struct mshr mshrs[maxMshrs]; // Lines non-blocking loads missed on, oldest first
+  unsigned mshrCount; // The MSHRs in use
+  bool mshrActive; // Indicates the cache's request is fetching the oldest MSHR's line
+  struct cacheContext *next; // The L2 below the cache, which fronts memory when it is on
+  struct cacheContext *instr; // The I-cache in front of imemory, its lines in instructions
+  unsigned latency; // Ticks an L2 takes to look a request up
+  bool exclusive; // An L2 holds only lines the cache above does not
+  enum levelStates levelState; // What an L2 is doing with the request from above
+  enum levelRequests levelRequest; // The request from above
+  unsigned levelTicks; // Ticks left before an L2 has looked the request up
+  unsigned levelAddress; // The first byte of the request
+  unsigned levelCount; // The bytes in the request
+  uint8_t *levelData; // Where a fetch answers, or the bytes a store writes
+  bool *levelWritten; // The bytes of levelData a store writes
+  bool *levelDonePtr; // Set when the request is done
+};
+
+// Get the bit mask of every byte in a line
+static uint64_t lineMask(struct cacheContext *cache) {
+  return (maxLineSize == cache->lineSize) ? ~(uint64_t)0 : ((uint64_t)1 << cache->lineSize) - 1;
+}
+
+// Mark every line invalid, dropping any written data
+static void cacheInvalidateAll(struct cacheContext *cache) {
+  for (unsigned i = 0; i < cache->sets * cache->ways; i++) {
+    cache->lines[i].valid = 0;
+    cache->lines[i].dirty = 0;
+  }
+  cache->version++;
+}
+
+// Set the shape of the cache, leaving every line invalid
+static void cacheConfigure(struct cacheContext *cache, unsigned sets, unsigned ways,
+                           unsigned lineSize, enum cachePolicies policy) {
+  free(cache->lines);
+  free(cache->data);
+  cache->sets = sets;
+  cache->ways = ways;
+  cache->lineSize = lineSize;
+  cache->lineBits = __builtin_ctz(lineSize);
+  cache->policy = policy;
+  cache->lines = calloc(sets * ways, sizeof(struct cacheLine));
+  cache->data = calloc(sets * ways, lineSize);
+  for (unsigned i = 0; i < sets * ways; i++) {
+    cache->lines[i].age = i % ways;
+  }
+  cache->randomState = 2463534242u;
+  cache->request = NO_REQUEST;
+  cache->prefetchValid = false;
+  cache->prefetchBusy = false;
+  cache->prefetchPredicted = false;
+  cache->storeCount = 0;
+  cache->drainBusy = false;
+  cache->mshrCount = 0;
+  cache->mshrActive = false;
+  cache->version++;
+}
+
+// Check if a shape is one the cache, the L2 and the I-cache can take: sets
+// and lines are picked out of an address by its bits
+static bool cacheShapeValid(unsigned sets, unsigned ways, unsigned lineSize) {
+  return 0 != sets && 0 == (sets & (sets - 1)) && 0 != lineSize && 0 == (lineSize & (lineSize - 1)) &&
+         lineSize <= maxLineSize && 0 != ways && ways <= maxCacheLines / sets;
+}
+
+// Allocate the cache of a new machine, a single 8 byte line, with an L2
+// of 16 sets of 4 ways of 16 byte lines below it and an I-cache of 8 sets
+// of 2 ways of 4 instruction lines beside it, both off
+struct cacheContext *cacheContextCreate() {
+    struct cacheContext *cache = calloc(1, sizeof(struct cacheContext));
+    cacheConfigure(cache, 1, 1, 8, LRU);
+    cache->specialAddress = 0xFF;
+
+    cache->next = calloc(1, sizeof(struct cacheContext));
+    cacheConfigure(cache->next, 16, 4, 16, LRU);
+    cache->next->latency = 2;
+
+    cache->instr = calloc(1, sizeof(struct cacheContext));
+    cacheConfigure(cache->instr, 8, 2, 4, LRU);
+    return cache;
+}
 
 
 // Reset the cache: cache to disabled, CLO to zero, data to be invalid
-static void cacheReset() {
-  isOn = false;
-  clo = 0;
+static void cacheReset(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  cache->isOn = false;
 
-  for (int i = 0; i < cacheSize; i++) {
-    cacheFlags[i] = INVALID;
-    cacheDataWritten[i] = false;
-  } 
+  for (unsigned i = 0; i < cache->sets * cache->ways; i++) {
+    cache->lines[i].tag = 0;
+    cache->lines[i].age = i % cache->ways;
+  }
+  cacheInvalidateAll(cache);
+  cache->randomState = 2463534242u;
+  cache->prefetchValid = false;
+  cache->prefetchBusy = false;
+  cache->prefetchPredicted = false;
+  cache->lastStride = 0;
+  cache->storeCount = 0;
+  cache->drainBusy = false;
+  cache->mshrCount = 0;
+  cache->mshrActive = false;
 }
 
 // Turn the cache on
-static void cacheOn() {
-   isOn = true;
+static void cacheOn(struct machine *m) {
+   struct cacheContext *cache = m->cache;
+   cache->isOn = true;
 }
 
 // Turn the cache off
-static void cacheOff() {
-   isOn = false;
+static void cacheOff(struct machine *m) {
+   struct cacheContext *cache = m->cache;
+   cache->isOn = false;
+   cache->prefetchValid = false;
+   cache->prefetchBusy = false;
 }
 
-// Dump the cache
-static void cacheDump() {  
-  // Print the CLO
-  printf("clo        : 0x%02X\n", clo);
+// Set the shape of the cache or the L2 from "sets S ways W line L policy lru|fifo|random"
+static void cacheConfig(struct machine *m, struct cacheContext *cache, FILE *infile) {
+  struct cacheContext *l2 = m->cache->next; // The L2
+
+  unsigned sets = 0; // Sets in the cache
+  unsigned ways = 0; // Lines in each set
+  unsigned lineSize = 0; // Bytes in each line
+  char policyName[11]; // The replacement policy
+  enum cachePolicies policy; // The replacement policy as an enum
 
-  // Print the cache data label
-  printf("cache data :");
+  // Get the shape
+  if (4 != fscanf(infile, " sets %u ways %u line %u policy %10s", &sets, &ways, &lineSize, policyName)) {
+    fprintf(m->out, "Usage: cache config sets S ways W line L policy lru|fifo|random\n\n");
+    return;
+  }
+
+  if (0 == strcmp(policyName, "lru")) {
+    policy = LRU;
+  }
+  else if (0 == strcmp(policyName, "fifo")) {
+    policy = FIFO;
+  }
+  else if (0 == strcmp(policyName, "random")) {
+    policy = RANDOM;
+  }
+  else {
+    fprintf(m->out, "Unknown cache policy: %s\n\n", policyName);
+    return;
+  }
 
-  // Print the cache data
-  for (int i = 0; i < cacheSize; i++) {
-    printf(" 0x%02X", cacheData[i]);
+  if (!cacheShapeValid(sets, ways, lineSize)) {
+    fprintf(m->out, "Sets and line size must be powers of two, lines at most %d bytes "
+            "and sets times ways at most %d\n\n", maxLineSize, maxCacheLines);
+    return;
   }
 
-  // Print the flag label
-  printf("\nFlags      :");
+  // Each request from the cache must fit in one line of the L2
+  if (cache != m->cache->instr && l2->isOn &&
+      ((cache == l2) ? lineSize < m->cache->lineSize : lineSize > l2->lineSize)) {
+    fprintf(m->out, "The L2's lines must be at least as long as the cache's\n\n");
+    return;
+  }
+
+  cacheConfigure(cache, sets, ways, lineSize, policy);
+}
+
+// Select how the prefetcher predicts the next line: off, next or stride
+static void cacheSetPrefetch(struct machine *m, FILE *infile) {
+  struct cacheContext *cache = m->cache;
+
+  char mode[11]; // "off", "next" or "stride"
+
+  // Get the mode
+  fscanf(infile, "%10s", mode);
+
+  if (0 == strcmp(mode, "off")) {
+    cache->prefetchMode = PREFETCH_OFF;
+  }
+  else if (0 == strcmp(mode, "next")) {
+    cache->prefetchMode = PREFETCH_NEXT;
+  }
+  else if (0 == strcmp(mode, "stride")) {
+    cache->prefetchMode = PREFETCH_STRIDE;
+  }
+  else {
+    fprintf(m->out, "Unknown prefetch mode: %s\n\n", mode);
+    return;
+  }
+  cache->prefetchPredicted = false;
+  cache->lastStride = 0;
+  cache->version++;
+}
+
+// Select the write policy: back, which keeps a store in its line until
+// the line is replaced, or through, which sends it on to memory as well
+static void cacheSetWrite(struct machine *m, FILE *infile) {
+  struct cacheContext *cache = m->cache;
+
+  char policy[11]; // "back" or "through"
+
+  // Get the policy
+  fscanf(infile, "%10s", policy);
+
+  if (0 == strcmp(policy, "back")) {
+    cache->writeThrough = false;
+  }
+  else if (0 == strcmp(policy, "through")) {
+    cache->writeThrough = true;
+  }
+  else {
+    fprintf(m->out, "Unknown write policy: %s\n\n", policy);
+    return;
+  }
+  cache->version++;
+}
+
+// Select whether a store miss takes a line: on, or off to store the byte
+// to memory without one
+static void cacheSetAllocate(struct machine *m, FILE *infile) {
+  struct cacheContext *cache = m->cache;
+
+  char mode[11]; // "on" or "off"
+
+  // Get the mode
+  fscanf(infile, "%10s", mode);
+
+  if (0 == strcmp(mode, "on")) {
+    cache->noAllocate = false;
+  }
+  else if (0 == strcmp(mode, "off")) {
+    cache->noAllocate = true;
+  }
+  else {
+    fprintf(m->out, "Unknown allocate mode: %s\n\n", mode);
+    return;
+  }
+  cache->version++;
+}
+
+// Set the entries the store buffer may hold, 0 to turn it off. Entries
+// already queued are still stored.
+static void cacheSetStoreBuffer(struct machine *m, FILE *infile) {
+  struct cacheContext *cache = m->cache;
+
+  unsigned size = 0; // The entries
+
+  // Get the size
+  if (1 != fscanf(infile, "%u", &size) || size > maxStoreBuffer) {
+    fprintf(m->out, "The store buffer holds 0 to %d entries\n\n", maxStoreBuffer);
+    return;
+  }
+  cache->storeBufferSize = size;
+  cache->version++;
+}
+
+// Set the MSHRs loads may use without blocking the cpu, 0 for loads that
+// block. Misses already held are still answered.
+static void cacheSetMshrs(struct machine *m, FILE *infile) {
+  struct cacheContext *cache = m->cache;
+
+  unsigned size = 0; // The MSHRs
+
+  // Get the size
+  if (1 != fscanf(infile, "%u", &size) || size > maxMshrs) {
+    fprintf(m->out, "The cache has 0 to %d MSHRs\n\n", maxMshrs);
+    return;
+  }
+  cache->mshrSize = size;
+  cache->version++;
+}
+
+// Print the flags of a line's bytes as I, V or W
+static void cacheDumpFlags(struct machine *m, struct cacheContext *cache, struct cacheLine *line) {
+  for (unsigned i = 0; i < cache->lineSize; i++) {
+    // Translate the bits to the appropriate character to print
+    char flag = 'I';
+    if ((line->dirty >> i) & 1)  flag = 'W';
+    else if ((line->valid >> i) & 1)  flag = 'V';
 
-  // Print the flag values
-  for (int i = 0; i < cacheSize; i++) {
-    
-    // Translate the enumeration to the appropriate character to print
-    char flag;
-    if(cacheFlags[i] == 0)  flag = 'I';
-    else if(cacheFlags[i] == 1)  flag = 'V';
-    else if(cacheFlags[i] == 2)  flag = 'W'; 
-    
     // Print the character
-    printf("   %c ", flag);
+    fprintf(m->out, "   %c ", flag);
+  }
+}
+
+// Dump the cache or the L2, each line labelled by its set and way when there is more than one
+static void cacheDump(struct machine *m, struct cacheContext *cache) {
+
+  for (unsigned i = 0; i < cache->sets * cache->ways; i++) {
+    struct cacheLine *line = &cache->lines[i]; // The line to print
+    const uint8_t *data = cache->data + (i << cache->lineBits); // The line's bytes
+
+    if (cache->sets * cache->ways > 1) {
+      fprintf(m->out, "Set %u way %u\n", i / cache->ways, i % cache->ways);
+    }
+
+    // Print the CLO
+    fprintf(m->out, "clo        : 0x%02X\n", line->tag);
+
+    // Print the cache data label
+    fprintf(m->out, "cache data :");
+
+    // Print the cache data
+    for (unsigned j = 0; j < cache->lineSize; j++) {
+      fprintf(m->out, " 0x%02X", data[j]);
+    }
+
+    // Print the flag label and values
+    fprintf(m->out, "\nFlags      :");
+    cacheDumpFlags(m, cache, line);
+    fprintf(m->out, "\n");
+  }
+
+  // Print the stores waiting in the store buffer, oldest first
+  for (unsigned i = 0; i < cache->storeCount; i++) {
+    struct storeEntry *entry = &cache->storeBuffer[i]; // The entry to print
+
+    fprintf(m->out, "Store buffer %u\n", i);
+    fprintf(m->out, "clo        : 0x%02X\n", entry->tag);
+    fprintf(m->out, "store data :");
+    for (unsigned j = 0; j < cache->lineSize; j++) {
+      if ((entry->written >> j) & 1) {
+        fprintf(m->out, " 0x%02X", entry->data[j]);
+      }
+      else {
+        fprintf(m->out, "   --");
+      }
+    }
+    fprintf(m->out, "\n");
+  }
+
+  // Print newline
+  fprintf(m->out, "\n");
+}
+
+// Get the line holding address, or NULL on a miss
+static struct cacheLine *cacheLookup(struct cacheContext *cache, unsigned address) {
+  unsigned tag = address >> cache->lineBits; // The line's number in memory
+  struct cacheLine *set = &cache->lines[(tag & (cache->sets - 1)) * cache->ways]; // The set's ways
+
+  for (unsigned w = 0; w < cache->ways; w++) {
+    if (tag == set[w].tag && 0 != set[w].valid) {
+      return &set[w];
+    }
+  }
+  return NULL;
+}
+
+// Make a line the youngest of its set, returns true if any rank changed
+static bool cachePromote(struct cacheContext *cache, struct cacheLine *line) {
+  struct cacheLine *set = cache->lines + (line - cache->lines) / cache->ways * cache->ways; // The line's set
+
+  if (0 == line->age) {
+    return false;
+  }
+  for (unsigned w = 0; w < cache->ways; w++) {
+    if (set[w].age < line->age) {
+      set[w].age++;
+    }
+  }
+  line->age = 0;
+  return true;
+}
+
+// Pick the way of address's set a miss replaces: an empty one if there
+// is one, otherwise the one the policy picks
+static struct cacheLine *cacheVictim(struct cacheContext *cache, unsigned address) {
+  unsigned tag = address >> cache->lineBits; // The line's number in memory
+  struct cacheLine *set = &cache->lines[(tag & (cache->sets - 1)) * cache->ways]; // The set's ways
+  struct cacheLine *victim = set; // The way picked
+
+  for (unsigned w = 0; w < cache->ways; w++) {
+    if (0 == set[w].valid) {
+      return &set[w];
+    }
+  }
+
+  if (RANDOM == cache->policy) {
+    // xorshift32
+    cache->randomState ^= cache->randomState << 13;
+    cache->randomState ^= cache->randomState >> 17;
+    cache->randomState ^= cache->randomState << 5;
+    return &set[cache->randomState % cache->ways];
+  }
+
+  // LRU and FIFO both replace the oldest way
+  for (unsigned w = 1; w < cache->ways; w++) {
+    if (set[w].age > victim->age) {
+      victim = &set[w];
+    }
+  }
+  return victim;
+}
+
+// Give a line to address's line, empty, as the youngest of its set
+static void cacheAllocate(struct cacheContext *cache, struct cacheLine *line, unsigned address) {
+  line->tag = address >> cache->lineBits;
+  line->valid = 0;
+  line->dirty = 0;
+  cachePromote(cache, line);
+  cache->version++;
+}
+
+// Write a byte into a line, marked as written, or only as valid when
+// memory is sent the byte too
+static void cacheWriteByte(struct cacheContext *cache, struct cacheLine *line, unsigned address,
+                           uint8_t value, bool written) {
+  unsigned offset = address & (cache->lineSize - 1); // The byte in the line
+  uint8_t *data = cache->data + ((line - cache->lines) << cache->lineBits) + offset; // Where the byte goes
+  uint64_t bit = (uint64_t)1 << offset; // The byte's flag bit
+
+  if (*data != value || !(line->valid & bit) || written != (0 != (line->dirty & bit))) {
+    *data = value;
+    line->valid |= bit;
+    line->dirty = written ? (line->dirty | bit) : (line->dirty & ~bit);
+    cache->version++;
+  }
+}
+
+// Find a line with written bytes, or NULL if there is none
+static struct cacheLine *cacheFindWritten(struct cacheContext *cache) {
+  for (unsigned i = 0; i < cache->sets * cache->ways; i++) {
+    if (0 != cache->lines[i].dirty) {
+      return &cache->lines[i];
+    }
+  }
+  return NULL;
+}
+
+// Take memory for a request the cpu waits on. The prefetch in flight is
+// dropped, and so is the store buffer's store, which starts again later.
+static void cacheTakeMemory(struct cacheContext *cache) {
+  cache->prefetchBusy = false;
+  cache->drainBusy = false;
+}
+
+// Check if the store buffer holds bytes of a line
+static bool cacheIsQueued(struct cacheContext *cache, unsigned tag) {
+  for (unsigned i = 0; i < cache->storeCount; i++) {
+    if (tag == cache->storeBuffer[i].tag) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Put bytes of a line into the store buffer, merged into the newest entry
+// for the line unless memory is already storing it. Returns false if there
+// is no room.
+static bool cacheQueueStore(struct cacheContext *cache, unsigned tag, const uint8_t *data, uint64_t written) {
+  struct storeEntry *entry = NULL; // The entry the bytes go in
+
+  for (unsigned i = cache->storeCount; i > (cache->drainBusy ? 1u : 0u); i--) {
+    if (tag == cache->storeBuffer[i - 1].tag) {
+      entry = &cache->storeBuffer[i - 1];
+      cache->counters.bufferMerges++;
+      break;
+    }
+  }
+  if (NULL == entry) {
+    if (cache->storeCount >= cache->storeBufferSize) {
+      return false;
+    }
+    entry = &cache->storeBuffer[cache->storeCount++];
+    entry->tag = tag;
+    entry->written = 0;
+    memset(entry->data, 0, sizeof(entry->data));
+  }
+
+  for (unsigned i = 0; i < cache->lineSize; i++) {
+    if ((written >> i) & 1) {
+      entry->data[i] = data[i];
+    }
+  }
+  entry->written |= written;
+  cache->counters.bufferedStores++;
+
+  // The prefetch buffer must not outlive the bytes as they were
+  if (tag == cache->prefetchTag) {
+    cache->prefetchValid = false;
+    cache->prefetchBusy = false;
+  }
+  cache->version++;
+  return true;
+}
+
+// Copy bytes stored to memory around the store buffer into the entries
+// for their line, so the older copies there do not overwrite them
+static void cacheUpdateQueued(struct cacheContext *cache, unsigned tag, const uint8_t *data, uint64_t written) {
+  for (unsigned i = 0; i < cache->storeCount; i++) {
+    struct storeEntry *entry = &cache->storeBuffer[i]; // The entry to update
+    if (tag == entry->tag && 0 != (entry->written & written)) {
+      for (unsigned j = 0; j < cache->lineSize; j++) {
+        if ((entry->written & written) >> j & 1) {
+          entry->data[j] = data[j];
+        }
+      }
+      cache->version++;
+    }
+  }
+}
+
+// Lay the store buffer's bytes for a line over the line's fetched data,
+// oldest first, as memory will hold them once the buffer is stored
+static void cacheForwardQueued(struct cacheContext *cache, unsigned tag, uint8_t *data) {
+  for (unsigned i = 0; i < cache->storeCount; i++) {
+    struct storeEntry *entry = &cache->storeBuffer[i]; // The entry to copy
+    if (tag == entry->tag) {
+      for (unsigned j = 0; j < cache->lineSize; j++) {
+        if ((entry->written >> j) & 1) {
+          data[j] = entry->data[j];
+        }
+      }
+    }
+  }
+}
+
+// Drop the cache's lines within a line the L2 is replacing, so the L2
+// keeps holding every line the cache does. Their written bytes join the
+// L2 line's to be stored to memory with it. Returns the lines dropped.
+static unsigned cacheBackInvalidate(struct cacheContext *cache, unsigned address, unsigned size,
+                                    uint8_t *data, uint64_t *written) {
+  unsigned dropped = 0; // Lines dropped
+
+  for (unsigned a = address; a < address + size; a += cache->lineSize) {
+    struct cacheLine *line = cacheLookup(cache, a); // The cache's line at a
+    uint8_t *lineData; // The line's bytes
+
+    if (NULL == line) {
+      continue;
+    }
+    lineData = cache->data + ((line - cache->lines) << cache->lineBits);
+    for (unsigned i = 0; i < cache->lineSize; i++) {
+      if ((line->dirty >> i) & 1) {
+        data[a - address + i] = lineData[i];
+        *written |= (uint64_t)1 << (a - address + i);
+      }
+    }
+
+    // Older copies in the store buffer must not overwrite the bytes later
+    cacheUpdateQueued(cache, line->tag, lineData, line->dirty);
+    line->valid = 0;
+    line->dirty = 0;
+    dropped++;
+  }
+
+  if ((cache->prefetchTag << cache->lineBits) - address < size) {
+    cache->prefetchValid = false;
+  }
+  if (dropped > 0) {
+    cache->version++;
   }
+  return dropped;
+}
+
+// Tell the cache above that the L2 is done with its request
+static void levelFinish(struct cacheContext *l2) {
+  l2->levelState = LEVEL_IDLE;
+  l2->version++;
+  *l2->levelDonePtr = true;
+}
+
+// Copy the bytes of the request from the L2's line to the cache above
+static void levelAnswer(struct cacheContext *l2, struct cacheLine *line) {
+  memcpy(l2->levelData, l2->data + ((line - l2->lines) << l2->lineBits) + (l2->levelAddress & (l2->lineSize - 1)),
+         l2->levelCount);
+}
+
+// Write the written bytes of the request into the L2's line
+static void levelWrite(struct cacheContext *l2, struct cacheLine *line) {
+  for (unsigned i = 0; i < l2->levelCount; i++) {
+    if (l2->levelWritten[i]) {
+      cacheWriteByte(l2, line, l2->levelAddress + i, l2->levelData[i], true);
+    }
+  }
+}
+
+// Start fetching from memory on the cache's port. The cache and the L2
+// have one request with memory between them, so whatever one of them
+// gave up on is cancelled first.
+static void cacheMemFetch(struct machine *m, unsigned address, unsigned count, uint8_t *dataPtr, bool *donePtr) {
+  memCancel(m, MEM_PORT_CACHE);
+  memStartFetch(m, MEM_PORT_CACHE, address, count, dataPtr, donePtr);
+}
+
+// Start storing to memory on the cache's port, cancelling first as for a fetch
+static void cacheMemStore(struct machine *m, unsigned address, unsigned count, uint8_t *dataPtr, bool *writtenPtr,
+                          bool *donePtr) {
+  memCancel(m, MEM_PORT_CACHE);
+  memStartStore(m, MEM_PORT_CACHE, address, count, dataPtr, writtenPtr, donePtr);
+}
+
+// Start storing an L2 line's written bytes to memory
+static void levelStartWriteBack(struct machine *m, struct cacheLine *line) {
+  struct cacheContext *l2 = m->cache->next;
+
+  l2->counters.writeBacks++;
+  l2->levelState = LEVEL_WRITEBACK;
+  l2->pendingLine = line - l2->lines;
+  memcpy(l2->flushData, l2->data + (l2->pendingLine << l2->lineBits), l2->lineSize);
+  for (unsigned i = 0; i < l2->lineSize; i++) {
+    l2->flushWritten[i] = (line->dirty >> i) & 1;
+  }
+  l2->cacheFetchDone = false;
+  l2->cacheStoreDone = false;
+  cacheMemStore(m, line->tag << l2->lineBits, l2->lineSize, l2->flushData, l2->flushWritten, &l2->cacheStoreDone);
+}
+
+// Start fetching the pending L2 line from memory
+static void levelStartFill(struct machine *m) {
+  struct cacheContext *l2 = m->cache->next;
 
-  // Print newlines
-  printf("\n\n");
+  l2->levelState = LEVEL_FILL;
+  l2->cacheFetchDone = false;
+  l2->cacheStoreDone = false;
+  cacheMemFetch(m, l2->lines[l2->pendingLine].tag << l2->lineBits, l2->lineSize, l2->fetchData, &l2->cacheFetchDone);
 }
 
-// Utility method to force invalid data
-void forceInvalid() {
-    // Clear data flags
-    for(int i=0; i<cacheSize;i++) {
-        cacheFlags[i] = INVALID;
-        cacheDataWritten[i] = false;
-    }  
-}
+// Give the pending L2 line, now free, to the request and go on with it
+static void levelContinue(struct machine *m) {
+  struct cacheContext *l2 = m->cache->next;
+  struct cacheLine *line = &l2->lines[l2->pendingLine]; // The line taken
+
+  cacheAllocate(l2, line, l2->levelAddress);
+  if (LEVEL_FETCH == l2->levelRequest) {
+    levelStartFill(m);
+  }
+  else {
+    levelWrite(l2, line);
+    levelFinish(l2);
+  }
+}
+
+// Replace an L2 line for the request, storing its written bytes first.
+// An inclusive L2 takes the lines it holds away from the cache above.
+static void levelReplace(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  struct cacheContext *l2 = cache->next;
+  struct cacheLine *line = cacheVictim(l2, l2->levelAddress); // The line replaced
+
+  l2->pendingLine = line - l2->lines;
+  if (!l2->exclusive && 0 != line->valid) {
+    l2->counters.invalidates += cacheBackInvalidate(cache, line->tag << l2->lineBits, l2->lineSize,
+                                                    l2->data + (l2->pendingLine << l2->lineBits), &line->dirty);
+    line->valid |= line->dirty;
+  }
+
+  if (0 != line->dirty) {
+    levelStartWriteBack(m, line);
+  }
+  else {
+    levelContinue(m);
+  }
+}
+
+// Look the request up in the L2 once its latency has passed
+static void levelLookup(struct machine *m) {
+  struct cacheContext *l2 = m->cache->next;
+  struct cacheLine *line = cacheLookup(l2, l2->levelAddress); // The line holding the request
+  unsigned offset = l2->levelAddress & (l2->lineSize - 1); // The request's first byte in the line
+  uint64_t mask = ((l2->levelCount >= maxLineSize) ? ~(uint64_t)0
+                                                   : ((uint64_t)1 << l2->levelCount) - 1) << offset; // The request's bytes
+
+  // A flush stores the written lines one at a time
+  if (LEVEL_FLUSH_ALL == l2->levelRequest) {
+    line = cacheFindWritten(l2);
+    if (NULL != line) {
+      levelStartWriteBack(m, line);
+    }
+    else {
+      levelFinish(l2);
+    }
+  }
+  else if (LEVEL_FETCH == l2->levelRequest) {
+    if (NULL != line && mask == (line->valid & mask)) {
+      l2->counters.readHits++;
+      cachePromote(l2, line);
+      levelAnswer(l2, line);
+
+      // An exclusive L2 hands bytes it need not store over to the cache above
+      if (l2->exclusive && m->cache->isOn && 0 == (line->dirty & mask)) {
+        line->valid &= ~mask;
+      }
+      levelFinish(l2);
+    }
+    else {
+      l2->counters.readMisses++;
+      if (NULL != line) {
+        l2->pendingLine = line - l2->lines;
+        levelStartFill(m);
+      }
+      // An exclusive L2 only takes lines from above, so a miss goes
+      // straight through to memory
+      else if (l2->exclusive) {
+        l2->levelState = LEVEL_FORWARD;
+        l2->cacheFetchDone = false;
+        l2->cacheStoreDone = false;
+        cacheMemFetch(m, l2->levelAddress, l2->levelCount, l2->levelData, &l2->cacheFetchDone);
+      }
+      else {
+        levelReplace(m);
+      }
+    }
+  }
+  else {
+    if (NULL != line) {
+      l2->counters.writeHits++;
+      cachePromote(l2, line);
+      levelWrite(l2, line);
+      levelFinish(l2);
+    }
+    else {
+      l2->counters.writeMisses++;
+      levelReplace(m);
+    }
+  }
+  l2->version++;
+}
+
+// Start a request on the L2, dropping any it had not finished. That one's
+// store to memory, if any, is simply made again, and a line it was filling
+// is left invalid.
+static void levelStart(struct machine *m, enum levelRequests request, unsigned address, unsigned count,
+                       uint8_t *dataPtr, bool *writtenPtr, bool *donePtr) {
+  struct cacheContext *l2 = m->cache->next;
+
+  l2->levelRequest = request;
+  l2->levelAddress = address;
+  l2->levelCount = count;
+  l2->levelData = dataPtr;
+  l2->levelWritten = writtenPtr;
+  l2->levelDonePtr = donePtr;
+  l2->levelState = LEVEL_LOOKUP;
+  l2->levelTicks = l2->latency;
+  l2->version++;
+}
+
+// Act on memory's answers to the L2 and on a request whose latency has passed
+static void levelDoWork(struct machine *m) {
+  struct cacheContext *l2 = m->cache->next;
+
+  if (LEVEL_LOOKUP == l2->levelState && 0 == l2->levelTicks) {
+    levelLookup(m);
+  }
+
+  // Memory has stored a line, a replaced one or the next of a flush
+  if (l2->cacheStoreDone) {
+    l2->cacheStoreDone = false;
+    if (LEVEL_WRITEBACK == l2->levelState) {
+      l2->lines[l2->pendingLine].dirty = 0;
+      l2->version++;
+      if (LEVEL_FLUSH_ALL == l2->levelRequest) {
+        levelLookup(m);
+      }
+      else {
+        levelContinue(m);
+      }
+    }
+  }
+
+  // Memory has fetched a line into the L2, or a missed request straight
+  // through to the cache above
+  if (l2->cacheFetchDone) {
+    l2->cacheFetchDone = false;
+    if (LEVEL_FILL == l2->levelState) {
+      struct cacheLine *line = &l2->lines[l2->pendingLine]; // The line being filled
+      uint8_t *data = l2->data + (l2->pendingLine << l2->lineBits); // The line's bytes
+
+      // Take memory's data for every byte that is not written
+      for (unsigned i = 0; i < l2->lineSize; i++) {
+        if (!((line->dirty >> i) & 1)) {
+          data[i] = l2->fetchData[i];
+        }
+      }
+      line->valid = lineMask(l2);
+      levelAnswer(l2, line);
+      levelFinish(l2);
+    }
+    else if (LEVEL_FORWARD == l2->levelState) {
+      levelFinish(l2);
+    }
+  }
+}
+
+// Check if the level below the cache, the L2 if it is on and memory, has
+// no request in progress
+static bool cacheNextIdle(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  return LEVEL_IDLE == cache->next->levelState && memIsIdle(m);
+}
+
+// Get the most ticks a request started on the level below takes: with an
+// L2, its latency and then a replaced line stored and a line fetched
+static unsigned cacheNextLatency(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  struct cacheContext *l2 = cache->next;
+  return l2->isOn ? l2->latency + 2 * memLatency(m, l2->lineSize) : memLatency(m, cache->lineSize);
+}
+
+// Start fetching bytes from the level below the cache
+static void cacheNextFetch(struct machine *m, unsigned address, unsigned count, uint8_t *dataPtr, bool *donePtr) {
+  struct cacheContext *cache = m->cache;
+  if (cache->next->isOn) {
+    levelStart(m, LEVEL_FETCH, address, count, dataPtr, NULL, donePtr);
+  }
+  else {
+    cacheMemFetch(m, address, count, dataPtr, donePtr);
+  }
+}
+
+// Start storing bytes to the level below the cache
+static void cacheNextStore(struct machine *m, unsigned address, unsigned count, uint8_t *dataPtr,
+                           bool *writtenPtr, bool *donePtr) {
+  struct cacheContext *cache = m->cache;
+  if (cache->next->isOn) {
+    levelStart(m, LEVEL_STORE, address, count, dataPtr, writtenPtr, donePtr);
+  }
+  else {
+    cacheMemStore(m, address, count, dataPtr, writtenPtr, donePtr);
+  }
+}
+
+// Hand a clean line the cache is replacing down to an exclusive L2. It
+// takes the line at once, unless that means replacing a written line of
+// its own or it is busy with a request.
+static void cacheRetire(struct machine *m, struct cacheLine *line) {
+  struct cacheContext *cache = m->cache;
+  struct cacheContext *l2 = cache->next;
+  unsigned address = line->tag << cache->lineBits; // The line's first byte
+  struct cacheLine *l2Line; // The L2's line for it
+  uint8_t *data = cache->data + ((line - cache->lines) << cache->lineBits); // The line's bytes
+
+  if (!l2->isOn || !l2->exclusive || LEVEL_IDLE != l2->levelState || 0 == line->valid || 0 != line->dirty) {
+    return;
+  }
+
+  l2Line = cacheLookup(l2, address);
+  if (NULL == l2Line) {
+    l2Line = cacheVictim(l2, address);
+    if (0 != l2Line->dirty) {
+      return;
+    }
+    cacheAllocate(l2, l2Line, address);
+  }
+
+  // Bytes the L2 holds already are the same or newer
+  for (unsigned i = 0; i < cache->lineSize; i++) {
+    unsigned offset = (address & (l2->lineSize - 1)) + i; // The byte in the L2's line
+    if (((line->valid >> i) & 1) && !((l2Line->valid >> offset) & 1)) {
+      l2->data[((l2Line - l2->lines) << l2->lineBits) + offset] = data[i];
+      l2Line->valid |= (uint64_t)1 << offset;
+    }
+  }
+  l2->version++;
+}
+
+// Start storing the store buffer's oldest entry to memory
+static void cacheStartDrain(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  struct storeEntry *entry = &cache->storeBuffer[0]; // The entry to store
+
+  cache->prefetchBusy = false;
+  memcpy(cache->flushData, entry->data, cache->lineSize);
+  for (unsigned i = 0; i < cache->lineSize; i++) {
+    cache->flushWritten[i] = (entry->written >> i) & 1;
+  }
+  cache->drainBusy = true;
+  cacheNextStore(m, entry->tag << cache->lineBits, cache->lineSize, cache->flushData,
+                 cache->flushWritten, &cache->drainDone);
+}
+
+// Check if the store buffer may start storing its oldest entry in the
+// background: only when neither the cache nor memory has anything else
+// to do and the io device will not take memory before the store is done
+static bool cacheCanDrain(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  return 0 != cache->storeCount && !cache->drainBusy && NO_REQUEST == cache->request &&
+         !cache->cacheFetchDone && !cache->cacheStoreDone && !cache->prefetchDone &&
+         cacheNextIdle(m) && iodevTicksToNextEvent(m) > cacheNextLatency(m);
+}
+
+// Send a stored byte on to memory: into the store buffer if there is room,
+// otherwise straight to memory, which sets donePtr. Returns true if the
+// store is already done.
+static bool cacheWriteAround(struct machine *m, unsigned address, uint8_t value, bool *donePtr) {
+  struct cacheContext *cache = m->cache;
+  unsigned tag = address >> cache->lineBits; // The byte's line
+  unsigned offset = address & (cache->lineSize - 1); // The byte in the line
+  uint64_t bit = (uint64_t)1 << offset; // The byte's flag bit
+  uint8_t bytes[maxLineSize]; // The byte at its place in the line
+
+  bytes[offset] = value;
+  if (cacheQueueStore(cache, tag, bytes, bit)) {
+    return true;
+  }
+  if (0 != cache->storeBufferSize) {
+    cache->counters.bufferFull++;
+  }
+
+  cacheUpdateQueued(cache, tag, bytes, bit);
+  cacheTakeMemory(cache);
+  cache->prefetchValid = false;
+  cache->flushData[0] = value;
+  cache->flushWritten[0] = true;
+  cacheNextStore(m, address, 1, cache->flushData, cache->flushWritten, donePtr);
+  return false;
+}
+
+// Write a stored byte into its line, and with write-through on to memory
+// as well. Tells the cpu when the store is done.
+static void cacheFinishStore(struct machine *m, struct cacheLine *line, unsigned address,
+                             uint8_t value, bool *donePtr) {
+  struct cacheContext *cache = m->cache;
+
+  cacheWriteByte(cache, line, address, value, !cache->writeThrough);
+  if (!cache->writeThrough || cacheWriteAround(m, address, value, donePtr)) {
+    *donePtr = true; // Tell the CPU the copy is done
+  }
+}
+
+// Move a replaced line's written bytes into the store buffer, so the miss
+// need not wait for them to be stored. Returns false if there is no room.
+static bool cacheQueueLine(struct cacheContext *cache, struct cacheLine *line) {
+  if (cacheQueueStore(cache, line->tag, cache->data + ((line - cache->lines) << cache->lineBits), line->dirty)) {
+    return true;
+  }
+  if (0 != cache->storeBufferSize) {
+    cache->counters.bufferFull++;
+  }
+  return false;
+}
+
+// Start storing a line's written bytes to memory
+static void cacheStartFlush(struct machine *m, struct cacheLine *line) {
+  struct cacheContext *cache = m->cache;
+
+  // Memory takes the store in place of a prefetch or the store buffer,
+  // and the prefetch buffer may hold the bytes being stored as they were
+  cacheTakeMemory(cache);
+  cache->prefetchValid = false;
+
+  cache->pendingLine = line - cache->lines;
+  cacheUpdateQueued(cache, line->tag, cache->data + (cache->pendingLine << cache->lineBits), line->dirty);
+  memcpy(cache->flushData, cache->data + (cache->pendingLine << cache->lineBits), cache->lineSize);
+  for (unsigned i = 0; i < cache->lineSize; i++) {
+    cache->flushWritten[i] = (line->dirty >> i) & 1;
+  }
+  cacheNextStore(m, line->tag << cache->lineBits, cache->lineSize, cache->flushData,
+                 cache->flushWritten, &cache->cacheStoreDone);
+}
+
+// Start fetching address's line into the pending line: straight from
+// the prefetch buffer if it holds the line, when the prefetch arrives if
+// it is in flight, or otherwise from memory, dropping any other prefetch
+static void cacheStartFill(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  unsigned tag = cache->cacheAddress >> cache->lineBits; // The line to fetch
+
+  cache->request = FILL;
+  if (cache->prefetchValid && tag == cache->prefetchTag) {
+    cache->counters.prefetchHits++;
+    memcpy(cache->fetchData, cache->prefetchData, cache->lineSize);
+    cache->prefetchValid = false;
+    cache->cacheFetchDone = true;
+  }
+  else if (cache->prefetchBusy && tag == cache->prefetchTag) {
+    cache->counters.prefetchHits++;
+    cache->prefetchJoined = true;
+  }
+  else {
+    cacheTakeMemory(cache);
+    cacheNextFetch(m, tag << cache->lineBits, cache->lineSize, cache->fetchData, &cache->cacheFetchDone);
+  }
+}
+
+// Learn from the line of a load miss what line to prefetch next
+static void cachePrefetchTrain(struct cacheContext *cache, unsigned tag) {
+  int stride = (int)(tag - cache->lastMissTag); // Lines since the last miss
+
+  if (PREFETCH_NEXT == cache->prefetchMode) {
+    cache->prefetchNext = tag + 1;
+    cache->prefetchPredicted = true;
+  }
+  // A stride is trusted once two misses in a row have moved by it
+  else if (PREFETCH_STRIDE == cache->prefetchMode) {
+    cache->prefetchNext = tag + stride;
+    cache->prefetchPredicted = (0 != stride && stride == cache->lastStride);
+  }
+  cache->lastStride = stride;
+  cache->lastMissTag = tag;
+  cache->version++;
+}
+
+// Start fetching the predicted line into the prefetch buffer, unless it
+// is already at hand, has stores waiting in the store buffer, lies outside
+// the address space, or memory could be taken by the io device before the
+// prefetch arrives
+static void cachePrefetchIssue(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  unsigned tag = cache->prefetchNext; // The line to prefetch
+
+  if (!cache->prefetchPredicted || cache->prefetchBusy || !cacheNextIdle(m) ||
+      (cache->prefetchValid && tag == cache->prefetchTag) ||
+      tag > (cache->specialAddress >> cache->lineBits) ||
+      NULL != cacheLookup(cache, tag << cache->lineBits) || cacheIsQueued(cache, tag) ||
+      iodevTicksToNextEvent(m) <= cacheNextLatency(m)) {
+    return;
+  }
+
+  cache->counters.prefetches++;
+  cache->prefetchTag = tag;
+  cache->prefetchValid = false;
+  cache->prefetchBusy = true;
+  cache->prefetchJoined = false;
+  cache->version++;
+  cacheNextFetch(m, tag << cache->lineBits, cache->lineSize, cache->prefetchData, &cache->prefetchDone);
+}
+
+// Store the next of the store buffer's entries, or else the next line with
+// written bytes, and last the L2's written lines, for a flush of the whole cache. Tells the cpu when
+// nothing is left to store.
+static void cacheFlushNext(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  struct cacheLine *line = cacheFindWritten(cache); // The next line to flush
+
+  if (0 != cache->storeCount) {
+    if (!cache->drainBusy) {
+      cacheStartDrain(m);
+    }
+  }
+  else if (NULL != line) {
+    cacheStartFlush(m, line);
+  }
+  // Then the L2's written lines go to memory
+  else if (cache->next->isOn && NULL != cacheFindWritten(cache->next)) {
+    cache->request = NO_REQUEST;
+    cacheTakeMemory(cache);
+    levelStart(m, LEVEL_FLUSH_ALL, 0, 0, NULL, NULL, cache->cacheDonePtr);
+  }
+  else {
+    cache->request = NO_REQUEST;
+    *cache->cacheDonePtr = true; // Tell the CPU the copy is done
+  }
+}
+
+// Start fetching the line a load missed on into line, the line already
+// holding some of its bytes, or else into a replaced line, storing the
+// replaced line's written bytes first unless the store buffer takes them
+static void cacheStartMiss(struct machine *m, struct cacheLine *line, unsigned address, uint8_t *dataPtr,
+                           bool *donePtr) {
+  struct cacheContext *cache = m->cache;
+
+  // Store the arguments
+  cache->cacheAddress = address;
+  cache->cacheAnswerPtr = dataPtr;
+  cache->cacheDonePtr = donePtr;
+
+  if (NULL != line) {
+    cache->pendingLine = line - cache->lines;
+    cacheStartFill(m);
+    return;
+  }
+  line = cacheVictim(cache, address);
+  cache->pendingLine = line - cache->lines;
+  if (0 != line->dirty) {
+    cache->counters.writeBacks++;
+  }
+  if (0 != line->dirty && !cacheQueueLine(cache, line)) {
+    cache->request = FLUSH_THEN_FILL;
+    cacheStartFlush(m, line);
+  }
+  else {
+    cacheRetire(m, line);
+    cacheAllocate(cache, line, address);
+    cacheStartFill(m);
+  }
+}
+
+// Start fetching the oldest MSHR's line, its first load answered as a
+// blocking load miss is
+static void cacheMshrService(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  struct mshr *entry = &cache->mshrs[0]; // The oldest MSHR
+
+  cache->mshrActive = true;
+  cacheStartMiss(m, cacheLookup(cache, entry->addresses[0]), entry->addresses[0], entry->answerPtrs[0],
+                 entry->donePtrs[0]);
+}
+
+// Answer the rest of the oldest MSHR's loads from the line just filled,
+// free the MSHR and start on the next one once the cache's request is done
+static void cacheMshrFinish(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  struct mshr *entry = &cache->mshrs[0]; // The MSHR whose line was filled
+  uint8_t *data = cache->data + (cache->pendingLine << cache->lineBits); // The line's bytes
+
+  if (cache->mshrActive) {
+    for (unsigned i = 1; i < entry->targetCount; i++) {
+      *entry->answerPtrs[i] = data[entry->addresses[i] & (cache->lineSize - 1)];
+      *entry->donePtrs[i] = true;
+    }
+    cache->mshrCount--;
+    memmove(cache->mshrs, cache->mshrs + 1, cache->mshrCount * sizeof(struct mshr));
+    cache->mshrActive = false;
+    cache->version++;
+  }
+  if (0 != cache->mshrCount && NO_REQUEST == cache->request) {
+    cacheMshrService(m);
+  }
+}
+
+// Alert cache of a tick
+void cacheStartTick(struct machine *m) {
+    struct cacheContext *cache = m->cache;
+    // Let the L2 answer first, as the cache may be waiting on it
+    levelDoWork(m);
+
+    // Check and see if memory is done with the prefetch, unless it was dropped
+    if(cache->prefetchDone) {
+        cache->prefetchDone = false;
+        if(cache->prefetchBusy) {
+            cache->prefetchBusy = false;
+            cache->prefetchValid = true;
+            cache->version++;
+
+            // Hand the line to a load miss waiting for it
+            if(cache->prefetchJoined) {
+                cache->prefetchJoined = false;
+                memcpy(cache->fetchData, cache->prefetchData, cache->lineSize);
+                cache->prefetchValid = false;
+                cache->cacheFetchDone = true;
+            }
+        }
+    }
+
+    // Check and see if memory is done storing the store buffer's oldest entry, unless it was dropped
+    if(cache->drainDone) {
+        cache->drainDone = false;
+        if(cache->drainBusy) {
+            cache->drainBusy = false;
+            cache->storeCount--;
+            memmove(cache->storeBuffer, cache->storeBuffer + 1, cache->storeCount * sizeof(struct storeEntry));
+            cache->version++;
 
-// Utility method that handles writing a byte on a cache miss
-void onCacheMissWriteByte(unsigned address, uint8_t *dataPtr,
-                   bool *donePtr) {
-    // Clear data flags
-    for(int i=0; i<cacheSize;i++) {
-        cacheFlags[i] = INVALID;
-        cacheDataWritten[i] = false;
+            // A flush of the whole cache goes on with the next entry or line
+            if(FLUSH_ALL == cache->request) {
+                cacheFlushNext(m);
+            }
+        }
     }
 
-    // Update the CLO
-    clo = address>>3;
-                
-    // Write the byte to cache
-    cacheData[address & 7] = *dataPtr; // Utilizes bitwise equivalent to "mod 8"
-    cacheFlags[address & 7] = WRITTEN; // Mark the value as written
-    cacheDataWritten[address & 7] = true; // Mark the value as written
-    *donePtr = true; // Tell the CPU the copy is done  
-}
-
-// Alert cache of a tick
-void cacheStartTick() {
     // check and see if memory is done with the fetch
-    if(cacheFetchDone) {
-        // Traverse the temp array and populate cacheData
-        for(int i=0; i<cacheSize; i++){
-            // If the data is not written, update it
-            if(cacheFlags[i] != WRITTEN) {
-                cacheData[i] = fetchData[i];
-                cacheFlags[i] = VALID;
+    if(cache->cacheFetchDone) {
+        struct cacheLine *line = &cache->lines[cache->pendingLine]; // The line being filled
+        uint8_t *data = cache->data + (cache->pendingLine << cache->lineBits); // The line's bytes
+
+        // Memory does not hold the stores still in the store buffer yet
+        cacheForwardQueued(cache, line->tag, cache->fetchData);
+
+        // Take memory's data for every byte that is not written
+        for(unsigned i=0; i<cache->lineSize; i++){
+            if(!((line->dirty >> i) & 1)) {
+                data[i] = cache->fetchData[i];
             }
         }
+        line->valid = lineMask(cache);
+        cache->version++;
 
         // Finish the lw command
-        *cacheAnswerPtr = cacheData[cacheAddress & 7]; // Utilizes bitwise equivalent to "mod 8"
-        *cacheDonePtr = true; // Tell the CPU the copy is done
-        cacheFetchDone = false;
+        *cache->cacheAnswerPtr = data[cache->cacheAddress & (cache->lineSize - 1)];
+        *cache->cacheDonePtr = true; // Tell the CPU the copy is done
+        cache->cacheFetchDone = false;
+        cache->request = NO_REQUEST;
+
+        // Non-blocking loads waiting for the line take it, and the next MSHR's line is fetched
+        cacheMshrFinish(m);
+
+        // Fetch the line the next miss is predicted for while the cpu runs on
+        if(NO_REQUEST == cache->request) {
+            cachePrefetchIssue(m);
+        }
     }
 
     // Check and see if memory is done with the store
-    if(cacheStoreDone) {
-        // Special Case: address = 0xFF, mark all written data as valid
-        if(cacheAddress == 0xFF) {
-            for(int i=0; i<cacheSize; i++){
-                // Determine if the data was written
-                if(cacheDataWritten[i]) {
-                    cacheDataWritten[i] = false; // Mark it as false
-                    cacheFlags[i] = VALID; // If so, mark it as valid now
-                }
-            }
-            *cacheDonePtr = true; // Tell the CPU the copy is done
+    if(cache->cacheStoreDone) {
+        // The flushed line's written data is now memory's, so it is valid
+        cache->lines[cache->pendingLine].dirty = 0;
+        cache->version++;
+        cache->cacheStoreDone = false; // Reset the cacheStoreDone variable
+
+        // Special Case: address = 0xFF (0xFFFF in wide mode), flush the next line with written data
+        if(FLUSH_ALL == cache->request) {
+            cacheFlushNext(m);
         }
-        // In a normal cacheMiss case
+        // A load miss fetches its line once the line it replaces is stored
+        else if(FLUSH_THEN_FILL == cache->request) {
+            cacheRetire(m, &cache->lines[cache->pendingLine]);
+            cacheAllocate(cache, &cache->lines[cache->pendingLine], cache->cacheAddress);
+            cacheStartFill(m);
+        }
+        // In a normal store miss case
         else {
-        onCacheMissWriteByte(cacheAddress, writeData, cacheDonePtr);
+            struct cacheLine *line = &cache->lines[cache->pendingLine]; // The line replaced
+            cacheRetire(m, line);
+            cacheAllocate(cache, line, cache->cacheAddress);
+            cache->request = NO_REQUEST;
+            cacheFinishStore(m, line, cache->cacheAddress, *cache->writeData, cache->cacheDonePtr);
         }
+    }
 
-        cacheStoreDone = false; // Reset the cacheStoreDone variable
+    // Store the store buffer's oldest entry while memory has nothing else to do
+    if(cacheCanDrain(m)) {
+        cacheStartDrain(m);
     }
-  
 }
 
 // Check and see if the cache has more work to do in this cycle
-bool cacheIsMoreCycleWorkNeeded() {
-  return cacheFetchDone || cacheStoreDone;
-}
-
-// Determine if there is any valid data in the cache
-static bool anyValid() {
-    bool valid = false;
-    
-    // Traverse the flag array and find any VALID or WRITTEN
-    for( int i = 0; i < cacheSize; i++) {
-        if(cacheFlags[i] == VALID || cacheFlags[i] == WRITTEN) {
-            valid = true;
-        }
-    }
-    return valid;
+bool cacheIsMoreCycleWorkNeeded(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  return cache->cacheFetchDone || cache->cacheStoreDone || cache->prefetchDone || cache->drainDone ||
+         cache->next->cacheFetchDone || cache->next->cacheStoreDone;
 }
 
-// Determine if there is any written data in the cache
-static bool anyWritten() {
-    bool written = false;
-    
-    // Traverse the flag array and find any WRITTEN
-    for( int i = 0; i < cacheSize; i++) {
-        if(cacheFlags[i] == WRITTEN) {
-            written = true;
-        }
-    }
-    return written;
+// Get the number of ticks until the cache next has work to do, counting
+// the tick it happens on: 1 when memory has answered it or the store
+// buffer can start a store, the ticks left when the L2 is looking a
+// request up, otherwise UINT_MAX
+unsigned cacheTicksToNextEvent(struct machine *m) {
+  struct cacheContext *l2 = m->cache->next;
+  if (cacheIsMoreCycleWorkNeeded(m) || cacheCanDrain(m)) {
+    return 1;
+  }
+  if (LEVEL_LOOKUP == l2->levelState) {
+    return l2->levelTicks > 0 ? l2->levelTicks : 1;
+  }
+  return UINT_MAX;
 }
 
+// Alert the L2 of a tick, which counts down its latency
+void l2StartTick(struct machine *m) {
+  struct cacheContext *l2 = m->cache->next;
+  if (LEVEL_LOOKUP == l2->levelState && l2->levelTicks > 0) {
+    l2->levelTicks--;
+  }
+}
+
+// Account for ticks on which the L2 only counts down its latency
+void l2SkipTicks(struct machine *m, unsigned ticks) {
+  struct cacheContext *l2 = m->cache->next;
+  if (LEVEL_LOOKUP == l2->levelState) {
+    l2->levelTicks = (ticks < l2->levelTicks) ? l2->levelTicks - ticks : 0;
+  }
+}
 
 
 // Start a cache fetch at the given address
@@ -182,110 +1354,921 @@ static bool anyWritten() {
 // dataPtr – a pointer where data should be placed
 // memDonePtr – a pointer to a boolean that the Cache Device will set to true when
 // the data transfer has completed (possibly multiple cycles after request)
-void cacheStartFetch(unsigned address, uint8_t *dataPtr,
+void cacheStartFetch(struct machine *m, unsigned address, uint8_t *dataPtr,
                    bool *donePtr) {
+    struct cacheContext *cache = m->cache;
     // If the cache is off, fetch the single byte
-    if(!isOn) {
-        memStartFetch(address, 1, dataPtr, donePtr);
+    if(!cache->isOn) {
+        cacheTakeMemory(cache);
+        cacheNextFetch(m, address, 1, dataPtr, donePtr);
     } else {
-        // Special Case: if the address is 0xFF, force the data to be invalid
-        if(address == 0xFF) {
-            forceInvalid();
+        // Special Case: if the address is 0xFF (0xFFFF in wide mode), force the data to be invalid
+        if(address == cache->specialAddress) {
+            cache->counters.invalidates++;
+            cacheInvalidateAll(cache);
+            if(cache->next->isOn) {
+                cacheInvalidateAll(cache->next);
+            }
+            cache->prefetchValid = false;
             *dataPtr = 0; // Return 0
             *donePtr = true; // Tell the CPU the copy is done
-        } 
+        }
         // Otherwise perform a standard fetch
         else {
+            struct cacheLine *line = cacheLookup(cache, address); // The line holding address
+            uint64_t bit = (uint64_t)1 << (address & (cache->lineSize - 1)); // The byte's flag bit
 
-            // Calculate the cash line
-            int cashLine = address>>3;
-            
             // Determine if the byte is in cache aka "cache hit"
-            // (if the clo matches the computed offset of the address and there is valid data)
-            if(clo == cashLine && anyValid()) {
+            if(NULL != line && (line->valid & bit)) {
+                cache->counters.readHits++;
+                if (LRU == cache->policy && cachePromote(cache, line)) {
+                    cache->version++;
+                }
+
                 // Finish the lw command
-                *dataPtr = cacheData[address & 7]; // Utilizes bitwise equivalent to "mod 8"
+                *dataPtr = cache->data[((line - cache->lines) << cache->lineBits) + (address & (cache->lineSize - 1))];
                 *donePtr = true; // Tell the CPU the copy is done
             }
             else {
-                // Store the arguments
-                cacheAddress = address;
-                cacheAnswerPtr = dataPtr;
-                cacheDonePtr = donePtr;     
-
-                // Get the address based on the cash line
-                unsigned newAddress = cashLine<<3; 
-
-                // initiate a memStartFetch for all 8 bytes starting at the new CLO
-                // Put it in a temporary array
-                memStartFetch(newAddress, cacheSize, fetchData, &cacheFetchDone);
+                cache->counters.readMisses++;
+                if (PREFETCH_OFF != cache->prefetchMode) {
+                    cachePrefetchTrain(cache, address >> cache->lineBits);
+                }
+                cacheStartMiss(m, line, address, dataPtr, donePtr);
             }
         }
     }
 }
 
-// Start a memory store at the given address 
+// Check if loads go through the cache's MSHRs rather than blocking the cpu
+bool cacheNonBlocking(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  return cache->isOn && 0 != cache->mshrSize;
+}
+
+// Check if a non-blocking load of the address can start now: it hits, or
+// an MSHR can take it. The special address waits for every MSHR.
+bool cacheCanStartLoad(struct machine *m, unsigned address) {
+  struct cacheContext *cache = m->cache;
+  struct cacheLine *line; // The line holding address
+  unsigned tag = address >> cache->lineBits; // The line's number in memory
+
+  if (address == cache->specialAddress) {
+    return 0 == cache->mshrCount;
+  }
+  line = cacheLookup(cache, address);
+  if (NULL != line && ((line->valid >> (address & (cache->lineSize - 1))) & 1)) {
+    return true;
+  }
+  for (unsigned i = 0; i < cache->mshrCount; i++) {
+    if (tag == cache->mshrs[i].tag) {
+      return cache->mshrs[i].targetCount < maxMshrTargets;
+    }
+  }
+  return cache->mshrCount < cache->mshrSize;
+}
+
+// Start a non-blocking load that cacheCanStartLoad allows. A miss joins
+// the MSHR for its line, or takes a new one, and is answered when the line
+// is filled; the lines are filled one at a time, oldest MSHR first.
+void cacheStartLoad(struct machine *m, unsigned address, uint8_t *dataPtr, bool *donePtr) {
+  struct cacheContext *cache = m->cache;
+  struct cacheLine *line = cacheLookup(cache, address); // The line holding address
+  unsigned tag = address >> cache->lineBits; // The line's number in memory
+  struct mshr *entry; // The MSHR the miss joins
+
+  if (address == cache->specialAddress ||
+      (NULL != line && ((line->valid >> (address & (cache->lineSize - 1))) & 1))) {
+    cacheStartFetch(m, address, dataPtr, donePtr);
+    return;
+  }
+
+  cache->counters.readMisses++;
+  for (unsigned i = 0; i < cache->mshrCount; i++) {
+    entry = &cache->mshrs[i];
+    if (tag == entry->tag) {
+      cache->counters.mshrMerges++;
+      entry->addresses[entry->targetCount] = address;
+      entry->answerPtrs[entry->targetCount] = dataPtr;
+      entry->donePtrs[entry->targetCount] = donePtr;
+      entry->targetCount++;
+      cache->version++;
+      return;
+    }
+  }
+
+  if (PREFETCH_OFF != cache->prefetchMode) {
+    cachePrefetchTrain(cache, tag);
+  }
+  entry = &cache->mshrs[cache->mshrCount++];
+  entry->tag = tag;
+  entry->targetCount = 1;
+  entry->addresses[0] = address;
+  entry->answerPtrs[0] = dataPtr;
+  entry->donePtrs[0] = donePtr;
+  cache->version++;
+  if (!cache->mshrActive && NO_REQUEST == cache->request) {
+    cacheMshrService(m);
+  }
+}
+
+// Start a memory store at the given address
 // address – the offset in memory where the write should begin
 // count – the number of bytes that should be written
 // dataPtr – a pointer that is the source of data to write
 // memDonePtr – a pointer to a boolean that the Memory Device will set to true when
-void cacheStartStore(unsigned address, uint8_t *dataPtr,
+void cacheStartStore(struct machine *m, unsigned address, uint8_t *dataPtr,
                    bool *donePtr) {
+    struct cacheContext *cache = m->cache;
     // If the cache is off, store the single byte
-    if(isOn == false) {
-        cacheDataWritten[address & 7] = true; 
-        memStartStore(address, 1, dataPtr, cacheDataWritten, donePtr);
-    } else { 
-        // Special Case: if the address is 0xFF, perform a cache flush
-        if(address == 0xFF) {
-            // Determine if any data needs to be written to memory
-            if(anyWritten()) {
-                // Store the arguments
-                cacheAddress = address;
-                cacheDonePtr = donePtr; 
-
-                // Flush the cache to memory
-                memStartStore(clo<<3, cacheSize, cacheData, cacheDataWritten, &cacheStoreDone);
-            }
-        } 
+    if(cache->isOn == false) {
+        cacheTakeMemory(cache);
+        cache->flushWritten[0] = true;
+        cacheNextStore(m, address, 1, dataPtr, cache->flushWritten, donePtr);
+    } else {
+        // Special Case: if the address is 0xFF (0xFFFF in wide mode), perform a cache flush
+        if(address == cache->specialAddress) {
+            cache->counters.flushes++;
+
+            // Store the arguments
+            cache->cacheAddress = address;
+            cache->cacheDonePtr = donePtr;
+            cache->request = FLUSH_ALL;
+
+            // Empty the store buffer, then flush the cache to memory a line at a time
+            cacheFlushNext(m);
+        }
         // Otherwise perform a standard store
         else {
-            // Calculate the cash line
-            int cashLine = address>>3;
-            
+            struct cacheLine *line = cacheLookup(cache, address); // The line holding address
+
             // Determine if the address is in cache aka "cache hit"
-            // (if the clo matches the computed offset of the address)
-            if(clo == cashLine) {
+            if(NULL != line) {
+                cache->counters.writeHits++;
+                if (LRU == cache->policy && cachePromote(cache, line)) {
+                    cache->version++;
+                }
+
                 // Write the value to cache
-                cacheData[address & 7] = *dataPtr; // Utilizes bitwise equivalent to "mod 8"
-                cacheFlags[address & 7] = WRITTEN; // Mark the value as written 
-                cacheDataWritten[address & 7] = true; // Mark the value as written
-                *donePtr = true; // Tell the CPU the copy is done
+                cacheFinishStore(m, line, address, *dataPtr, donePtr);
+            }
+
+            // On a miss without write-allocate, the byte goes to memory alone
+            else if(cache->noAllocate) {
+                cache->counters.writeMisses++;
+                if(cacheWriteAround(m, address, *dataPtr, donePtr)) {
+                    *donePtr = true; // Tell the CPU the copy is done
+                }
             }
 
             // On cache miss
             else {
+                cache->counters.writeMisses++;
+                line = cacheVictim(cache, address);
+                if(0 != line->dirty) {
+                    cache->counters.writeBacks++;
+                }
 
-                // Determine if any data in cache as been written to
-                if(anyWritten()) {
+                // Determine if the line replaced has written data the store buffer cannot take
+                if(0 != line->dirty && !cacheQueueLine(cache, line)) {
                     // Store the arguments
-                    cacheAddress = address;
-                    writeData = dataPtr;
-                    cacheDonePtr = donePtr; 
+                    cache->cacheAddress = address;
+                    cache->writeData = dataPtr;
+                    cache->cacheDonePtr = donePtr;
+                    cache->request = FLUSH_THEN_WRITE;
 
-                    // Flush the cache to memory
-                    memStartStore(clo<<3, cacheSize, cacheData, cacheDataWritten, &cacheStoreDone);
+                    // Flush the line to memory
+                    cacheStartFlush(m, line);
                 } else {
-                    onCacheMissWriteByte(address, dataPtr, donePtr); 
-                }      
+                    // Take the line without fetching it, only the byte written is valid
+                    cacheRetire(m, line);
+                    cacheAllocate(cache, line, address);
+                    cacheFinishStore(m, line, address, *dataPtr, donePtr);
+                }
             }
         }
-    }               
+    }
+}
+
+// Check if instructions are fetched through the I-cache and imemory
+// rather than read for free: the I-cache is on, or imemory has a latency
+bool icacheFetchPathOn(struct machine *m) {
+  struct cacheContext *icache = m->cache->instr;
+  return icache->isOn || iMemFetchLatency(m) > 0;
+}
+
+// Mark the line imemory has fetched valid and tell the cpu its
+// instruction has arrived
+static void icacheFinishFill(struct cacheContext *icache) {
+  icache->lines[icache->pendingLine].valid = lineMask(icache);
+  icache->request = NO_REQUEST;
+  icache->cacheFetchDone = false;
+  icache->version++;
+  *icache->cacheDonePtr = true;
+}
+
+// Start fetching the instruction at address for the cpu, setting *donePtr
+// when it has arrived. With the I-cache off every fetch goes to imemory;
+// with it on a hit arrives at once, and a miss fetches the whole line.
+void icacheStartFetch(struct machine *m, unsigned address, bool *donePtr) {
+  struct cacheContext *icache = m->cache->instr;
+  struct cacheLine *line; // The line holding the instruction
+
+  if (!icache->isOn) {
+    iMemStartFetch(m, donePtr);
+    return;
+  }
+
+  line = cacheLookup(icache, address);
+  if (NULL != line) {
+    icache->counters.readHits++;
+    if (cachePromote(icache, line)) {
+      icache->version++;
+    }
+    *donePtr = true;
+    return;
+  }
+
+  // Take the line and fetch it from imemory
+  icache->counters.readMisses++;
+  line = cacheVictim(icache, address);
+  cacheAllocate(icache, line, address);
+  icache->pendingLine = line - icache->lines;
+  icache->cacheDonePtr = donePtr;
+  icache->cacheFetchDone = false;
+  icache->request = FILL;
+  iMemStartFetch(m, &icache->cacheFetchDone);
+
+  // A fetch that takes no time is done already
+  if (icache->cacheFetchDone) {
+    icacheFinishFill(icache);
+  }
+}
+
+// Alert the I-cache of a tick, after imemory has counted down its fetch
+void icacheStartTick(struct machine *m) {
+  struct cacheContext *icache = m->cache->instr;
+  if (FILL == icache->request && icache->cacheFetchDone) {
+    icacheFinishFill(icache);
+  }
+}
+
+// Move the special flush and invalidate address to the top of the 8 bit
+// or, in wide mode, the 16 bit address space
+void cacheSetWide(struct machine *m, bool wide) {
+  struct cacheContext *cache = m->cache;
+  cache->specialAddress = wide ? 0xFFFF : 0xFF;
+}
+
+// Copy the state that decides what the cache does next into buf, so the
+// clock can spot the machine repeating itself. The lines are represented
+// by their version, which changes whenever they do. Returns the bytes copied.
+unsigned cacheFingerprint(struct machine *m, uint8_t *buf) {
+  struct cacheContext *cache = m->cache;
+  unsigned n = 0; // Bytes copied
+  buf[n++] = cache->isOn;
+  memcpy(buf + n, &cache->version, sizeof(cache->version)); n += sizeof(cache->version);
+  buf[n++] = cache->next->isOn;
+  memcpy(buf + n, &cache->next->version, sizeof(cache->next->version)); n += sizeof(cache->next->version);
+  buf[n++] = cache->instr->isOn;
+  memcpy(buf + n, &cache->instr->version, sizeof(cache->instr->version)); n += sizeof(cache->instr->version);
+  return n;
+}
+
+// List the fields of the cache and the L2 that memory answers into, and
+// the I-cache's that imemory does
+unsigned cacheSnapFields(struct machine *m, struct snapField *fields) {
+  struct cacheContext *cache = m->cache;
+  struct cacheContext *l2 = cache->next;
+  fields[0] = (struct snapField){cache->flushData, sizeof(cache->flushData)};
+  fields[1] = (struct snapField){cache->fetchData, sizeof(cache->fetchData)};
+  fields[2] = (struct snapField){cache->flushWritten, sizeof(cache->flushWritten)};
+  fields[3] = (struct snapField){&cache->cacheFetchDone, sizeof(cache->cacheFetchDone)};
+  fields[4] = (struct snapField){&cache->cacheStoreDone, sizeof(cache->cacheStoreDone)};
+  fields[5] = (struct snapField){cache->prefetchData, sizeof(cache->prefetchData)};
+  fields[6] = (struct snapField){&cache->prefetchDone, sizeof(cache->prefetchDone)};
+  fields[7] = (struct snapField){&cache->drainDone, sizeof(cache->drainDone)};
+  fields[8] = (struct snapField){l2->flushData, sizeof(l2->flushData)};
+  fields[9] = (struct snapField){l2->fetchData, sizeof(l2->fetchData)};
+  fields[10] = (struct snapField){l2->flushWritten, sizeof(l2->flushWritten)};
+  fields[11] = (struct snapField){&l2->cacheFetchDone, sizeof(l2->cacheFetchDone)};
+  fields[12] = (struct snapField){&l2->cacheStoreDone, sizeof(l2->cacheStoreDone)};
+  fields[13] = (struct snapField){&cache->instr->cacheFetchDone, sizeof(cache->instr->cacheFetchDone)};
+  return 14;
+}
+
+// Write a cache's shape, lines and their bytes to a snapshot
+static void cacheSaveLines(FILE *f, struct cacheContext *cache) {
+  snapWrite(f, &cache->sets, sizeof(cache->sets));
+  snapWrite(f, &cache->ways, sizeof(cache->ways));
+  snapWrite(f, &cache->lineSize, sizeof(cache->lineSize));
+  snapWrite(f, &cache->policy, sizeof(cache->policy));
+  snapWrite(f, &cache->isOn, sizeof(cache->isOn));
+  snapWrite(f, &cache->randomState, sizeof(cache->randomState));
+  snapWrite(f, cache->lines, cache->sets * cache->ways * sizeof(struct cacheLine));
+  snapWrite(f, cache->data, cache->sets * cache->ways * cache->lineSize);
+}
+
+// Set a cache's shape, lines and their bytes from a snapshot. Returns
+// false, leaving the cache as it was, if the shape is not one a config
+// command would have accepted.
+static bool cacheRestoreLines(struct snapReader *r, struct cacheContext *cache) {
+  unsigned sets = 0, ways = 0, lineSize = 0; // The saved shape
+  enum cachePolicies policy = LRU; // The saved policy
+
+  snapRead(r, &sets, sizeof(sets));
+  snapRead(r, &ways, sizeof(ways));
+  snapRead(r, &lineSize, sizeof(lineSize));
+  snapRead(r, &policy, sizeof(policy));
+
+  if (!cacheShapeValid(sets, ways, lineSize) || policy > RANDOM) {
+    r->bad = true;
+    return false;
+  }
+  if (sets != cache->sets || ways != cache->ways || lineSize != cache->lineSize) {
+    cacheConfigure(cache, sets, ways, lineSize, policy);
+  }
+  cache->policy = policy;
+
+  snapRead(r, &cache->isOn, sizeof(cache->isOn));
+  snapRead(r, &cache->randomState, sizeof(cache->randomState));
+  snapRead(r, cache->lines, cache->sets * cache->ways * sizeof(struct cacheLine));
+  snapRead(r, cache->data, cache->sets * cache->ways * cache->lineSize);
+  return true;
+}
+
+// Write the L2's shape, lines and request in progress to a snapshot
+static void levelSave(struct machine *m, FILE *f) {
+  struct cacheContext *l2 = m->cache->next;
+  cacheSaveLines(f, l2);
+  snapWrite(f, &l2->latency, sizeof(l2->latency));
+  snapWrite(f, &l2->exclusive, sizeof(l2->exclusive));
+  snapWrite(f, l2->fetchData, sizeof(l2->fetchData));
+  snapWrite(f, l2->flushData, sizeof(l2->flushData));
+  snapWrite(f, l2->flushWritten, sizeof(l2->flushWritten));
+  snapWrite(f, &l2->cacheFetchDone, sizeof(l2->cacheFetchDone));
+  snapWrite(f, &l2->cacheStoreDone, sizeof(l2->cacheStoreDone));
+  snapWrite(f, &l2->pendingLine, sizeof(l2->pendingLine));
+  snapWrite(f, &l2->levelState, sizeof(l2->levelState));
+  snapWrite(f, &l2->levelRequest, sizeof(l2->levelRequest));
+  snapWrite(f, &l2->levelTicks, sizeof(l2->levelTicks));
+  snapWrite(f, &l2->levelAddress, sizeof(l2->levelAddress));
+  snapWrite(f, &l2->levelCount, sizeof(l2->levelCount));
+  snapWritePointer(m, f, l2->levelData);
+  snapWritePointer(m, f, l2->levelWritten);
+  snapWritePointer(m, f, l2->levelDonePtr);
+  snapWrite(f, &l2->counters, sizeof(l2->counters));
+}
+
+// Set the L2's shape, lines and request in progress from a snapshot
+static void levelRestore(struct machine *m, struct snapReader *r) {
+  struct cacheContext *l2 = m->cache->next;
+
+  if (!cacheRestoreLines(r, l2)) {
+    return;
+  }
+  snapRead(r, &l2->latency, sizeof(l2->latency));
+  snapRead(r, &l2->exclusive, sizeof(l2->exclusive));
+  snapRead(r, l2->fetchData, sizeof(l2->fetchData));
+  snapRead(r, l2->flushData, sizeof(l2->flushData));
+  snapRead(r, l2->flushWritten, sizeof(l2->flushWritten));
+  snapRead(r, &l2->cacheFetchDone, sizeof(l2->cacheFetchDone));
+  snapRead(r, &l2->cacheStoreDone, sizeof(l2->cacheStoreDone));
+  snapRead(r, &l2->pendingLine, sizeof(l2->pendingLine));
+  snapRead(r, &l2->levelState, sizeof(l2->levelState));
+  snapRead(r, &l2->levelRequest, sizeof(l2->levelRequest));
+  snapRead(r, &l2->levelTicks, sizeof(l2->levelTicks));
+  snapRead(r, &l2->levelAddress, sizeof(l2->levelAddress));
+  snapRead(r, &l2->levelCount, sizeof(l2->levelCount));
+  l2->levelData = snapReadPointer(m, r);
+  l2->levelWritten = snapReadPointer(m, r);
+  l2->levelDonePtr = snapReadPointer(m, r);
+  snapRead(r, &l2->counters, sizeof(l2->counters));
+
+  if (l2->pendingLine >= l2->sets * l2->ways || l2->levelCount > l2->lineSize) {
+    l2->pendingLine = 0;
+    l2->levelState = LEVEL_IDLE;
+    r->bad = true;
+  }
+  l2->version++;
+}
+
+// Write the I-cache's shape, lines and fill in progress to a snapshot
+static void icacheSave(struct machine *m, FILE *f) {
+  struct cacheContext *icache = m->cache->instr;
+  cacheSaveLines(f, icache);
+  snapWrite(f, &icache->request, sizeof(icache->request));
+  snapWrite(f, &icache->pendingLine, sizeof(icache->pendingLine));
+  snapWrite(f, &icache->cacheFetchDone, sizeof(icache->cacheFetchDone));
+  snapWritePointer(m, f, icache->cacheDonePtr);
+  snapWrite(f, &icache->counters, sizeof(icache->counters));
+}
+
+// Set the I-cache's shape, lines and fill in progress from a snapshot
+static void icacheRestore(struct machine *m, struct snapReader *r) {
+  struct cacheContext *icache = m->cache->instr;
+
+  if (!cacheRestoreLines(r, icache)) {
+    return;
+  }
+  snapRead(r, &icache->request, sizeof(icache->request));
+  snapRead(r, &icache->pendingLine, sizeof(icache->pendingLine));
+  snapRead(r, &icache->cacheFetchDone, sizeof(icache->cacheFetchDone));
+  icache->cacheDonePtr = snapReadPointer(m, r);
+  snapRead(r, &icache->counters, sizeof(icache->counters));
+
+  if (icache->pendingLine >= icache->sets * icache->ways ||
+      (NO_REQUEST != icache->request && NULL == icache->cacheDonePtr)) {
+    icache->pendingLine = 0;
+    icache->request = NO_REQUEST;
+    r->bad = true;
+  }
+  icache->version++;
+}
+
+// Write the cache's shape, lines and request in progress, then the L2's and
+// the I-cache's, to a snapshot
+void cacheSave(struct machine *m, FILE *f) {
+  struct cacheContext *cache = m->cache;
+  cacheSaveLines(f, cache);
+  snapWrite(f, cache->fetchData, sizeof(cache->fetchData));
+  snapWrite(f, cache->flushData, sizeof(cache->flushData));
+  snapWrite(f, cache->flushWritten, sizeof(cache->flushWritten));
+  snapWrite(f, &cache->request, sizeof(cache->request));
+  snapWrite(f, &cache->pendingLine, sizeof(cache->pendingLine));
+  snapWrite(f, &cache->cacheAddress, sizeof(cache->cacheAddress));
+  snapWrite(f, &cache->cacheFetchDone, sizeof(cache->cacheFetchDone));
+  snapWrite(f, &cache->cacheStoreDone, sizeof(cache->cacheStoreDone));
+  snapWritePointer(m, f, cache->writeData);
+  snapWritePointer(m, f, cache->cacheAnswerPtr);
+  snapWritePointer(m, f, cache->cacheDonePtr);
+  snapWrite(f, &cache->counters, sizeof(cache->counters));
+  snapWrite(f, &cache->prefetchMode, sizeof(cache->prefetchMode));
+  snapWrite(f, cache->prefetchData, sizeof(cache->prefetchData));
+  snapWrite(f, &cache->prefetchTag, sizeof(cache->prefetchTag));
+  snapWrite(f, &cache->prefetchValid, sizeof(cache->prefetchValid));
+  snapWrite(f, &cache->prefetchBusy, sizeof(cache->prefetchBusy));
+  snapWrite(f, &cache->prefetchDone, sizeof(cache->prefetchDone));
+  snapWrite(f, &cache->prefetchJoined, sizeof(cache->prefetchJoined));
+  snapWrite(f, &cache->prefetchPredicted, sizeof(cache->prefetchPredicted));
+  snapWrite(f, &cache->prefetchNext, sizeof(cache->prefetchNext));
+  snapWrite(f, &cache->lastMissTag, sizeof(cache->lastMissTag));
+  snapWrite(f, &cache->lastStride, sizeof(cache->lastStride));
+  snapWrite(f, &cache->writeThrough, sizeof(cache->writeThrough));
+  snapWrite(f, &cache->noAllocate, sizeof(cache->noAllocate));
+  snapWrite(f, &cache->storeBufferSize, sizeof(cache->storeBufferSize));
+  snapWrite(f, &cache->storeCount, sizeof(cache->storeCount));
+  snapWrite(f, cache->storeBuffer, cache->storeCount * sizeof(struct storeEntry));
+  snapWrite(f, &cache->drainBusy, sizeof(cache->drainBusy));
+  snapWrite(f, &cache->drainDone, sizeof(cache->drainDone));
+  snapWrite(f, &cache->mshrSize, sizeof(cache->mshrSize));
+  snapWrite(f, &cache->mshrCount, sizeof(cache->mshrCount));
+  snapWrite(f, &cache->mshrActive, sizeof(cache->mshrActive));
+  for (unsigned i = 0; i < cache->mshrCount; i++) {
+    struct mshr *entry = &cache->mshrs[i]; // The MSHR written
+    snapWrite(f, &entry->tag, sizeof(entry->tag));
+    snapWrite(f, &entry->targetCount, sizeof(entry->targetCount));
+    for (unsigned j = 0; j < entry->targetCount; j++) {
+      snapWrite(f, &entry->addresses[j], sizeof(entry->addresses[j]));
+      snapWritePointer(m, f, entry->answerPtrs[j]);
+      snapWritePointer(m, f, entry->donePtrs[j]);
+    }
+  }
+  levelSave(m, f);
+  icacheSave(m, f);
+}
+
+// Set the cache's shape, lines and request in progress, then the L2's and
+// the I-cache's, from a snapshot
+void cacheRestore(struct machine *m, struct snapReader *r) {
+  struct cacheContext *cache = m->cache;
+
+  if (!cacheRestoreLines(r, cache)) {
+    return;
+  }
+  snapRead(r, cache->fetchData, sizeof(cache->fetchData));
+  snapRead(r, cache->flushData, sizeof(cache->flushData));
+  snapRead(r, cache->flushWritten, sizeof(cache->flushWritten));
+  snapRead(r, &cache->request, sizeof(cache->request));
+  snapRead(r, &cache->pendingLine, sizeof(cache->pendingLine));
+  snapRead(r, &cache->cacheAddress, sizeof(cache->cacheAddress));
+  snapRead(r, &cache->cacheFetchDone, sizeof(cache->cacheFetchDone));
+  snapRead(r, &cache->cacheStoreDone, sizeof(cache->cacheStoreDone));
+  cache->writeData = snapReadPointer(m, r);
+  cache->cacheAnswerPtr = snapReadPointer(m, r);
+  cache->cacheDonePtr = snapReadPointer(m, r);
+  snapRead(r, &cache->counters, sizeof(cache->counters));
+  snapRead(r, &cache->prefetchMode, sizeof(cache->prefetchMode));
+  snapRead(r, cache->prefetchData, sizeof(cache->prefetchData));
+  snapRead(r, &cache->prefetchTag, sizeof(cache->prefetchTag));
+  snapRead(r, &cache->prefetchValid, sizeof(cache->prefetchValid));
+  snapRead(r, &cache->prefetchBusy, sizeof(cache->prefetchBusy));
+  snapRead(r, &cache->prefetchDone, sizeof(cache->prefetchDone));
+  snapRead(r, &cache->prefetchJoined, sizeof(cache->prefetchJoined));
+  snapRead(r, &cache->prefetchPredicted, sizeof(cache->prefetchPredicted));
+  snapRead(r, &cache->prefetchNext, sizeof(cache->prefetchNext));
+  snapRead(r, &cache->lastMissTag, sizeof(cache->lastMissTag));
+  snapRead(r, &cache->lastStride, sizeof(cache->lastStride));
+  snapRead(r, &cache->writeThrough, sizeof(cache->writeThrough));
+  snapRead(r, &cache->noAllocate, sizeof(cache->noAllocate));
+  snapRead(r, &cache->storeBufferSize, sizeof(cache->storeBufferSize));
+  snapRead(r, &cache->storeCount, sizeof(cache->storeCount));
+  if (cache->storeBufferSize > maxStoreBuffer || cache->storeCount > maxStoreBuffer) {
+    cache->storeBufferSize = 0;
+    cache->storeCount = 0;
+    r->bad = true;
+  }
+  snapRead(r, cache->storeBuffer, cache->storeCount * sizeof(struct storeEntry));
+  snapRead(r, &cache->drainBusy, sizeof(cache->drainBusy));
+  snapRead(r, &cache->drainDone, sizeof(cache->drainDone));
+  snapRead(r, &cache->mshrSize, sizeof(cache->mshrSize));
+  snapRead(r, &cache->mshrCount, sizeof(cache->mshrCount));
+  snapRead(r, &cache->mshrActive, sizeof(cache->mshrActive));
+  if (cache->mshrSize > maxMshrs || cache->mshrCount > maxMshrs) {
+    cache->mshrSize = 0;
+    cache->mshrCount = 0;
+    cache->mshrActive = false;
+    r->bad = true;
+  }
+  for (unsigned i = 0; i < cache->mshrCount; i++) {
+    struct mshr *entry = &cache->mshrs[i]; // The MSHR read
+    snapRead(r, &entry->tag, sizeof(entry->tag));
+    snapRead(r, &entry->targetCount, sizeof(entry->targetCount));
+    if (0 == entry->targetCount || entry->targetCount > maxMshrTargets) {
+      cache->mshrCount = i;
+      cache->mshrActive = false;
+      r->bad = true;
+      break;
+    }
+    for (unsigned j = 0; j < entry->targetCount; j++) {
+      snapRead(r, &entry->addresses[j], sizeof(entry->addresses[j]));
+      entry->answerPtrs[j] = snapReadPointer(m, r);
+      entry->donePtrs[j] = snapReadPointer(m, r);
+      if (NULL == entry->answerPtrs[j] || NULL == entry->donePtrs[j]) {
+        r->bad = true;
+      }
+    }
+    if (r->bad) {
+      cache->mshrCount = i;
+      cache->mshrActive = false;
+      break;
+    }
+  }
+
+  if (cache->pendingLine >= cache->sets * cache->ways) {
+    cache->pendingLine = 0;
+    r->bad = true;
+  }
+  cache->version++;
+  levelRestore(m, r);
+  icacheRestore(m, r);
+}
+
+// Dump the cache's counters and the ticks the cpu waited on memory
+static void cacheStats(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  fprintf(m->out, "Read hits: %lu\n", cache->counters.readHits);
+  fprintf(m->out, "Read misses: %lu\n", cache->counters.readMisses);
+  fprintf(m->out, "Write hits: %lu\n", cache->counters.writeHits);
+  fprintf(m->out, "Write misses: %lu\n", cache->counters.writeMisses);
+  fprintf(m->out, "Write-backs: %lu\n", cache->counters.writeBacks);
+  fprintf(m->out, "Invalidates: %lu\n", cache->counters.invalidates);
+  fprintf(m->out, "Flushes: %lu\n", cache->counters.flushes);
+  fprintf(m->out, "CPU ticks waiting on memory: %lu\n", cpuMemoryWaitTicks(m));
+
+  // Accuracy is the share of prefetches a miss used, coverage the share
+  // of misses a prefetch answered
+  if (PREFETCH_OFF != cache->prefetchMode || 0 != cache->counters.prefetches) {
+    fprintf(m->out, "Prefetches: %lu\n", cache->counters.prefetches);
+    fprintf(m->out, "Prefetch hits: %lu\n", cache->counters.prefetchHits);
+    fprintf(m->out, "Prefetch accuracy: %.1f%%\n",
+            cache->counters.prefetches ? 100.0 * cache->counters.prefetchHits / cache->counters.prefetches : 0.0);
+    fprintf(m->out, "Prefetch coverage: %.1f%%\n",
+            cache->counters.readMisses ? 100.0 * cache->counters.prefetchHits / cache->counters.readMisses : 0.0);
+  }
+  if (0 != cache->storeBufferSize || 0 != cache->counters.bufferedStores) {
+    fprintf(m->out, "Buffered stores: %lu\n", cache->counters.bufferedStores);
+    fprintf(m->out, "Buffer merges: %lu\n", cache->counters.bufferMerges);
+    fprintf(m->out, "Buffer full: %lu\n", cache->counters.bufferFull);
+  }
+  if (0 != cache->mshrSize || 0 != cache->counters.mshrMerges || 0 != cpuLoadStallTicks(m)) {
+    fprintf(m->out, "MSHR merges: %lu\n", cache->counters.mshrMerges);
+    fprintf(m->out, "CPU ticks stalled on loads: %lu\n", cpuLoadStallTicks(m));
+  }
+  fprintf(m->out, "\n");
+}
+
+// Clear the cache's counters and the ticks the cpu waited on memory
+static void cacheResetStats(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  memset(&cache->counters, 0, sizeof(cache->counters));
+  cpuResetMemoryWaitTicks(m);
+  cpuResetLoadStallTicks(m);
+}
+
+// Get the cache's counters
+void cacheGetCounters(struct machine *m, struct cacheCounters *counters) {
+  struct cacheContext *cache = m->cache;
+  *counters = cache->counters;
+}
+
+// Add periods repeats of the events counted since a state the machine has
+// returned to
+static void countersForward(struct cacheCounters *counters, unsigned long periods, const struct cacheCounters *since) {
+  counters->readHits += periods * (counters->readHits - since->readHits);
+  counters->readMisses += periods * (counters->readMisses - since->readMisses);
+  counters->writeHits += periods * (counters->writeHits - since->writeHits);
+  counters->writeMisses += periods * (counters->writeMisses - since->writeMisses);
+  counters->writeBacks += periods * (counters->writeBacks - since->writeBacks);
+  counters->invalidates += periods * (counters->invalidates - since->invalidates);
+  counters->flushes += periods * (counters->flushes - since->flushes);
+  counters->prefetches += periods * (counters->prefetches - since->prefetches);
+  counters->prefetchHits += periods * (counters->prefetchHits - since->prefetchHits);
+  counters->bufferedStores += periods * (counters->bufferedStores - since->bufferedStores);
+  counters->bufferMerges += periods * (counters->bufferMerges - since->bufferMerges);
+  counters->bufferFull += periods * (counters->bufferFull - since->bufferFull);
+  counters->mshrMerges += periods * (counters->mshrMerges - since->mshrMerges);
+}
+
+// Add periods repeats of the events counted since a state the machine has
+// returned to, for ticks the clock jumps over
+void cacheForwardCounters(struct machine *m, unsigned long periods, const struct cacheCounters *since) {
+  struct cacheContext *cache = m->cache;
+  countersForward(&cache->counters, periods, since);
+}
+
+// Get the L2's counters
+void l2GetCounters(struct machine *m, struct cacheCounters *counters) {
+  struct cacheContext *l2 = m->cache->next;
+  *counters = l2->counters;
+}
+
+// Add periods repeats of the L2's events counted since a state the machine
+// has returned to, for ticks the clock jumps over
+void l2ForwardCounters(struct machine *m, unsigned long periods, const struct cacheCounters *since) {
+  struct cacheContext *l2 = m->cache->next;
+  countersForward(&l2->counters, periods, since);
+}
+
+// Get the I-cache's counters
+void icacheGetCounters(struct machine *m, struct cacheCounters *counters) {
+  struct cacheContext *icache = m->cache->instr;
+  *counters = icache->counters;
+}
+
+// Add periods repeats of the I-cache's events counted since a state the
+// machine has returned to, for ticks the clock jumps over
+void icacheForwardCounters(struct machine *m, unsigned long periods, const struct cacheCounters *since) {
+  struct cacheContext *icache = m->cache->instr;
+  countersForward(&icache->counters, periods, since);
+}
+
+// Free the lines of the cache, the L2 and the I-cache
+void cacheClean(struct machine *m) {
+  struct cacheContext *cache = m->cache;
+  free(cache->next->lines);
+  free(cache->next->data);
+  free(cache->next);
+  cache->next = NULL;
+  free(cache->instr->lines);
+  free(cache->instr->data);
+  free(cache->instr);
+  cache->instr = NULL;
+  free(cache->lines);
+  free(cache->data);
+  cache->lines = NULL;
+  cache->data = NULL;
+}
+
+// Reset the L2: off, every line invalid
+static void l2Reset(struct machine *m) {
+  struct cacheContext *l2 = m->cache->next;
+  l2->isOn = false;
+
+  for (unsigned i = 0; i < l2->sets * l2->ways; i++) {
+    l2->lines[i].tag = 0;
+    l2->lines[i].age = i % l2->ways;
+  }
+  cacheInvalidateAll(l2);
+  l2->randomState = 2463534242u;
+}
+
+// Turn the L2 on, if the cache's requests fit in its lines
+static void l2On(struct machine *m) {
+  struct cacheContext *l2 = m->cache->next;
+  if (l2->lineSize < m->cache->lineSize) {
+    fprintf(m->out, "The L2's lines must be at least as long as the cache's\n\n");
+    return;
+  }
+  l2->isOn = true;
+  l2->version++;
+}
+
+// Turn the L2 off, so the cache goes straight to memory
+static void l2Off(struct machine *m) {
+  struct cacheContext *l2 = m->cache->next;
+  l2->isOn = false;
+  l2->version++;
+}
+
+// Set the ticks the L2 takes to look a request up, at least 1
+static void l2SetLatency(struct machine *m, FILE *infile) {
+  struct cacheContext *l2 = m->cache->next;
+
+  unsigned latency = 0; // The ticks
+
+  // Get the latency
+  if (1 != fscanf(infile, "%u", &latency) || 0 == latency) {
+    fprintf(m->out, "The L2's latency is at least 1 tick\n\n");
+    return;
+  }
+  l2->latency = latency;
+  l2->version++;
+}
+
+// Select whether the L2 also holds the lines the cache does, inclusive,
+// or only the ones the cache has given up, exclusive
+static void l2SetInclusion(struct machine *m, FILE *infile) {
+  struct cacheContext *l2 = m->cache->next;
+
+  char policy[11]; // "inclusive" or "exclusive"
+
+  // Get the policy
+  fscanf(infile, "%10s", policy);
+
+  if (0 == strcmp(policy, "inclusive")) {
+    l2->exclusive = false;
+  }
+  else if (0 == strcmp(policy, "exclusive")) {
+    l2->exclusive = true;
+  }
+  else {
+    fprintf(m->out, "Unknown inclusion policy: %s\n\n", policy);
+    return;
+  }
+  l2->version++;
+}
+
+// Dump the L2's counters
+static void l2Stats(struct machine *m) {
+  struct cacheContext *l2 = m->cache->next;
+  fprintf(m->out, "L2 read hits: %lu\n", l2->counters.readHits);
+  fprintf(m->out, "L2 read misses: %lu\n", l2->counters.readMisses);
+  fprintf(m->out, "L2 write hits: %lu\n", l2->counters.writeHits);
+  fprintf(m->out, "L2 write misses: %lu\n", l2->counters.writeMisses);
+  fprintf(m->out, "L2 write-backs: %lu\n", l2->counters.writeBacks);
+  fprintf(m->out, "L2 back-invalidations: %lu\n", l2->counters.invalidates);
+  fprintf(m->out, "\n");
+}
+
+// Clear the L2's counters
+static void l2ResetStats(struct machine *m) {
+  struct cacheContext *l2 = m->cache->next;
+  memset(&l2->counters, 0, sizeof(l2->counters));
+}
+
+// Read L2 commands from the file and call the functions
+void parseL2(struct machine *m, FILE *infile) {
+
+  char cmd[11]; // Holds the command
+
+  // Get the command to execute
+  fscanf(infile, "%10s", cmd);
+
+  // Calls the reset function
+  if (0 == strcmp(cmd, "reset")) {
+    l2Reset(m);
+  }
+  // Calls the on function
+  else if (0 == strcmp(cmd, "on")) {
+    l2On(m);
+  }
+  // Calls the off function
+  else if (0 == strcmp(cmd, "off")) {
+    l2Off(m);
+  }
+  // Calls the dump function
+  else if (0 == strcmp(cmd, "dump")) {
+    cacheDump(m, m->cache->next);
+  }
+  // Calls the config function
+  else if (0 == strcmp(cmd, "config")) {
+    cacheConfig(m, m->cache->next, infile);
+  }
+  // Calls the latency function
+  else if (0 == strcmp(cmd, "latency")) {
+    l2SetLatency(m, infile);
+  }
+  // Calls the inclusion function
+  else if (0 == strcmp(cmd, "inclusion")) {
+    l2SetInclusion(m, infile);
+  }
+  // Calls the stats function
+  else if (0 == strcmp(cmd, "stats")) {
+    l2Stats(m);
+  }
+  // Calls the resetstats function
+  else if (0 == strcmp(cmd, "resetstats")) {
+    l2ResetStats(m);
+  }
+}
+
+// Reset the I-cache: off, every line invalid
+static void icacheReset(struct machine *m) {
+  struct cacheContext *icache = m->cache->instr;
+  icache->isOn = false;
+
+  for (unsigned i = 0; i < icache->sets * icache->ways; i++) {
+    icache->lines[i].tag = 0;
+    icache->lines[i].age = i % icache->ways;
+  }
+  cacheInvalidateAll(icache);
+  icache->randomState = 2463534242u;
+}
+
+// Turn the I-cache on, or off so every fetch goes to imemory. A fill in
+// progress still completes.
+static void icacheSetOn(struct machine *m, bool on) {
+  struct cacheContext *icache = m->cache->instr;
+  icache->isOn = on;
+  icache->version++;
+}
+
+// Dump the I-cache, each line's number in imemory and which of its
+// instructions are held
+static void icacheDump(struct machine *m) {
+  struct cacheContext *icache = m->cache->instr;
+
+  for (unsigned i = 0; i < icache->sets * icache->ways; i++) {
+    struct cacheLine *line = &icache->lines[i]; // The line to print
+
+    if (icache->sets * icache->ways > 1) {
+      fprintf(m->out, "Set %u way %u\n", i / icache->ways, i % icache->ways);
+    }
+    fprintf(m->out, "clo        : 0x%02X\n", line->tag);
+    fprintf(m->out, "Flags      :");
+    cacheDumpFlags(m, icache, line);
+    fprintf(m->out, "\n");
+  }
+  fprintf(m->out, "\n");
+}
+
+// Dump the I-cache's counters and the ticks the cpu waited on fetches
+static void icacheStats(struct machine *m) {
+  struct cacheContext *icache = m->cache->instr;
+  fprintf(m->out, "I-cache hits: %lu\n", icache->counters.readHits);
+  fprintf(m->out, "I-cache misses: %lu\n", icache->counters.readMisses);
+  fprintf(m->out, "CPU ticks waiting on fetch: %lu\n", cpuFetchStallTicks(m));
+  fprintf(m->out, "\n");
+}
+
+// Clear the I-cache's counters and the ticks the cpu waited on fetches
+static void icacheResetStats(struct machine *m) {
+  struct cacheContext *icache = m->cache->instr;
+  memset(&icache->counters, 0, sizeof(icache->counters));
+  cpuResetFetchStallTicks(m);
 }
 
+// Read I-cache commands from the file and call the functions
+void parseICache(struct machine *m, FILE *infile) {
+
+  char cmd[11]; // Holds the command
+
+  // Get the command to execute
+  fscanf(infile, "%10s", cmd);
+
+  // Calls the reset function
+  if (0 == strcmp(cmd, "reset")) {
+    icacheReset(m);
+  }
+  // Calls the on function
+  else if (0 == strcmp(cmd, "on")) {
+    icacheSetOn(m, true);
+  }
+  // Calls the off function
+  else if (0 == strcmp(cmd, "off")) {
+    icacheSetOn(m, false);
+  }
+  // Calls the dump function
+  else if (0 == strcmp(cmd, "dump")) {
+    icacheDump(m);
+  }
+  // Calls the config function
+  else if (0 == strcmp(cmd, "config")) {
+    cacheConfig(m, m->cache->instr, infile);
+  }
+  // Calls the stats function
+  else if (0 == strcmp(cmd, "stats")) {
+    icacheStats(m);
+  }
+  // Calls the resetstats function
+  else if (0 == strcmp(cmd, "resetstats")) {
+    icacheResetStats(m);
+  }
+}
 
 // Read cache commands from the file and call the functions
-void parseCache(FILE *infile) {
+void parseCache(struct machine *m, FILE *infile) {
 
   char cmd[11]; // Holds the command
 
@@ -295,19 +2278,51 @@ void parseCache(FILE *infile) {
   // Call the command's function
   // Calls the reset function
   if (0 == strcmp(cmd, "reset")) {
-    cacheReset();
+    cacheReset(m);
   }
   // Calls the on function
   else if (0 == strcmp(cmd, "on")) {
-    cacheOn(infile);
+    cacheOn(m);
 
   }
   // Calls the off function
   else if (0 == strcmp(cmd, "off")) {
-    cacheOff();
+    cacheOff(m);
   }
   // Calls the dump function
   else if (0 == strcmp(cmd, "dump")) {
-    cacheDump();
+    cacheDump(m, m->cache);
+  }
+  // Calls the config function
+  else if (0 == strcmp(cmd, "config")) {
+    cacheConfig(m, m->cache, infile);
   }
-}
\ No newline at end of file
+  // Calls the stats function
+  else if (0 == strcmp(cmd, "stats")) {
+    cacheStats(m);
+  }
+  // Calls the prefetch function
+  else if (0 == strcmp(cmd, "prefetch")) {
+    cacheSetPrefetch(m, infile);
+  }
+  // Calls the resetstats function
+  else if (0 == strcmp(cmd, "resetstats")) {
+    cacheResetStats(m);
+  }
+  // Calls the write function
+  else if (0 == strcmp(cmd, "write")) {
+    cacheSetWrite(m, infile);
+  }
+  // Calls the allocate function
+  else if (0 == strcmp(cmd, "allocate")) {
+    cacheSetAllocate(m, infile);
+  }
+  // Calls the storebuf function
+  else if (0 == strcmp(cmd, "storebuf")) {
+    cacheSetStoreBuffer(m, infile);
+  }
+  // Calls the mshrs function
+  else if (0 == strcmp(cmd, "mshrs")) {
+    cacheSetMshrs(m, infile);
+  }
+}
@@ -2,11 +2,54 @@
 #define CACHE_H 
 #include <stdio.h>
 #include <stdint.h>
+#include "machine.h"
+#include "snapshot.h"
 
- int parseCache(FILE *infile);
- void cacheStartFetch(unsigned address, uint8_t *dataPtr, bool *donePtr);
- void cacheStartStore(unsigned address, uint8_t *dataPtr, bool *donePtr);
- void cacheStartTick();
- bool cacheIsMoreCycleWorkNeeded();
+// Counts of the cache's events, kept while the machine runs
+struct cacheCounters {
+  unsigned long readHits;    // Loads answered from a line
+  unsigned long readMisses;  // Loads that went to memory
+  unsigned long writeHits;   // Stores written into a line
+  unsigned long writeMisses; // Stores that took a line
+  unsigned long writeBacks;  // Lines with written bytes stored to memory to make room
+  unsigned long invalidates; // Loads of the special address
+  unsigned long flushes;     // Stores to the special address
+  unsigned long prefetches;  // Lines the prefetcher fetched ahead of a load
+  unsigned long prefetchHits; // Load misses the prefetched line answered
+  unsigned long bufferedStores; // Write-backs and stores the store buffer took
+  unsigned long bufferMerges; // Of those, ones merged into an entry for the same line
+  unsigned long bufferFull;  // Ones that waited on memory because the store buffer was full
+  unsigned long mshrMerges;  // Non-blocking load misses that joined an MSHR for their line
+};
+
+ struct cacheContext *cacheContextCreate();
+ void parseCache(struct machine *m, FILE *infile);
+ void parseL2(struct machine *m, FILE *infile);
+ void parseICache(struct machine *m, FILE *infile);
+ void cacheStartFetch(struct machine *m, unsigned address, uint8_t *dataPtr, bool *donePtr);
+ void cacheStartStore(struct machine *m, unsigned address, uint8_t *dataPtr, bool *donePtr);
+ bool cacheNonBlocking(struct machine *m);
+ bool cacheCanStartLoad(struct machine *m, unsigned address);
+ void cacheStartLoad(struct machine *m, unsigned address, uint8_t *dataPtr, bool *donePtr);
+ void cacheStartTick(struct machine *m);
+ void cacheSetWide(struct machine *m, bool wide);
+ bool cacheIsMoreCycleWorkNeeded(struct machine *m);
+ unsigned cacheTicksToNextEvent(struct machine *m);
+ void l2StartTick(struct machine *m);
+ void l2SkipTicks(struct machine *m, unsigned ticks);
+ bool icacheFetchPathOn(struct machine *m);
+ void icacheStartFetch(struct machine *m, unsigned address, bool *donePtr);
+ void icacheStartTick(struct machine *m);
+ unsigned cacheFingerprint(struct machine *m, uint8_t *buf);
+ unsigned cacheSnapFields(struct machine *m, struct snapField *fields);
+ void cacheSave(struct machine *m, FILE *f);
+ void cacheRestore(struct machine *m, struct snapReader *r);
+ void cacheClean(struct machine *m);
+ void cacheGetCounters(struct machine *m, struct cacheCounters *counters);
+ void cacheForwardCounters(struct machine *m, unsigned long periods, const struct cacheCounters *since);
+ void l2GetCounters(struct machine *m, struct cacheCounters *counters);
+ void l2ForwardCounters(struct machine *m, unsigned long periods, const struct cacheCounters *since);
+ void icacheGetCounters(struct machine *m, struct cacheCounters *counters);
+ void icacheForwardCounters(struct machine *m, unsigned long periods, const struct cacheCounters *since);
 
 #endif
\ No newline at end of file
@@ -1,76 +1,699 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 #include "cpu.h"
 #include "memory.h"
 #include "cache.h"
 #include "iodev.h"
+#include "imemory.h"
+#include "clock.h"
+#include "snapshot.h"
 
-static uint16_t totalTicks; // Total clock ticks performed
+enum clockModes { TICK, EVENT };
+#define defaultGuard 1000000 // The most ticks a "clock run" takes unless told otherwise
+#define detectSlots 4096 // Block start states the periodic state detector remembers
+#define fingerprintSize 96 // Room for the state of every device
+
+// A state the machine was in at the start of a block during this run
+struct detectEntry {
+  uint8_t fingerprint[fingerprintSize]; // The state of every device
+  unsigned size;      // Bytes used in fingerprint
+  unsigned done;      // Ticks into the run the state was seen
+  unsigned long instructions; // The cpu's instruction count at the time
+  unsigned long memWaitTicks; // The ticks the cpu had waited on memory at the time
+  unsigned long fetchStallTicks; // The ticks the cpu had waited for instructions at the time
+  unsigned long loadStallTicks; // The ticks the cpu had stalled on pending loads at the time
+  struct cacheCounters cacheCounts; // The cache's counters at the time
+  struct cacheCounters l2Counts; // The L2's counters at the time
+  struct cacheCounters icacheCounts; // The I-cache's counters at the time
+  struct memCounters memCounts; // Memory's counters at the time
+  unsigned gen;       // The entry is in use when this matches detectGen
+};
+
+// The state of the machine at a tick, all but memory's contents, which
+// memory saves page by page as they are written
+struct clockCheckpoint {
+  unsigned long tick; // The elapsed tick it was taken on
+  unsigned iMemGen; // The imemory generation it was taken in
+  unsigned scheduleGen; // The io device schedule generation it was taken in
+  char *state; // The state of the devices as snapshot records
+  size_t size; // Bytes in state
+};
+
+// Conditions "clock run until" can stop on
+enum clockConditions { NONE, HALT, PC, MEM };
+
+// The state of one machine's clock
+struct clockContext {
+  uint16_t totalTicks; // Total clock ticks performed
+  enum clockModes clockMode; // TICK steps every tick, EVENT skips idle ones
+  struct detectEntry detectTable[detectSlots]; // Open addressed by fingerprint hash
+  unsigned detectGen; // Bumped to empty detectTable
+  unsigned detectCount; // Entries in use
+  bool detectOn; // Indicates the periodic state detector is on
+  unsigned long idleTicks; // Ticks event mode jumped over
+  unsigned long forwardedTicks; // Ticks the detector jumped over
+  enum clockConditions untilCondition; // The condition of the current run
+  unsigned untilPc; // The pc to stop at
+  unsigned untilAddress; // The memory address to watch
+  uint8_t untilValue; // The value to compare the memory address with
+  bool untilEqual; // True to stop on ==, false to stop on !=
+  bool yieldAhead; // Stop the run where the cpu could run ahead, for an ensemble
+  unsigned yieldedAhead; // The ticks the cpu could have run ahead when the run stopped
+  unsigned long elapsedTicks; // Ticks performed since the machine was created
+  unsigned checkpointEvery; // Ticks between checkpoints, 0 when they are off
+  unsigned long nextCheckpoint; // The elapsed tick the next checkpoint is due on
+  struct clockCheckpoint *checkpoints; // The checkpoints taken, oldest first
+  unsigned checkpointCount; // Checkpoints in checkpoints
+  unsigned checkpointCap; // Room in checkpoints
+  bool commandSince; // A command may have changed the machine since the last checkpoint
+};
+
+// Allocate the clock of a new machine
+struct clockContext *clockContextCreate() {
+  struct clockContext *clk = calloc(1, sizeof(struct clockContext));
+  clk->detectGen = 1;
+  return clk;
+}
 
 // Reset the clock to zero
-static void clockReset() { totalTicks = 0; }
+static void clockReset(struct machine *m) { m->clock->totalTicks = 0; }
+
+// Check if the condition of the current run holds
+static bool clockConditionMet(struct machine *m) {
+  struct clockContext *clk = m->clock;
+  if (HALT == clk->untilCondition) {
+    return cpuIsHalted(m);
+  }
+  if (PC == clk->untilCondition) {
+    return cpuGetPc(m) == clk->untilPc;
+  }
+  if (MEM == clk->untilCondition) {
+    return (memPeek(m, clk->untilAddress) == clk->untilValue) == clk->untilEqual;
+  }
+  return false;
+}
+
+// Look for the machine returning to a state it was in at an earlier block
+// start of this run. With nothing but the tick count different, it will
+// repeat the same ticks until the io device next acts, so jump over as
+// many whole periods as fit before that and before ticksLeft runs out.
+// Returns the ticks jumped over.
+static unsigned clockDetectPeriod(struct machine *m, unsigned done, unsigned ticksLeft) {
+  struct clockContext *clk = m->clock;
+  uint8_t fingerprint[fingerprintSize]; // The state of every device
+  unsigned size = 0; // Bytes used in fingerprint
+  unsigned jump = 0; // Ticks jumped over
+
+  size += cpuFingerprint(m, fingerprint + size);
+  size += cacheFingerprint(m, fingerprint + size);
+  size += memFingerprint(m, fingerprint + size);
+  size += iodevFingerprint(m, fingerprint + size);
+
+  // FNV-1a hash of the state
+  uint32_t hash = 2166136261u;
+  for (unsigned i = 0; i < size; i++) {
+    hash = (hash ^ fingerprint[i]) * 16777619u;
+  }
+
+  // Find the state, or the free slot for it
+  struct detectEntry *entry = &clk->detectTable[hash % detectSlots];
+  while (entry->gen == clk->detectGen &&
+         (entry->size != size || 0 != memcmp(entry->fingerprint, fingerprint, size))) {
+    entry = (entry == &clk->detectTable[detectSlots - 1]) ? clk->detectTable : entry + 1;
+  }
+
+  if (entry->gen == clk->detectGen) {
+    // Seen before: jump whole periods, stopping short of the io device
+    unsigned period = done - entry->done; // Ticks between the two visits
+    unsigned limit = ticksLeft; // Ticks that may be jumped over
+    unsigned untilEvent = iodevTicksToNextEvent(m) - 1;
+    if (untilEvent < limit) {
+      limit = untilEvent;
+    }
+
+    if (period > 0) {
+      unsigned periods = limit / period;
+      jump = periods * period;
+      if (jump > 0) {
+        cpuFastForward(m, jump, periods * (cpuInstructionCount(m) - entry->instructions),
+                       periods * (cpuMemoryWaitTicks(m) - entry->memWaitTicks),
+                       periods * (cpuFetchStallTicks(m) - entry->fetchStallTicks),
+                       periods * (cpuLoadStallTicks(m) - entry->loadStallTicks));
+        cacheForwardCounters(m, periods, &entry->cacheCounts);
+        l2ForwardCounters(m, periods, &entry->l2Counts);
+        icacheForwardCounters(m, periods, &entry->icacheCounts);
+        memForwardCounters(m, periods, &entry->memCounts);
+        iodevSkipTicks(m, jump);
+        clk->totalTicks += jump;
+        clk->elapsedTicks += jump;
+        clk->forwardedTicks += jump;
+      }
+    }
+  }
+  else {
+    // Start over when the table fills up
+    if (clk->detectCount >= detectSlots * 3 / 4) {
+      clk->detectGen++;
+      clk->detectCount = 0;
+      entry = &clk->detectTable[hash % detectSlots];
+    }
+    memcpy(entry->fingerprint, fingerprint, size);
+    entry->size = size;
+    entry->gen = clk->detectGen;
+    clk->detectCount++;
+  }
+
+  // Remember where the state was last seen
+  entry->done = done + jump;
+  entry->instructions = cpuInstructionCount(m);
+  entry->memWaitTicks = cpuMemoryWaitTicks(m);
+  entry->fetchStallTicks = cpuFetchStallTicks(m);
+  entry->loadStallTicks = cpuLoadStallTicks(m);
+  cacheGetCounters(m, &entry->cacheCounts);
+  l2GetCounters(m, &entry->l2Counts);
+  icacheGetCounters(m, &entry->icacheCounts);
+  memGetCounters(m, &entry->memCounts);
+
+  return jump;
+}
+
+// Perform one tick on every device
+void clockTickOnce(struct machine *m) {
+  struct clockContext *clk = m->clock;
+
+  bool workToDo = true; // Flag that indicates work is still being done
+                        //    by device during this tick
+
+  // Tell devices a new tick is starting
+  cpuStartTick(m);
+  memStartTick(m);
+  iMemStartTick(m);
+  l2StartTick(m);
+  cacheStartTick(m);
+  icacheStartTick(m);
+  iodevStartTick(m);
+
+  // Loop while any device still has work to do this
+  while (workToDo) {
+    // Give devices a chance to do work
+    cpuDoCycleWork(m);
+    memDoCycleWork(m);
+    cacheStartTick(m);
+    
+    // See if devices have more work to do this cycle
+    workToDo = cpuIsMoreCycleWorkNeeded(m) || memIsMoreCycleWorkNeeded() || cacheIsMoreCycleWorkNeeded(m);
+  }
+
+  clk->totalTicks++;
+  clk->elapsedTicks++;
+}
+
+// Account for ticks the cpu ran ahead of the clock on its own
+void clockAheadDone(struct machine *m, unsigned ticks) {
+  struct clockContext *clk = m->clock;
+  iodevSkipTicks(m, ticks);
+  clk->totalTicks += ticks;
+  clk->elapsedTicks += ticks;
+}
+
+// Record the state of the machine as a checkpoint. Memory starts saving
+// the pages written from here on, so only what changes takes room.
+static void clockCheckpoint(struct machine *m) {
+  struct clockContext *clk = m->clock;
+  struct clockCheckpoint *checkpoint; // The checkpoint being taken
+
+  // Grow the list when it is full
+  if (clk->checkpointCount == clk->checkpointCap) {
+    clk->checkpointCap = clk->checkpointCap ? clk->checkpointCap * 2 : 64;
+    clk->checkpoints = realloc(clk->checkpoints, clk->checkpointCap * sizeof(struct clockCheckpoint));
+  }
+
+  memCheckpoint(m, clk->checkpointCount);
+  checkpoint = &clk->checkpoints[clk->checkpointCount++];
+  checkpoint->tick = clk->elapsedTicks;
+  checkpoint->iMemGen = iMemGeneration(m);
+  checkpoint->scheduleGen = iodevScheduleGeneration(m);
+
+  // The devices other than memory are small enough to record whole
+  FILE *f = open_memstream(&checkpoint->state, &checkpoint->size);
+  clockSave(m, f);
+  cpuSave(m, f);
+  memSaveState(m, f);
+  iMemSaveState(m, f);
+  cacheSave(m, f);
+  iodevSaveState(m, f);
+  fclose(f);
+
+  clk->nextCheckpoint = clk->elapsedTicks + clk->checkpointEvery;
+  clk->commandSince = false;
+}
+
+// Forget the checkpoints after the one at index
+static void clockDropCheckpoints(struct machine *m, unsigned index) {
+  struct clockContext *clk = m->clock;
+  while (clk->checkpointCount > index + 1) {
+    free(clk->checkpoints[--clk->checkpointCount].state);
+  }
+}
+
+// Set the machine back to the checkpoint at index, forgetting later ones
+static void clockRestoreCheckpoint(struct machine *m, unsigned index) {
+  struct clockContext *clk = m->clock;
+  struct clockCheckpoint *checkpoint = &clk->checkpoints[index]; // The checkpoint to go back to
+  struct snapReader r; // Reads the recorded state
+
+  memRestoreCheckpoint(m, index);
+  r.pos = (const uint8_t *)checkpoint->state;
+  r.end = r.pos + checkpoint->size;
+  r.bad = false;
+  clockRestore(m, &r);
+  cpuRestore(m, &r);
+  memRestoreState(m, &r);
+  iMemRestoreState(m, &r);
+  cacheRestore(m, &r);
+  iodevRestoreState(m, &r);
+
+  clk->elapsedTicks = checkpoint->tick;
+  clk->nextCheckpoint = checkpoint->tick + clk->checkpointEvery;
+  clockDropCheckpoints(m, index);
+}
+
+// Stop taking checkpoints and forget the ones taken
+static void clockCheckpointsOff(struct machine *m) {
+  struct clockContext *clk = m->clock;
+  if (clk->checkpointCount > 0) {
+    clockDropCheckpoints(m, 0);
+    free(clk->checkpoints[0].state);
+  }
+  free(clk->checkpoints);
+  clk->checkpoints = NULL;
+  clk->checkpointCount = 0;
+  clk->checkpointCap = 0;
+  clk->checkpointEvery = 0;
+  memCheckpointsOff(m);
+}
+
+// Perform up to ticks clock ticks, stopping before any tick if the run's
+// condition holds. Returns the number of ticks performed.
+static unsigned clockRun(struct machine *m, unsigned ticks) {
+  struct clockContext *clk = m->clock;
+
+  unsigned done = 0; // Ticks performed
+
+  // States seen in earlier runs say nothing about this one
+  if (clk->detectOn) {
+    clk->detectGen++;
+    clk->detectCount = 0;
+  }
+
+  // Commands since the last checkpoint may have changed the machine, and
+  // going back must never re-simulate across them
+  if (clk->checkpointEvery > 0 && clk->commandSince) {
+    clockCheckpoint(m);
+  }
+
+  while (done < ticks) {
+
+    // Stop as soon as the condition holds
+    if (NONE != clk->untilCondition && clockConditionMet(m)) {
+      break;
+    }
+
+    unsigned left = ticks - done; // Ticks the next step may take
+
+    // Take a checkpoint when one is due, and end each step at the next
+    if (clk->checkpointEvery > 0) {
+      if (clk->elapsedTicks >= clk->nextCheckpoint) {
+        clockCheckpoint(m);
+      }
+      if (clk->nextCheckpoint - clk->elapsedTicks < left) {
+        left = clk->nextCheckpoint - clk->elapsedTicks;
+      }
+    }
+
+    // At the start of a block, with no memory request in flight, check if
+    // the machine is going around a loop it has been around before
+    if (clk->detectOn && cpuAtBlockStart(m) && memIsIdle(m) && UINT_MAX == cacheTicksToNextEvent(m)) {
+      unsigned jump = clockDetectPeriod(m, done, left);
+      if (jump > 0) {
+        done += jump;
+        continue;
+      }
+    }
+
+    // In event mode, jump straight to the next tick a device has work on
+    if (EVENT == clk->clockMode) {
+      unsigned idle = left; // Ticks on which no device has work
+      unsigned wake; // Ticks until a device has work, counting that tick
+
+      if ((wake = cpuTicksToNextEvent(m) - 1) < idle) idle = wake;
+      if ((wake = memTicksToNextEvent(m) - 1) < idle) idle = wake;
+      if ((wake = iMemTicksToNextEvent(m) - 1) < idle) idle = wake;
+      if ((wake = iodevTicksToNextEvent(m) - 1) < idle) idle = wake;
+      if ((wake = cacheTicksToNextEvent(m) - 1) < idle) idle = wake;
+
+      if (idle > 0) {
+        cpuSkipTicks(m, idle);
+        memSkipTicks(m, idle);
+        iMemSkipTicks(m, idle);
+        l2SkipTicks(m, idle);
+        iodevSkipTicks(m, idle);
+        clk->totalTicks += idle;
+        clk->elapsedTicks += idle;
+        clk->idleTicks += idle;
+        done += idle;
+        continue;
+      }
+    }
+
+    // While memory is idle and the io device has nothing to start, the
+    // cpu is the only device with work and may run ahead on its own
+    if (memIsIdle(m) && UINT_MAX == cacheTicksToNextEvent(m)) {
+      unsigned aheadMax = left; // Ticks the cpu may run ahead
+      unsigned untilEvent = iodevTicksToNextEvent(m) - 1; // Ticks before the io device acts
+      if (untilEvent < aheadMax) {
+        aheadMax = untilEvent;
+      }
+
+      // Leave the ticks to the ensemble running this machine
+      if (clk->yieldAhead && aheadMax > 0) {
+        clk->yieldedAhead = aheadMax;
+        break;
+      }
+
+      unsigned ahead = aheadMax > 0 ? cpuRunAhead(m, aheadMax) : 0;
+      if (ahead > 0) {
+        clockAheadDone(m, ahead);
+        done += ahead;
+        continue;
+      }
+    }
+
+    clockTickOnce(m);
+    done++;
+  }
+
+  return done;
+}
+
+// Perform up to ticks clock ticks like clockRun(), but stop as soon as
+// the cpu could run ahead, so an ensemble can run it together with other
+// machines. Returns the ticks performed and sets aheadMax to the ticks the
+// cpu may run ahead, 0 if the run finished.
+unsigned clockRunToAhead(struct machine *m, unsigned ticks, unsigned *aheadMax) {
+  struct clockContext *clk = m->clock;
+
+  // The detector needs every block start, so it runs ahead on its own
+  clk->yieldAhead = !clk->detectOn;
+  clk->yieldedAhead = 0;
+  unsigned done = clockRun(m, ticks);
+  clk->yieldAhead = false;
+
+  *aheadMax = clk->yieldedAhead;
+  return done;
+}
 
 // Get the number of ticks and perform clock ticks
-static void clockTick(FILE *infile) {
+static void clockTick(struct machine *m, FILE *infile) {
 
   int ticks; // The number of ticks
 
   // Get the number of ticks
   fscanf(infile, "%d", &ticks);
 
-  // Perform each tick
-  for (int i = 0; i < ticks; i++) {
-    bool workToDo = true; // Flag that indicates work is still being done
-                          //    by device during this tick
+  if (ticks > 0) {
+    clockRun(m, ticks);
+  }
+}
 
-    // Tell devices a new tick is starting
-    cpuStartTick();
-    memStartTick();
-    cacheStartTick();
-    iodevStartTick();
-    
-    
+// Run the clock until a condition holds:
+//     clock run until halt
+//     clock run until pc <pc>
+//     clock run until mem <address> == <value>   (or !=)
+// each optionally followed by "max <ticks>" to change the guard on how
+// many ticks the run may take
+static void clockRunUntil(struct machine *m, FILE *infile) {
+  struct clockContext *clk = m->clock;
+
+  char word[11]; // "until", then the condition
+  char op[3];    // The comparison of a memory condition
+  char rest[101]; // The rest of the line, where the guard may be
+  unsigned guard = defaultGuard; // The most ticks the run may take
+
+  // Read "until" to skip over it, then get the condition
+  fscanf(infile, "%10s", word);
+  fscanf(infile, "%10s", word);
+
+  if (0 == strcmp(word, "halt")) {
+    clk->untilCondition = HALT;
+  }
+  else if (0 == strcmp(word, "pc")) {
+    fscanf(infile, "%x", &clk->untilPc);
+    clk->untilCondition = PC;
+  }
+  else if (0 == strcmp(word, "mem")) {
+    unsigned value; // The value to compare with
+    fscanf(infile, "%x %2s %x", &clk->untilAddress, op, &value);
+    clk->untilValue = value;
+    clk->untilEqual = (0 != strcmp(op, "!="));
+    clk->untilCondition = MEM;
+  }
+  else {
+    fprintf(m->out, "Unknown clock run condition: %s\n\n", word);
+    return;
+  }
+
+  // Get the guard if the line has one
+  if (NULL != fgets(rest, sizeof(rest), infile)) {
+    sscanf(rest, " max %u", &guard);
+  }
+
+  // Let the cpu's engines stop exactly at the pc
+  if (PC == clk->untilCondition) {
+    cpuSetBreakpoint(m, clk->untilPc);
+  }
+
+  unsigned ticks = clockRun(m, guard);
+  if (ticks == guard && !clockConditionMet(m)) {
+    fprintf(m->out, "Clock: condition not met after %u ticks\n\n", guard);
+  }
 
-    // Loop while any device still has work to do this
-    while (workToDo) {
-      // Give devices a chance to do work
-      cpuDoCycleWork();
-      memDoCycleWork();
-      cacheStartTick();
-      
-      // See if devices have more work to do this cycle
-      workToDo = cpuIsMoreCycleWorkNeeded() || memIsMoreCycleWorkNeeded() || cacheIsMoreCycleWorkNeeded();
-   }
+  clk->untilCondition = NONE;
+  cpuSetBreakpoint(m, UINT_MAX);
+}
+
+// Take a checkpoint every so many ticks, or stop taking them:
+//     clock checkpoint <ticks>
+//     clock checkpoint off
+static void clockSetCheckpoints(struct machine *m, FILE *infile) {
+  struct clockContext *clk = m->clock;
+
+  char setting[11]; // The ticks between checkpoints, or "off"
+  unsigned every = 0; // The ticks between checkpoints
 
-    totalTicks++;
+  // Get the setting
+  fscanf(infile, "%10s", setting);
+
+  // Start over from the current tick
+  clockCheckpointsOff(m);
+  if (1 == sscanf(setting, "%u", &every) && every > 0) {
+    clk->checkpointEvery = every;
+    clk->commandSince = true;
   }
 }
 
+// Set the machine back to how it was the given number of ticks ago, by
+// going back to the last checkpoint at or before that tick and performing
+// the ticks from there
+static void clockBack(struct machine *m, FILE *infile) {
+  struct clockContext *clk = m->clock;
+
+  unsigned long ticks = 0; // The ticks to go back
+  unsigned long target; // The elapsed tick to go back to
+  int index; // The checkpoint to start from
+
+  // Get the number of ticks
+  fscanf(infile, "%lu", &ticks);
+
+  if (0 == clk->checkpointEvery) {
+    fprintf(m->out, "Clock: checkpoints are off\n\n");
+    return;
+  }
+  if (ticks > clk->elapsedTicks) {
+    fprintf(m->out, "Clock: cannot go back %lu ticks from tick %lu\n\n", ticks, clk->elapsedTicks);
+    return;
+  }
+  target = clk->elapsedTicks - ticks;
+
+  // Find the last checkpoint at or before the target
+  for (index = clk->checkpointCount - 1; index >= 0; index--) {
+    if (clk->checkpoints[index].tick <= target) {
+      break;
+    }
+  }
+
+  // The program, memory and io schedule must be the ones it was taken with
+  if (index < 0 || clk->checkpoints[index].iMemGen != iMemGeneration(m) ||
+      clk->checkpoints[index].scheduleGen != iodevScheduleGeneration(m) ||
+      !memCanRestoreCheckpoint(m, index)) {
+    fprintf(m->out, "Clock: no checkpoint to go back %lu ticks from\n\n", ticks);
+    return;
+  }
+
+  clockRestoreCheckpoint(m, index);
+  if (target > clk->elapsedTicks) {
+    clockRun(m, target - clk->elapsedTicks);
+  }
+}
+
+// Select how the clock steps through ticks
+static void clockSetMode(struct machine *m, FILE *infile) {
+  struct clockContext *clk = m->clock;
+
+  char mode[11]; // The name of the mode
+
+  // Get the mode
+  fscanf(infile, "%10s", mode);
+
+  if (0 == strcmp(mode, "tick")) {
+    clk->clockMode = TICK;
+  }
+  else if (0 == strcmp(mode, "event")) {
+    clk->clockMode = EVENT;
+  }
+  else {
+    fprintf(m->out, "Unknown clock mode: %s\n\n", mode);
+  }
+}
+
+// Turn the periodic state detector on or off
+static void clockSetDetect(struct machine *m, FILE *infile) {
+  struct clockContext *clk = m->clock;
+
+  char setting[11]; // "on" or "off"
+
+  // Get the setting
+  fscanf(infile, "%10s", setting);
+
+  clk->detectOn = (0 == strcmp(setting, "on"));
+
+  // The engines must stop at every block start for the detector to see it
+  cpuSetStopAtBlocks(m, clk->detectOn);
+}
+
+// Display how many ticks were jumped over rather than performed
+static void clockStats(struct machine *m) {
+  struct clockContext *clk = m->clock;
+  fprintf(m->out, "Idle ticks skipped: %lu\n", clk->idleTicks);
+  fprintf(m->out, "Ticks fast-forwarded: %lu\n", clk->forwardedTicks);
+
+  // Only what changed between checkpoints takes room
+  if (clk->checkpointEvery > 0) {
+    unsigned long bytes = memCheckpointBytes(m); // Room the checkpoints take
+    for (unsigned i = 0; i < clk->checkpointCount; i++) {
+      bytes += clk->checkpoints[i].size;
+    }
+    fprintf(m->out, "Checkpoints: %u taking %lu bytes\n", clk->checkpointCount, bytes);
+  }
+  fprintf(m->out, "\n");
+}
+
 // Display the total ticks
-static void clockDump() { printf("Clock: %d\n\n", totalTicks); }
+static void clockDump(struct machine *m) { fprintf(m->out, "Clock: %d\n\n", m->clock->totalTicks); }
 
-// Read clock commands from the file and call the functions
-void parseClock(FILE *infile) {
+// Write the clock's state to a snapshot
+void clockSave(struct machine *m, FILE *f) {
+  struct clockContext *clk = m->clock;
+  snapWrite(f, &clk->totalTicks, sizeof(clk->totalTicks));
+  snapWrite(f, &clk->clockMode, sizeof(clk->clockMode));
+  snapWrite(f, &clk->detectOn, sizeof(clk->detectOn));
+  snapWrite(f, &clk->idleTicks, sizeof(clk->idleTicks));
+  snapWrite(f, &clk->forwardedTicks, sizeof(clk->forwardedTicks));
+}
 
-  char cmd[11]; // Holds the command
+// Set the clock's state from a snapshot
+void clockRestore(struct machine *m, struct snapReader *r) {
+  struct clockContext *clk = m->clock;
+  snapRead(r, &clk->totalTicks, sizeof(clk->totalTicks));
+  snapRead(r, &clk->clockMode, sizeof(clk->clockMode));
+  snapRead(r, &clk->detectOn, sizeof(clk->detectOn));
+  snapRead(r, &clk->idleTicks, sizeof(clk->idleTicks));
+  snapRead(r, &clk->forwardedTicks, sizeof(clk->forwardedTicks));
 
-  // Get the command to execute
-  fscanf(infile, "%10s", cmd);
+  // The engines must stop at every block start for the detector to see it
+  cpuSetStopAtBlocks(m, clk->detectOn);
+}
+
+// Note a command that may have changed the machine, so the next run
+// starts with a checkpoint
+void clockNoteCommand(struct machine *m) {
+  struct clockContext *clk = m->clock;
+  clk->commandSince = true;
+}
+
+// Free the clock's checkpoints
+void clockClean(struct machine *m) {
+  clockCheckpointsOff(m);
+}
+
+// Call the function of a clock command, reading its arguments from the file
+void clockCommand(struct machine *m, const char *cmd, FILE *infile) {
+  struct clockContext *clk = m->clock;
 
   // Call the command's function
   // Calls the reset function
   if (0 == strcmp(cmd, "reset")) {
-    clockReset();
+    clockReset(m);
+    clk->commandSince = true;
   }
   // Calls the tick function
   else if (0 == strcmp(cmd, "tick")) {
-    clockTick(infile);
+    clockTick(m, infile);
 
   }
   // Calls the dump function
   else if (0 == strcmp(cmd, "dump")) {
-    clockDump();
+    clockDump(m);
+  }
+  // Calls the run function
+  else if (0 == strcmp(cmd, "run")) {
+    clockRunUntil(m, infile);
+  }
+  // Calls the detect function
+  else if (0 == strcmp(cmd, "detect")) {
+    clockSetDetect(m, infile);
+    clk->commandSince = true;
+  }
+  // Calls the stats function
+  else if (0 == strcmp(cmd, "stats")) {
+    clockStats(m);
+  }
+  // Calls the mode function
+  else if (0 == strcmp(cmd, "mode")) {
+    clockSetMode(m, infile);
+    clk->commandSince = true;
+  }
+  // Calls the checkpoint function
+  else if (0 == strcmp(cmd, "checkpoint")) {
+    clockSetCheckpoints(m, infile);
+  }
+  // Calls the back function
+  else if (0 == strcmp(cmd, "back")) {
+    clockBack(m, infile);
   }
+}
+
+// Read clock commands from the file and call the functions
+void parseClock(struct machine *m, FILE *infile) {
+
+  char cmd[11]; // Holds the command
+
+  // Get the command to execute
+  fscanf(infile, "%10s", cmd);
+
+  clockCommand(m, cmd, infile);
 }
\ No newline at end of file
@@ -1,7 +1,18 @@
 #ifndef CLOCK_H
 #define CLOCK_H 
 #include <stdio.h>
+#include "machine.h"
+#include "snapshot.h"
 
-int parseClock(FILE *infile); 
+struct clockContext *clockContextCreate();
+void parseClock(struct machine *m, FILE *infile); 
+void clockCommand(struct machine *m, const char *cmd, FILE *infile);
+void clockTickOnce(struct machine *m);
+void clockAheadDone(struct machine *m, unsigned ticks);
+unsigned clockRunToAhead(struct machine *m, unsigned ticks, unsigned *aheadMax);
+void clockSave(struct machine *m, FILE *f);
+void clockRestore(struct machine *m, struct snapReader *r);
+void clockNoteCommand(struct machine *m);
+void clockClean(struct machine *m);
 
 #endif
\ No newline at end of file
@@ -1,41 +1,185 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "imemory.h"
 #include "memory.h"
 #include "cache.h"
+#include "jit.h"
+#include "snapshot.h"
 
-enum cpu_instr_T { ADD = 0, ADDI = 1, MUL = 2, INV = 3, BRANCH = 4, LOAD = 5, STORE = 6, HALTINSTR = 7};
-enum cpu_branch_T { BEQ = 0, BNEQ = 1, BLT = 2};
-static uint8_t regs[8]; // CPU Registers RA-RH
-static uint8_t pc; // Index into imemory
-static uint16_t tc; // Counts the total number of ticks acted on the cpu
-enum cpuStates { IDLE, INSTRUCTION, WAIT, HALTSTATE };
-static enum cpuStates cpuState = IDLE; // Defualt state: IDLE
-static bool fetchDone = false; // Indicates whether a fetch is complete
-static uint8_t fetchByte; // The byte to fetch
-static unsigned cpuTicks; // Keep track of the tick count for instructions
-static unsigned instr;    // The instruction to perform 
-static uint8_t instrCode = 0; // The code of the instruction to perform
-static uint8_t destReg = 0;   // The destination register from the instruction
-static uint8_t srcReg = 0;    // The source register from the instruction
-static uint8_t trgtReg = 0;   // The target register from the instruction
-static uint8_t imValue = 0;   // The immediate values in the instruction
+enum cpuStates { IDLE, INSTRUCTION, WAIT, HALTSTATE, FETCHSTATE, STALL };
+enum cpuEngines { CLASSIC, THREADED, JIT };
+enum cpuModels { MULTICYCLE, PIPELINE };
+enum pipeStages { IF_STAGE, ID_STAGE, EX_STAGE, MEM_STAGE, WB_STAGE, PIPE_STAGES };
+
+// Handlers of the threaded engine, one per opcode and branch variant
+// followed by the superinstructions
+enum threadedHandlers { T_ADD, T_ADDI, T_MUL, T_INV, T_BEQ, T_BNEQ, T_BLT,
+                        T_ADDI_BEQ, T_ADDI_BNEQ, T_ADDI_BLT, T_HALT, T_EXIT,
+                        T_BLOCK, T_LOOP };
+
+// An instruction translated for the threaded engine
+struct threadedOp {
+  const void *handler; // Address of the code that performs the instruction
+  const void *body;    // The instruction's own handler when handler is T_BLOCK or T_LOOP
+  uint8_t dest;        // The destination register (or branch variant)
+  uint8_t src;         // The source register
+  uint8_t trgt;        // The target register
+  uint8_t imm;         // The immediate value
+};
+
+// An instruction in a stage of the pipelined model
+struct pipeSlot {
+  bool valid;        // Indicates the stage holds an instruction rather than a bubble
+  unsigned pc;       // The instruction's full pc
+  uint8_t code;      // The code of the instruction
+  uint8_t dest;      // The destination register (or branch variant)
+  uint8_t src;       // The source register
+  uint8_t trgt;      // The target register
+  uint8_t imm;       // The immediate value
+  uint8_t value;     // The result, the byte loaded or the byte stored
+  unsigned address;  // The address a load or store uses
+};
+
+#define maxLoopBody 32 // The longest loop body that is collapsed
+
+// A counted loop: a BNEQ jumping back to the loop's first pc, whose body
+// only does arithmetic that has a closed form. Every register the body
+// writes is written once, and is either an accumulator (a register adding
+// a constant or an unchanging register to itself) or computed from
+// registers the body never writes.
+struct countedLoop {
+  bool valid;            // Indicates a loop starts at this pc
+  uint8_t end;           // The pc of the loop's BNEQ
+  uint8_t counter;       // The accumulator the BNEQ compares
+  uint8_t bound;         // The unchanging register it is compared with
+  uint8_t accumulators;  // Bit mask of the body's accumulators
+  unsigned bodyTicks;    // Ticks one trip through the body takes
+  unsigned bodyCount;    // Instructions in the body
+};
+
+// The state of one machine's cpu
+struct cpuContext {
+  uint8_t regs[8]; // CPU Registers RA-RH
+  uint8_t pc; // Index into imemory, within pcPage in wide mode
+  uint8_t pcPage; // The high byte of the pc, always 0 in narrow mode
+  bool wideAddress; // Indicates 16 bit pc and load and store addresses
+  uint16_t tc; // Counts the total number of ticks acted on the cpu
+  enum cpuStates cpuState; // Defualt state: IDLE
+  bool fetchDone; // Indicates whether a fetch is complete
+  bool instrDone; // Indicates the instruction at pc has arrived through the fetch path
+  uint8_t fetchByte; // The byte to fetch
+  unsigned cpuTicks; // Keep track of the tick count for instructions
+  uint8_t instrCode; // The code of the instruction to perform
+  uint8_t destReg; // The destination register from the instruction
+  uint8_t srcReg; // The source register from the instruction
+  uint8_t trgtReg; // The target register from the instruction
+  uint8_t imValue; // The immediate values in the instruction
+  enum cpuEngines cpuEngine; // The engine used to run ahead of the clock
+  unsigned long instrCount; // Number of instructions the cpu has started
+  unsigned long aheadTicks; // Number of ticks the engine ran ahead of the clock
+  struct threadedOp threadedCode[256]; // One translated instruction per pc value
+  bool threadedValid; // Indicates threadedCode matches imemory
+  unsigned threadedGen; // The imemory generation threadedCode was translated from
+  unsigned breakPc; // The engines stop before reaching this pc, UINT_MAX for none
+  bool stopAtBlocks; // The engines stop at the start of each block
+  struct countedLoop countedLoops[256]; // The loop starting at each pc
+  bool loopsValid; // Indicates countedLoops matches imemory
+  unsigned loopsGen; // The imemory generation countedLoops was found in
+  bool loopsOn; // Indicates counted loops are collapsed
+  unsigned long collapsedTicks; // Ticks run by collapsing loops
+  unsigned long memWaitTicks; // Ticks spent waiting for a load or store
+  unsigned long fetchStallTicks; // Ticks spent waiting for an instruction to arrive
+  uint8_t loadPending; // Bit mask of the registers non-blocking loads have yet to write
+  uint8_t loadByte[8]; // The byte each register's non-blocking load fetched
+  bool loadDone[8]; // Set by the cache when each register's non-blocking load is answered
+  unsigned long loadStallTicks; // Ticks spent stalled on a register a load has yet to write
+  enum cpuModels cpuModel; // The multi-cycle state machine or the 5 stage pipeline
+  struct pipeSlot pipe[PIPE_STAGES]; // The instruction in each stage of the pipeline
+  bool fetchBusy; // Indicates the fetch path is fetching the instruction at pc for the pipeline
+  bool fetchDiscard; // Indicates the fetch in flight was flushed and is dropped when it arrives
+  bool fetchStopped; // Indicates a halt has been decoded, so nothing more is fetched
+  unsigned long runTicks; // Ticks the cpu has run without being halted
+  unsigned long loadUseStalls; // Ticks the pipeline held an instruction for the load before it
+  unsigned long branchFlushes; // Taken branches that flushed the pipeline
+};
+
+// Allocate the cpu of a new machine
+struct cpuContext *cpuContextCreate() {
+  struct cpuContext *cpu = calloc(1, sizeof(struct cpuContext));
+  cpu->breakPc = UINT_MAX;
+  cpu->loopsOn = true;
+  return cpu;
+}
+
+// Empty every stage, dropping any fetch in flight when it arrives
+static void pipeFlush(struct cpuContext *cpu) {
+  for (unsigned i = 0; i < PIPE_STAGES; i++) {
+    cpu->pipe[i].valid = false;
+  }
+  cpu->fetchDiscard = cpu->fetchBusy;
+  cpu->fetchStopped = false;
+  cpu->cpuTicks = 0;
+}
 
 // Clear the cpu's registers
-static void cpuReset() {
+static void cpuReset(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
 
   for (int i = 0; i < 8; i++) {
-    regs[i] = 0;
+    cpu->regs[i] = 0;
+  }
+  cpu->pc = 0;
+  cpu->pcPage = 0;
+  cpu->tc = 0;
+  cpu->cpuState = IDLE;
+  cpu->loadPending = 0;
+  pipeFlush(cpu);
+  cpu->fetchBusy = false;
+  cpu->fetchDiscard = false;
+}
+
+// Get the full pc, which only has a high byte in wide mode
+static unsigned cpuFullPc(struct cpuContext *cpu) {
+  return cpu->pcPage << 8 | cpu->pc;
+}
+
+// Get the pc of the oldest instruction the pipeline has not finished, or
+// of the next one to fetch when it is empty
+static unsigned pipeOldestPc(struct cpuContext *cpu) {
+  for (int i = WB_STAGE; i >= IF_STAGE; i--) {
+    if (cpu->pipe[i].valid) {
+      return cpu->pipe[i].pc;
+    }
+  }
+  return cpuFullPc(cpu);
+}
+
+// Move the pc to the next instruction. In wide mode it carries into the
+// high byte, while branches stay within the page they are taken in.
+static void cpuNextPc(struct cpuContext *cpu) {
+  if (0 == ++cpu->pc && cpu->wideAddress) {
+    cpu->pcPage++;
   }
-  pc = 0;
-  tc = 0;
-  cpuState = IDLE;
+}
+
+// Get the address a load or store uses. Narrow mode uses the target
+// register alone, wide mode the pair starting at the target register,
+// high byte in the next register, plus the immediate value.
+static unsigned cpuDataAddress(struct cpuContext *cpu) {
+  if (!cpu->wideAddress) {
+    return cpu->regs[cpu->trgtReg];
+  }
+  unsigned base = cpu->regs[(cpu->trgtReg + 1) & 7] << 8 | cpu->regs[cpu->trgtReg]; // The register pair
+  return (base + cpu->imValue) & 0xFFFF;
 }
 
 // Set the data in a register
-static void cpuSetReg(FILE *infile) {
+static void cpuSetReg(struct machine *m, FILE *infile) {
+  struct cpuContext *cpu = m->cpu;
 
   char regChar[3]; // The reg to set
   unsigned reg;    // The reg to set as an int
@@ -49,8 +193,10 @@ static void cpuSetReg(FILE *infile) {
 
   // If the register to set is the PC
   if (0 == strcmp(regChar, "PC")) {
-    pc = inByte;
-    cpuState = INSTRUCTION; // Cancel any current instruction and move to fetch instruction state
+    cpu->pc = inByte;
+    cpu->pcPage = cpu->wideAddress ? inByte >> 8 : 0;
+    cpu->cpuState = INSTRUCTION; // Cancel any current instruction and move to fetch instruction state
+    pipeFlush(cpu); // And any in the pipeline
   }
 
   // Otherwise it is RA-RH
@@ -60,234 +206,1667 @@ static void cpuSetReg(FILE *infile) {
     reg = reg - 'A'; // Translate the reg to the index
 
     // Set the value in the reg
-    regs[reg] = inByte;
+    cpu->regs[reg] = inByte;
   }
 }
 
 // Dump the contents of the cpu
-static void cpuDump() {
+static void cpuDump(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
 
   // Print the PC content
-  printf("PC: 0x%02X\n", pc);
+  fprintf(m->out, cpu->wideAddress ? "PC: 0x%04X\n" : "PC: 0x%02X\n",
+          PIPELINE == cpu->cpuModel ? pipeOldestPc(cpu) : cpuFullPc(cpu));
 
   // Print the data registers (65 is ascii A, 73 is ascii I)
   for (int i = 'A'; i < 'I'; i++) {
     // i is used as the ascii value of the register's letter
-    printf("R%c: 0x%02X\n", i, regs[i - 'A']);
+    fprintf(m->out, "R%c: 0x%02X\n", i, cpu->regs[i - 'A']);
   }
 
   // Print the TC content
-  printf("TC: %d\n\n", tc);
+  fprintf(m->out, "TC: %d\n\n", cpu->tc);
+}
+
+// Fetch the decoded instruction from imemory at pc
+static const struct decodedInstr *fetchInstruction(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  return iMemFetchDecoded(m, cpuFullPc(cpu)); // Get the instruction from imemory at address pc
+}
+
+// Write the registers whose non-blocking loads the cache has answered
+static void cpuRetireLoads(struct cpuContext *cpu) {
+  for (unsigned r = 0; r < 8; r++) {
+    if (((cpu->loadPending >> r) & 1) && cpu->loadDone[r]) {
+      cpu->regs[r] = cpu->loadByte[r];
+      cpu->loadDone[r] = false;
+      cpu->loadPending &= ~(1u << r);
+    }
+  }
+}
+
+// Check if the instruction copied out of imemory has to wait for
+// non-blocking loads: it reads or writes a register a load has yet to
+// write, it is a store or halt while any load is pending, or it is a load
+// the cache cannot take yet
+static bool cpuLoadHazard(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  unsigned used = 0; // Bit mask of the registers the instruction reads or writes
+
+  if (0 == cpu->loadPending && !(LOAD == cpu->instrCode && cacheNonBlocking(m))) {
+    return false;
+  }
+  switch (cpu->instrCode) {
+    case ADD:
+      used = 1u << cpu->destReg | 1u << cpu->srcReg | 1u << cpu->trgtReg;
+      break;
+    case ADDI:
+    case MUL:
+    case INV:
+      used = 1u << cpu->destReg | 1u << cpu->srcReg;
+      break;
+    case BRANCH:
+      used = 1u << cpu->srcReg | 1u << cpu->trgtReg;
+      break;
+    case LOAD:
+      used = 1u << cpu->destReg | 1u << cpu->trgtReg | (cpu->wideAddress ? 1u << ((cpu->trgtReg + 1) & 7) : 0);
+      break;
+    default:
+      return 0 != cpu->loadPending;
+  }
+  if (0 != (cpu->loadPending & used)) {
+    return true;
+  }
+
+  // A blocking load would take memory from the cache's MSHRs
+  if (LOAD == cpu->instrCode) {
+    if (!cacheNonBlocking(m)) {
+      return 0 != cpu->loadPending;
+    }
+    return !cacheCanStartLoad(m, cpuDataAddress(cpu));
+  }
+  return false;
+}
+
+// Check if an instruction writes its destination register
+static bool pipeWrites(const struct pipeSlot *slot) {
+  return ADD == slot->code || ADDI == slot->code || MUL == slot->code || INV == slot->code ||
+         LOAD == slot->code;
+}
+
+// Check if an instruction goes through the cache in MEM
+static bool pipeUsesMemory(const struct pipeSlot *slot) {
+  return LOAD == slot->code || STORE == slot->code;
+}
+
+// Get the bit mask of the registers an instruction reads
+static unsigned pipeReads(struct cpuContext *cpu, const struct pipeSlot *slot) {
+  unsigned pair = cpu->wideAddress ? 1u << ((slot->trgt + 1) & 7) : 0; // The high byte of a wide address
+
+  switch (slot->code) {
+    case ADD:
+    case BRANCH:
+      return 1u << slot->src | 1u << slot->trgt;
+    case ADDI:
+    case MUL:
+    case INV:
+      return 1u << slot->src;
+    case LOAD:
+      return 1u << slot->trgt | pair;
+    case STORE:
+      return 1u << slot->src | 1u << slot->trgt | pair;
+    default:
+      return 0;
+  }
+}
+
+// Read a register for the instruction in EX. The result of the
+// instruction in MEM is forwarded ahead of the register file, which WB
+// has already written this tick.
+static uint8_t pipeOperand(struct cpuContext *cpu, unsigned reg) {
+  const struct pipeSlot *mem = &cpu->pipe[MEM_STAGE]; // The instruction ahead of EX
+  if (mem->valid && pipeWrites(mem) && mem->dest == reg) {
+    return mem->value;
+  }
+  return cpu->regs[reg];
+}
+
+// Perform the instruction in EX. Returns false while it needs another
+// tick: the first of a multiply's two, or forever for a branch the cpu
+// does not know. Sets taken for a branch that is taken.
+static bool pipeExecute(struct cpuContext *cpu, bool *taken) {
+  struct pipeSlot *ex = &cpu->pipe[EX_STAGE]; // The instruction performed
+  uint8_t a = pipeOperand(cpu, ex->src); // The source register
+  uint8_t b = pipeOperand(cpu, ex->trgt); // The target register
+
+  *taken = false;
+  switch (ex->code) {
+    case ADD:
+      ex->value = a + b;
+      break;
+    case ADDI:
+      ex->value = a + ex->imm;
+      break;
+    case MUL:
+      if (0 == cpu->cpuTicks) {
+        cpu->cpuTicks = 1;
+        return false;
+      }
+      ex->value = (a & 0x0F) * (a >> 4);
+      break;
+    case INV:
+      ex->value = ~a;
+      break;
+    case BRANCH:
+      if (BEQ == ex->dest) {
+        *taken = (a == b);
+      }
+      else if (BNEQ == ex->dest) {
+        *taken = (a != b);
+      }
+      else if (BLT == ex->dest) {
+        *taken = (a < b);
+      }
+      else {
+        return false;
+      }
+      break;
+    case LOAD:
+    case STORE:
+      ex->address = cpu->wideAddress
+                        ? ((pipeOperand(cpu, (ex->trgt + 1) & 7) << 8 | b) + ex->imm) & 0xFFFF
+                        : b;
+      ex->value = a;
+      break;
+  }
+  return true;
+}
+
+// Put the instruction at pc in IF and move pc past it
+static void pipeFill(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  const struct decodedInstr *instr = fetchInstruction(m); // The instruction at pc
+  struct pipeSlot *slot = &cpu->pipe[IF_STAGE]; // IF
+
+  slot->valid = true;
+  slot->pc = cpuFullPc(cpu);
+  slot->code = instr->code;
+  slot->dest = instr->dest;
+  slot->src = instr->src;
+  slot->trgt = instr->trgt;
+  slot->imm = instr->imm;
+  cpuNextPc(cpu);
+}
+
+// Take the instruction the fetch path has answered into IF, unless it was flushed
+static void pipeFetchArrived(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  cpu->instrDone = false;
+  cpu->fetchBusy = false;
+  if (cpu->fetchDiscard) {
+    cpu->fetchDiscard = false;
+  }
+  else {
+    pipeFill(m);
+  }
+}
+
+// Start fetching the instruction at pc into an empty IF. Without a fetch
+// path it arrives at once.
+static void pipeFetch(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+
+  if (cpu->pipe[IF_STAGE].valid || cpu->fetchStopped || cpu->fetchBusy) {
+    return;
+  }
+  if (!icacheFetchPathOn(m)) {
+    pipeFill(m);
+    return;
+  }
+  cpu->fetchBusy = true;
+  cpu->instrDone = false;
+  icacheStartFetch(m, cpuFullPc(cpu), &cpu->instrDone);
+  if (cpu->instrDone) {
+    pipeFetchArrived(m);
+  }
+}
+
+// Finish the instruction in WB: write its register, or halt the cpu
+static void pipeRetire(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  struct pipeSlot *wb = &cpu->pipe[WB_STAGE]; // The instruction finished
+
+  cpu->instrCount++;
+  if (pipeWrites(wb)) {
+    cpu->regs[wb->dest] = wb->value;
+  }
+  else if (HALTINSTR == wb->code) {
+    cpu->pc = wb->pc;
+    cpu->pcPage = wb->pc >> 8;
+    cpuNextPc(cpu);
+    cpu->cpuState = HALTSTATE;
+  }
+  wb->valid = false;
+}
+
+// Move the instruction in EX to MEM, starting its load or store, and
+// flush the two instructions behind it if it is a taken branch
+static void pipeEnterMem(struct machine *m, bool taken) {
+  struct cpuContext *cpu = m->cpu;
+  struct pipeSlot *mem = &cpu->pipe[MEM_STAGE]; // MEM
+
+  *mem = cpu->pipe[EX_STAGE];
+  cpu->pipe[EX_STAGE].valid = false;
+  cpu->cpuTicks = 0;
+
+  if (LOAD == mem->code) {
+    cpu->fetchDone = false;
+    cacheStartFetch(m, mem->address, &mem->value, &cpu->fetchDone);
+  }
+  else if (STORE == mem->code) {
+    cpu->fetchDone = false;
+    cacheStartStore(m, mem->address, &mem->value, &cpu->fetchDone);
+  }
+  else if (taken) {
+    cpu->branchFlushes++;
+    cpu->pipe[IF_STAGE].valid = false;
+    cpu->pipe[ID_STAGE].valid = false;
+    cpu->fetchDiscard = cpu->fetchBusy;
+    cpu->fetchStopped = false;
+    cpu->pc = mem->imm;
+    cpu->pcPage = mem->pc >> 8;
+  }
 }
 
-// Fetch an instruction from imemory at pc
-static unsigned fetchInstruction() {
-  unsigned instr; // The instruction fetched
-  instr = iMemFetch(pc); // Get the instruction from imemory at address pc
-  return instr;
+// Perform one tick of the pipeline. Each stage works on the instruction
+// it holds, then the instructions move on from the back: WB writes the
+// register file before EX reads it, a load in MEM holds everything behind
+// it until the cache answers, an instruction reading the register a load
+// in EX writes waits a tick in ID, and a taken branch flushes IF and ID
+// as it leaves EX.
+static void pipeDoCycleWork(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  struct pipeSlot *pipe = cpu->pipe; // The stages
+  bool memReady = true; // Indicates MEM's instruction can move on
+  bool exReady = false; // Indicates EX's instruction can move on
+  bool taken = false; // Indicates EX's instruction is a taken branch
+  bool hazard = false; // Indicates ID's instruction needs a load's byte
+
+  // WB
+  if (pipe[WB_STAGE].valid) {
+    pipeRetire(m);
+    if (HALTSTATE == cpu->cpuState) {
+      return;
+    }
+  }
+
+  // MEM
+  if (pipe[MEM_STAGE].valid && pipeUsesMemory(&pipe[MEM_STAGE])) {
+    memReady = cpu->fetchDone;
+  }
+
+  // EX
+  if (pipe[EX_STAGE].valid) {
+    exReady = pipeExecute(cpu, &taken);
+  }
+
+  // ID, where a halt stops the fetching behind it
+  if (pipe[ID_STAGE].valid) {
+    hazard = pipe[EX_STAGE].valid && LOAD == pipe[EX_STAGE].code &&
+             ((pipeReads(cpu, &pipe[ID_STAGE]) >> pipe[EX_STAGE].dest) & 1);
+    if (HALTINSTR == pipe[ID_STAGE].code && !cpu->fetchStopped) {
+      cpu->fetchStopped = true;
+      cpu->fetchDiscard = cpu->fetchBusy;
+      pipe[IF_STAGE].valid = false;
+    }
+  }
+
+  // IF
+  if (cpu->fetchBusy && cpu->instrDone) {
+    pipeFetchArrived(m);
+  }
+
+  // Move the instructions on
+  if (pipe[MEM_STAGE].valid && memReady) {
+    pipe[WB_STAGE] = pipe[MEM_STAGE];
+    pipe[MEM_STAGE].valid = false;
+  }
+  if (pipe[EX_STAGE].valid && exReady && !pipe[MEM_STAGE].valid) {
+    pipeEnterMem(m, taken);
+  }
+  if (pipe[ID_STAGE].valid && !pipe[EX_STAGE].valid) {
+    if (hazard) {
+      cpu->loadUseStalls++;
+    }
+    else {
+      pipe[EX_STAGE] = pipe[ID_STAGE];
+      pipe[ID_STAGE].valid = false;
+    }
+  }
+  if (pipe[IF_STAGE].valid && !pipe[ID_STAGE].valid) {
+    pipe[ID_STAGE] = pipe[IF_STAGE];
+    pipe[IF_STAGE].valid = false;
+  }
+  pipeFetch(m);
+}
+
+// Check if the pipeline's load or store in MEM is waiting on the cache
+static bool pipeMemoryWait(struct cpuContext *cpu) {
+  return cpu->pipe[MEM_STAGE].valid && pipeUsesMemory(&cpu->pipe[MEM_STAGE]) && !cpu->fetchDone;
+}
+
+// Check if IF is waiting on the fetch path
+static bool pipeFetchWait(struct cpuContext *cpu) {
+  return cpu->fetchBusy && !cpu->instrDone;
+}
+
+// Check if a tick would change nothing in the pipeline, as every stage
+// waits on the cache or the fetch path, or on the stage ahead of it
+static bool pipeIsWaiting(struct cpuContext *cpu) {
+  const struct pipeSlot *pipe = cpu->pipe; // The stages
+  return !pipe[WB_STAGE].valid &&
+         (pipe[MEM_STAGE].valid ? pipeMemoryWait(cpu) : !pipe[EX_STAGE].valid) &&
+         (pipe[EX_STAGE].valid ? !(MUL == pipe[EX_STAGE].code && 0 == cpu->cpuTicks) : !pipe[ID_STAGE].valid) &&
+         (pipe[ID_STAGE].valid || !pipe[IF_STAGE].valid) &&
+         (pipe[IF_STAGE].valid || cpu->fetchStopped || pipeFetchWait(cpu));
 }
 
 // Handle start ticks
-void cpuStartTick() {
+void cpuStartTick(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
   //Determine if the cpu is in its haltstate, if it is, do not perform a tick
-  if(cpuState != HALTSTATE) {
+  if(cpu->cpuState != HALTSTATE) {
     // Increment the tc reg
-    tc++;
+    cpu->tc++;
+    cpu->runTicks++;
+
+    // The pipeline works on every tick, counting the ticks its MEM and IF stages wait
+    if (PIPELINE == cpu->cpuModel) {
+      if (pipeMemoryWait(cpu)) {
+        cpu->memWaitTicks++;
+      }
+      if (pipeFetchWait(cpu)) {
+        cpu->fetchStallTicks++;
+      }
+      cpu->cpuState = INSTRUCTION;
+      return;
+    }
     
     // If the cpu is in its IDLE state it needs to get an instruction 
     // and execute it
-    if (IDLE == cpuState) {
-      cpuState = INSTRUCTION; // Change the state
+    if (IDLE == cpu->cpuState) {
+      cpu->cpuState = INSTRUCTION; // Change the state
+    }
+
+    // An instruction stalled on a load tries again
+    else if (STALL == cpu->cpuState) {
+      cpu->cpuState = INSTRUCTION;
+    }
+
+    // Count the ticks a load or store keeps the cpu waiting
+    else if (WAIT == cpu->cpuState && (LOAD == cpu->instrCode || STORE == cpu->instrCode)) {
+      cpu->memWaitTicks++;
+    }
+
+    // And the ticks it waits for an instruction to arrive
+    else if (FETCHSTATE == cpu->cpuState) {
+      cpu->fetchStallTicks++;
     }
 
     // If a branch or multiply instuction is being performed, increment cpuTicks
-    else if ((WAIT == cpuState && BRANCH == instrCode) ||
-              (WAIT == cpuState && MUL == instrCode)) {
-      cpuTicks++;
+    else if ((WAIT == cpu->cpuState && BRANCH == cpu->instrCode) ||
+              (WAIT == cpu->cpuState && MUL == cpu->instrCode)) {
+      cpu->cpuTicks++;
     }
   }
 }
 
 // Check and see if the cpu has more work to do in this cycle
-bool cpuIsMoreCycleWorkNeeded() {
+bool cpuIsMoreCycleWorkNeeded(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
   // Check and see if the instruction has been complete
-  if ((WAIT == cpuState) && fetchDone) {
+  if ((WAIT == cpu->cpuState) && cpu->fetchDone) {
     return true; 
   }
+
+  // Or has arrived to be performed
+  if ((FETCHSTATE == cpu->cpuState) && cpu->instrDone) {
+    return true;
+  }
+
+  // Or a non-blocking load has been answered
+  for (unsigned r = 0; 0 != cpu->loadPending && r < 8; r++) {
+    if (((cpu->loadPending >> r) & 1) && cpu->loadDone[r]) {
+      return true;
+    }
+  }
   
   return false; 
 }
 
 // Perform the work done in a clock tick
-void cpuDoCycleWork() {
+void cpuDoCycleWork(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+
+  // The pipeline moves on once a tick
+  if (PIPELINE == cpu->cpuModel) {
+    if (INSTRUCTION == cpu->cpuState) {
+      cpu->cpuState = IDLE;
+      pipeDoCycleWork(m);
+    }
+    return;
+  }
+
+  // Take the bytes non-blocking loads have fetched
+  if (0 != cpu->loadPending) {
+    cpuRetireLoads(cpu);
+  }
+
+  // With the fetch path on, the instruction at pc comes through the
+  // I-cache and imemory first, and is performed on the tick it arrives
+  if (INSTRUCTION == cpu->cpuState && !cpu->instrDone && icacheFetchPathOn(m)) {
+    cpu->cpuState = FETCHSTATE;
+    icacheStartFetch(m, cpuFullPc(cpu), &cpu->instrDone);
+  }
+  if (FETCHSTATE == cpu->cpuState && cpu->instrDone) {
+    cpu->cpuState = INSTRUCTION;
+  }
 
   // If the state is INSTRUCTION, fetch an instruction
-  if (cpuState == INSTRUCTION) {
-    // Fetch an instruction
-    instr = fetchInstruction();
+  if (cpu->cpuState == INSTRUCTION) {
+    // Fetch an instruction, imemory has already decoded it
+    const struct decodedInstr *instr = fetchInstruction(m);
 
-    // Decode the instruction and execute it
-    instrCode = (instr >> 17) & 0x7;
-    destReg = (instr >> 14) & 0x7;
-    srcReg = (instr >> 11) & 0x7;
-    trgtReg = (instr >> 8) & 0x7;
-    imValue = instr & 0xFF;
+    // Copy out the instruction's fields
+    cpu->instrCode = instr->code;
+    cpu->destReg = instr->dest;
+    cpu->srcReg = instr->src;
+    cpu->trgtReg = instr->trgt;
+    cpu->imValue = instr->imm;
+
+    // Wait a tick if it needs a register a non-blocking load has yet to write
+    if (cpuLoadHazard(m)) {
+      cpu->cpuState = STALL;
+      cpu->loadStallTicks++;
+      return;
+    }
+
+    cpu->instrDone = false;
+
+    cpu->instrCount++;
 
     // If instrCode is equivalent to 0, perform the add operation
-    if(ADD == instrCode) {
+    if(ADD == cpu->instrCode) {
       // Get the value at srcReg and at it to the value at trgtReg and save it to destReg
-      regs[destReg] = regs[srcReg] + regs[trgtReg];
+      cpu->regs[cpu->destReg] = cpu->regs[cpu->srcReg] + cpu->regs[cpu->trgtReg];
 
-      pc++; // Increment pc
-      cpuState = IDLE; // Change the state to "IDLE
+      cpuNextPc(cpu); // Increment pc
+      cpu->cpuState = IDLE; // Change the state to "IDLE
     }
 
     // If instrCode is equivalent to 1, perform the addi instruction
-    else if(ADDI == instrCode) {
+    else if(ADDI == cpu->instrCode) {
       // Get the value at srcReg and at it to the immediate value and save it to destReg
-      regs[destReg] = regs[srcReg] + imValue;
+      cpu->regs[cpu->destReg] = cpu->regs[cpu->srcReg] + cpu->imValue;
 
-      pc++; // Increment pc
-      cpuState = IDLE; // Change the state to "IDLE
+      cpuNextPc(cpu); // Increment pc
+      cpu->cpuState = IDLE; // Change the state to "IDLE
     }
 
     // If instrCode is equivalent to 2, start the mul instruction
-    else if(MUL == instrCode) {
+    else if(MUL == cpu->instrCode) {
       // Change the state to "WAIT"
-      cpuState = WAIT;
+      cpu->cpuState = WAIT;
     }
 
     // If instrCode is equivalent to 3, perform the inv instruction
-    else if(INV == instrCode) {
+    else if(INV == cpu->instrCode) {
       // Get the value at srcReg and at it to the immediate value and save it to destReg
-      regs[destReg] = ~regs[srcReg];
+      cpu->regs[cpu->destReg] = ~cpu->regs[cpu->srcReg];
 
-      pc++; // Increment pc
-      cpuState = IDLE; // Change the state to "IDLE"
+      cpuNextPc(cpu); // Increment pc
+      cpu->cpuState = IDLE; // Change the state to "IDLE"
     }
 
     // If instrCode is equivalent to 4, start the beq, bneq, or blt instruction
-    else if(BRANCH == instrCode) {
-      cpuState = WAIT; // Change the state to "WAIT"
+    else if(BRANCH == cpu->instrCode) {
+      cpu->cpuState = WAIT; // Change the state to "WAIT"
+    }
+
+    // A non-blocking load only marks its register pending, and the cpu goes on
+    else if (LOAD == cpu->instrCode && cacheNonBlocking(m)) {
+      cpu->loadDone[cpu->destReg] = false;
+      cpu->loadPending |= 1u << cpu->destReg;
+      cacheStartLoad(m, cpuDataAddress(cpu), &cpu->loadByte[cpu->destReg], &cpu->loadDone[cpu->destReg]);
+
+      cpuNextPc(cpu); // Increment pc
+      cpu->cpuState = IDLE; // Change the state to "IDLE"
     }
 
     // If instrCode is equivalent to 5, start load word instruction
-    else if (LOAD == instrCode) {
+    else if (LOAD == cpu->instrCode) {
       
       // Start the load from cache
-      cacheStartFetch(regs[trgtReg], &fetchByte, &fetchDone);
+      cacheStartFetch(m, cpuDataAddress(cpu), &cpu->fetchByte, &cpu->fetchDone);
 
-      cpuState = WAIT; // Change the state to "WAIT"
+      cpu->cpuState = WAIT; // Change the state to "WAIT"
     }
 
     // If instrCode is equivalent to 6, start store word instruction
-    else if (STORE == instrCode) {
+    else if (STORE == cpu->instrCode) {
       
       // Start the store word in cache
-      cacheStartStore(regs[trgtReg], &regs[srcReg], &fetchDone);
+      cacheStartStore(m, cpuDataAddress(cpu), &cpu->regs[cpu->srcReg], &cpu->fetchDone);
 
-      cpuState = WAIT; // Change the state to "WAIT"
+      cpu->cpuState = WAIT; // Change the state to "WAIT"
     }
 
     // If instrCode is equivalent to 7, execute halt instruction
-    else if (HALTINSTR == instrCode) {
-      cpuState = HALTSTATE;// Change the state to "HALTSTATE"
-      pc++;
+    else if (HALTINSTR == cpu->instrCode) {
+      cpu->cpuState = HALTSTATE;// Change the state to "HALTSTATE"
+      cpuNextPc(cpu);
     }
   }
 
   // If cpuState is WAIT and fetchDone is true
   // Complete the instruction
-  if ((WAIT == cpuState) && fetchDone) {
+  if ((WAIT == cpu->cpuState) && cpu->fetchDone) {
 
     // If instrCode is equivalent to 5, complete load word instruction
-    if (LOAD == instrCode) {      
+    if (LOAD == cpu->instrCode) {      
       // set the fetch by to the destination register
-      regs[destReg] = fetchByte;
+      cpu->regs[cpu->destReg] = cpu->fetchByte;
       
-      cpuState = IDLE; // Change the state to "IDLE"
-      fetchDone = false; // Change fetchDone back to false
+      cpu->cpuState = IDLE; // Change the state to "IDLE"
+      cpu->fetchDone = false; // Change fetchDone back to false
     }
 
     // If instrCode is equivalent to 6, complete save word instruction
-    else if (STORE == instrCode) {
-      cpuState = IDLE; // Change the state to "IDLE"
-      fetchDone = false; // Change fetchDone back to false
+    else if (STORE == cpu->instrCode) {
+      cpu->cpuState = IDLE; // Change the state to "IDLE"
+      cpu->fetchDone = false; // Change fetchDone back to false
     }
     
     // Now that the instruction is complete, increment PC
-    pc++; 
+    cpuNextPc(cpu); 
   }   
 
   // Finish the branch instructions
-  else if(WAIT == cpuState && BRANCH == instrCode) {
+  else if(WAIT == cpu->cpuState && BRANCH == cpu->instrCode) {
 
     // Perform a beq, bneq, or blt instruction
-    if(BEQ == destReg) {
+    if(BEQ == cpu->destReg) {
       // If the contents are equal, branch if cpuTicks is 1 (second cycle)
-      if(regs[srcReg] == regs[trgtReg]) {
-        if(1 == cpuTicks) {
-          pc = imValue; // Branch to the line in imValue
-          cpuTicks = 0; // After the instruction, reset ticks
-          cpuState = IDLE; // Put the cpu back in IDLE
+      if(cpu->regs[cpu->srcReg] == cpu->regs[cpu->trgtReg]) {
+        if(1 == cpu->cpuTicks) {
+          cpu->pc = cpu->imValue; // Branch to the line in imValue
+          cpu->cpuTicks = 0; // After the instruction, reset ticks
+          cpu->cpuState = IDLE; // Put the cpu back in IDLE
         }
       } 
       else { 
-        pc++; // If they are not equal, branch in 0 additional cycles
-        cpuState = IDLE; // Put the cpu back in IDLE
+        cpuNextPc(cpu); // If they are not equal, branch in 0 additional cycles
+        cpu->cpuState = IDLE; // Put the cpu back in IDLE
       }
     }
-    else if (BNEQ == destReg) {
+    else if (BNEQ == cpu->destReg) {
       // If the contents are not equal, branch if cpuTicks is 1 (second cycle)
-      if(regs[srcReg] != regs[trgtReg]) {
-        if(1 == cpuTicks) {
-          pc = imValue; // Branch to the line in imValue
-          cpuTicks = 0; // After the instruction, reset ticks
-          cpuState = IDLE; // Put the cpu back in IDLE
+      if(cpu->regs[cpu->srcReg] != cpu->regs[cpu->trgtReg]) {
+        if(1 == cpu->cpuTicks) {
+          cpu->pc = cpu->imValue; // Branch to the line in imValue
+          cpu->cpuTicks = 0; // After the instruction, reset ticks
+          cpu->cpuState = IDLE; // Put the cpu back in IDLE
         }
       } 
       else { 
-        pc++; // If they are equal, branch in 0 additional cycles
-        cpuState = IDLE; // Put the cpu back in IDLE
+        cpuNextPc(cpu); // If they are equal, branch in 0 additional cycles
+        cpu->cpuState = IDLE; // Put the cpu back in IDLE
       }
     }
-    else if (BLT == destReg) {
+    else if (BLT == cpu->destReg) {
       // If content in srcReg is less than in trgtReg, branch if cpuTicks is 1 (second cycle)
-      if(regs[srcReg] < regs[trgtReg]) {
-        if(1 == cpuTicks) {
-          pc = imValue; // Branch to the line in imValue
-          cpuTicks = 0; // After the instruction, reset ticks
-          cpuState = IDLE; // Put the cpu back in IDLE
+      if(cpu->regs[cpu->srcReg] < cpu->regs[cpu->trgtReg]) {
+        if(1 == cpu->cpuTicks) {
+          cpu->pc = cpu->imValue; // Branch to the line in imValue
+          cpu->cpuTicks = 0; // After the instruction, reset ticks
+          cpu->cpuState = IDLE; // Put the cpu back in IDLE
         }
       } 
       else { 
-        pc++; // If they are equal or it is greater, branch in 0 additional cycles
-        cpuState = IDLE; // Put the cpu back in IDLE
+        cpuNextPc(cpu); // If they are equal or it is greater, branch in 0 additional cycles
+        cpu->cpuState = IDLE; // Put the cpu back in IDLE
       }
     }
   }
 
   // Finish the multiply instruction
-  else if(WAIT == cpuState && MUL == instrCode) {
+  else if(WAIT == cpu->cpuState && MUL == cpu->instrCode) {
     
     // On the second tick complete the mul instruction
-    if (1 == cpuTicks) {
+    if (1 == cpu->cpuTicks) {
       // Get the terms
-      uint8_t term1 = regs[srcReg]&0x0F; // Bits [0:3] from the source reg
-      uint8_t term2 = regs[srcReg]>>4; // Bits [4:7] from the source reg
+      uint8_t term1 = cpu->regs[cpu->srcReg]&0x0F; // Bits [0:3] from the source reg
+      uint8_t term2 = cpu->regs[cpu->srcReg]>>4; // Bits [4:7] from the source reg
 
       // Multiply the terms and save them to the destination register
-      regs[destReg] = term1 * term2;
+      cpu->regs[cpu->destReg] = term1 * term2;
 
-      cpuState = IDLE;// Change the state to "IDLE"
-      pc++; // Increment PC
-      cpuTicks = 0; // Reset cpuTicks
+      cpu->cpuState = IDLE;// Change the state to "IDLE"
+      cpuNextPc(cpu); // Increment PC
+      cpu->cpuTicks = 0; // Reset cpuTicks
     }
   }
 }
 
+// Check if the instructions from start to end, a BNEQ back to start, form a
+// counted loop and fill in loop if so
+static bool loopRecognize(struct machine *m, unsigned start, unsigned end, struct countedLoop *loop) {
+  unsigned written = 0;      // Bit mask of the registers the body writes
+  unsigned accumulators = 0; // Bit mask of the body's accumulators
+
+  loop->bodyTicks = 0;
+  loop->bodyCount = end - start;
+
+  // The body is arithmetic writing each register once
+  for (unsigned i = start; i < end; i++) {
+    const struct decodedInstr *instr = iMemFetchDecoded(m, i);
+    if (instr->code > INV || (written & (1 << instr->dest))) {
+      return false;
+    }
+    written |= 1 << instr->dest;
+    loop->bodyTicks += (MUL == instr->code) ? 2 : 1;
+  }
+
+  // Each register written is an accumulator or reads no written register
+  for (unsigned i = start; i < end; i++) {
+    const struct decodedInstr *instr = iMemFetchDecoded(m, i);
+    bool srcIsDest = instr->src == instr->dest;
+    bool trgtIsDest = instr->trgt == instr->dest;
+
+    if (ADDI == instr->code && srcIsDest) {
+      accumulators |= 1 << instr->dest;
+    }
+    else if (ADD == instr->code && srcIsDest != trgtIsDest) {
+      unsigned other = srcIsDest ? instr->trgt : instr->src; // The amount added
+      if (written & (1 << other)) {
+        return false;
+      }
+      accumulators |= 1 << instr->dest;
+    }
+    else if ((written & (1 << instr->src)) ||
+             (ADD == instr->code && (written & (1 << instr->trgt)))) {
+      return false;
+    }
+  }
+
+  // The branch compares an accumulator with an unchanging register
+  const struct decodedInstr *branch = iMemFetchDecoded(m, end);
+  if ((accumulators & (1 << branch->src)) && !(written & (1 << branch->trgt))) {
+    loop->counter = branch->src;
+    loop->bound = branch->trgt;
+  }
+  else if ((accumulators & (1 << branch->trgt)) && !(written & (1 << branch->src))) {
+    loop->counter = branch->trgt;
+    loop->bound = branch->src;
+  }
+  else {
+    return false;
+  }
+
+  loop->end = end;
+  loop->accumulators = accumulators;
+  loop->valid = true;
+  return true;
+}
+
+// Find the counted loops in imemory, if it changed since the last time
+static void loopsTranslate(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  if (cpu->loopsValid && cpu->loopsGen == iMemGeneration(m)) {
+    return;
+  }
+
+  unsigned size = iMemGetSize(m);
+  memset(cpu->countedLoops, 0, sizeof(cpu->countedLoops));
+
+  // Look at every BNEQ that jumps back a short way
+  for (unsigned end = 0; end < size && end < 256; end++) {
+    const struct decodedInstr *instr = iMemFetchDecoded(m, end);
+    unsigned start = instr->imm;
+    if (BRANCH == instr->code && BNEQ == instr->dest && start <= end &&
+        end - start <= maxLoopBody && !cpu->countedLoops[start].valid) {
+      loopRecognize(m, start, end, &cpu->countedLoops[start]);
+    }
+  }
+
+  cpu->loopsValid = true;
+  cpu->loopsGen = iMemGeneration(m);
+}
+
+// If a counted loop starts at pc, run as many trips around it as fit in
+// maxTicks in one step: accumulators gain trips times what they add, the
+// other registers get the value they always get, and the ticks are those
+// the trips take, two for each taken BNEQ and one for the final one.
+// regs points to the registers to use. Returns the ticks used and sets
+// count to the instructions performed.
+static unsigned loopCollapse(struct machine *m, uint8_t *loopRegs, unsigned maxTicks, unsigned long *count) {
+  struct cpuContext *cpu = m->cpu;
+  loopsTranslate(m);
+
+  const struct countedLoop *loop = &cpu->countedLoops[cpu->pc];
+  if (!cpu->loopsOn || !loop->valid) {
+    return 0;
+  }
+
+  // Never go past a breakpoint
+  if (cpu->breakPc >= cpu->pc && cpu->breakPc <= loop->end + 1u) {
+    return 0;
+  }
+
+  // Find what each accumulator adds on a trip
+  uint8_t steps[8] = { 0 }; // The amount added to each accumulator
+  for (unsigned i = cpu->pc; i < loop->end; i++) {
+    const struct decodedInstr *instr = iMemFetchDecoded(m, i);
+    if (loop->accumulators & (1 << instr->dest)) {
+      if (ADDI == instr->code) {
+        steps[instr->dest] = instr->imm;
+      }
+      else {
+        steps[instr->dest] = loopRegs[(instr->src == instr->dest) ? instr->trgt : instr->src];
+      }
+    }
+  }
+
+  // Find the trip on which the counter reaches the bound, 0 for never.
+  // The counter wraps at 256 so it repeats within 256 trips.
+  uint8_t counter = loopRegs[loop->counter]; // The counter after each trip
+  unsigned trips = 0; // Trips until the loop ends
+  for (unsigned k = 1; k <= 256; k++) {
+    counter += steps[loop->counter];
+    if (counter == loopRegs[loop->bound]) {
+      trips = k;
+      break;
+    }
+  }
+
+  // Run the whole loop if it fits, otherwise the trips that fit
+  unsigned tripTicks = loop->bodyTicks + 2; // Ticks for a trip with the branch taken
+  unsigned ticks; // Ticks used
+  unsigned k;     // Trips run
+  bool finished;  // Indicates the loop ran to its end
+  if (trips > 0 && (trips - 1) * tripTicks + loop->bodyTicks + 1 <= maxTicks) {
+    k = trips;
+    ticks = (trips - 1) * tripTicks + loop->bodyTicks + 1;
+    finished = true;
+  }
+  else {
+    k = maxTicks / tripTicks;
+    if (trips > 0 && k > trips - 1) {
+      k = trips - 1;
+    }
+    ticks = k * tripTicks;
+    finished = false;
+  }
+  if (0 == k) {
+    return 0;
+  }
+
+  // Set the registers to what they are after k trips
+  for (unsigned i = cpu->pc; i < loop->end; i++) {
+    const struct decodedInstr *instr = iMemFetchDecoded(m, i);
+    uint8_t *dest = &loopRegs[instr->dest];
+
+    if (loop->accumulators & (1 << instr->dest)) {
+      *dest = *dest + k * steps[instr->dest];
+    }
+    else if (ADD == instr->code) {
+      *dest = loopRegs[instr->src] + loopRegs[instr->trgt];
+    }
+    else if (ADDI == instr->code) {
+      *dest = loopRegs[instr->src] + instr->imm;
+    }
+    else if (MUL == instr->code) {
+      *dest = (loopRegs[instr->src] & 0x0F) * (loopRegs[instr->src] >> 4);
+    }
+    else if (INV == instr->code) {
+      *dest = ~loopRegs[instr->src];
+    }
+  }
+
+  if (finished) {
+    cpu->pc = loop->end + 1;
+  }
+  *count = k * (loop->bodyCount + 1);
+  cpu->collapsedTicks += ticks;
+  return ticks;
+}
+
+// Translate imemory into threaded code, handlers holds the address of
+// each handler in threadedRun()
+static void threadedTranslate(struct machine *m, const void *const *handlers) {
+  struct cpuContext *cpu = m->cpu;
+  unsigned size = iMemGetSize(m);
+
+  loopsTranslate(m);
+
+  for (unsigned i = 0; i < 256; i++) {
+    struct threadedOp *op = &cpu->threadedCode[i];
+
+    // Anything outside of imemory goes back to the cycle accurate path
+    if (i >= size) {
+      op->handler = handlers[T_EXIT];
+      continue;
+    }
+
+    const struct decodedInstr *instr = iMemFetchDecoded(m, i);
+    op->dest = instr->dest;
+    op->src = instr->src;
+    op->trgt = instr->trgt;
+    op->imm = instr->imm;
+
+    // Pick the handler for the instruction
+    if (ADD == instr->code || ADDI == instr->code || MUL == instr->code ||
+        INV == instr->code) {
+      op->handler = handlers[T_ADD + instr->code];
+    }
+    else if (BRANCH == instr->code && instr->dest <= BLT) {
+      op->handler = handlers[T_BEQ + instr->dest];
+    }
+    else if (HALTINSTR == instr->code) {
+      op->handler = handlers[T_HALT];
+    }
+    // Loads, stores and unknown branches need the cycle accurate path
+    else {
+      op->handler = handlers[T_EXIT];
+    }
+
+    // Fuse an ADDI followed by a branch, the usual loop back-edge
+    if (ADDI == instr->code && i + 1 < size && i + 1 != cpu->breakPc) {
+      const struct decodedInstr *next = iMemFetchDecoded(m, i + 1);
+      if (BRANCH == next->code && next->dest <= BLT) {
+        op->handler = handlers[T_ADDI_BEQ + next->dest];
+      }
+    }
+
+    // Collapse counted loops, which also stops at their start if asked to
+    if (cpu->loopsOn && cpu->countedLoops[i].valid) {
+      op->body = op->handler;
+      op->handler = handlers[T_LOOP];
+    }
+    // Stop at block starts, other than the one the run starts at
+    else if (cpu->stopAtBlocks && iMemIsBranchTarget(m, i)) {
+      op->body = op->handler;
+      op->handler = handlers[T_BLOCK];
+    }
+
+    // Stop at the breakpoint
+    if (i == cpu->breakPc) {
+      op->handler = handlers[T_EXIT];
+    }
+  }
+
+  cpu->threadedValid = true;
+  cpu->threadedGen = iMemGeneration(m);
+}
+
+// Run whole instructions with computed goto dispatch for at most maxTicks
+// ticks. The ticks taken and the cpu state left behind are exactly what
+// cpuStartTick()/cpuDoCycleWork() would produce. Returns the ticks used.
+static unsigned threadedRun(struct machine *m, unsigned maxTicks) {
+  struct cpuContext *cpu = m->cpu;
+  static const void *const handlers[] = {
+    [T_ADD] = &&opAdd, [T_ADDI] = &&opAddi, [T_MUL] = &&opMul, [T_INV] = &&opInv,
+    [T_BEQ] = &&opBeq, [T_BNEQ] = &&opBneq, [T_BLT] = &&opBlt,
+    [T_ADDI_BEQ] = &&opAddiBeq, [T_ADDI_BNEQ] = &&opAddiBneq,
+    [T_ADDI_BLT] = &&opAddiBlt, [T_HALT] = &&opHalt, [T_EXIT] = &&done,
+    [T_BLOCK] = &&opBlock, [T_LOOP] = &&opLoop
+  };
+  const struct threadedOp *op; // The instruction being performed
+  unsigned ticks = 0;          // Ticks used so far
+  unsigned long count = 0;     // Instructions performed so far
+
+  // Retranslate if imemory or the breakpoint changed since the last run
+  if (!cpu->threadedValid || cpu->threadedGen != iMemGeneration(m)) {
+    threadedTranslate(m, handlers);
+  }
+
+  #define DISPATCH() op = &cpu->threadedCode[cpu->pc]; goto *op->handler
+
+  DISPATCH();
+
+  // Single tick instructions
+opAdd:
+  if (ticks + 1 > maxTicks) goto done;
+  cpu->regs[op->dest] = cpu->regs[op->src] + cpu->regs[op->trgt];
+  cpu->pc++; ticks++; count++;
+  DISPATCH();
+
+opAddi:
+  if (ticks + 1 > maxTicks) goto done;
+  cpu->regs[op->dest] = cpu->regs[op->src] + op->imm;
+  cpu->pc++; ticks++; count++;
+  DISPATCH();
+
+opInv:
+  if (ticks + 1 > maxTicks) goto done;
+  cpu->regs[op->dest] = ~cpu->regs[op->src];
+  cpu->pc++; ticks++; count++;
+  DISPATCH();
+
+  // The mul instruction completes on its second tick
+opMul:
+  if (ticks + 2 > maxTicks) goto done;
+  cpu->regs[op->dest] = (cpu->regs[op->src] & 0x0F) * (cpu->regs[op->src] >> 4);
+  cpu->pc++; ticks += 2; count++;
+  DISPATCH();
+
+  // A taken branch takes two ticks, one that is not taken takes one
+opBeq:
+  if (cpu->regs[op->src] == cpu->regs[op->trgt]) goto taken;
+  goto notTaken;
+
+opBneq:
+  if (cpu->regs[op->src] != cpu->regs[op->trgt]) goto taken;
+  goto notTaken;
+
+opBlt:
+  if (cpu->regs[op->src] < cpu->regs[op->trgt]) goto taken;
+  goto notTaken;
+
+taken:
+  if (ticks + 2 > maxTicks) goto done;
+  cpu->pc = op->imm; ticks += 2; count++;
+  DISPATCH();
+
+notTaken:
+  if (ticks + 1 > maxTicks) goto done;
+  cpu->pc++; ticks++; count++;
+  DISPATCH();
+
+  // An ADDI and the branch after it, run as one when both fit
+opAddiBeq:
+  if (ticks + 3 > maxTicks) goto opAddi;
+  cpu->regs[op->dest] = cpu->regs[op->src] + op->imm;
+  op++;
+  if (cpu->regs[op->src] == cpu->regs[op->trgt]) goto fusedTaken;
+  goto fusedNotTaken;
+
+opAddiBneq:
+  if (ticks + 3 > maxTicks) goto opAddi;
+  cpu->regs[op->dest] = cpu->regs[op->src] + op->imm;
+  op++;
+  if (cpu->regs[op->src] != cpu->regs[op->trgt]) goto fusedTaken;
+  goto fusedNotTaken;
+
+opAddiBlt:
+  if (ticks + 3 > maxTicks) goto opAddi;
+  cpu->regs[op->dest] = cpu->regs[op->src] + op->imm;
+  op++;
+  if (cpu->regs[op->src] < cpu->regs[op->trgt]) goto fusedTaken;
+  goto fusedNotTaken;
+
+fusedTaken:
+  cpu->pc = op->imm; ticks += 3; count += 2;
+  DISPATCH();
+
+fusedNotTaken:
+  cpu->pc += 2; ticks += 2; count += 2;
+  DISPATCH();
+
+  // The halt instruction takes a tick, then the cpu sleeps
+opHalt:
+  if (ticks + 1 > maxTicks) goto done;
+  cpu->pc++; ticks++; count++;
+  cpu->tc += ticks;
+  cpu->runTicks += ticks;
+  cpu->cpuState = HALTSTATE;
+  cpu->instrCount += count;
+  return ticks;
+
+  // The start of a block when the engines are asked to stop at them
+opBlock:
+  if (count > 0) goto done;
+  goto *op->body;
+
+  // The start of a counted loop, run in one step when it can be
+opLoop:
+  if (cpu->stopAtBlocks && count > 0) goto done;
+  {
+    unsigned long loopCount = 0; // Instructions the loop performed
+    unsigned loopTicks = loopCollapse(m, cpu->regs, maxTicks - ticks, &loopCount);
+    if (0 == loopTicks) {
+      goto *op->body;
+    }
+    ticks += loopTicks;
+    count += loopCount;
+  }
+  DISPATCH();
+
+  #undef DISPATCH
+
+done:
+  // The cpu is between instructions again
+  if (count > 0) {
+    cpu->cpuState = IDLE;
+  }
+  cpu->tc += ticks;
+  cpu->runTicks += ticks;
+  cpu->instrCount += count;
+  return ticks;
+}
+
+// Run translated native blocks for at most maxTicks ticks, falling back to
+// threaded code for halts and for the ticks too few for a whole block.
+// Returns the ticks used.
+static unsigned jitRun(struct machine *m, unsigned maxTicks) {
+  struct cpuContext *cpu = m->cpu;
+  struct jitState state; // The registers as translated code sees them
+  uint64_t ticksLeft = maxTicks; // Ticks not used yet
+  jitBlock block; // The block to run next
+
+  // Without a translation the threaded engine does the work
+  if (!jitTranslate(m)) {
+    return threadedRun(m, maxTicks);
+  }
+
+  memcpy(state.regs, cpu->regs, sizeof(cpu->regs));
+  state.instructions = 0;
+
+  // Chain blocks until one does not fit or there is none for pc
+  while (ticksLeft > 0 && NULL != (block = jitBlockAt(m, cpu->pc))) {
+    // Run a counted loop in one step when one starts here
+    unsigned long loopCount = 0; // Instructions the loop performed
+    unsigned loopTicks = loopCollapse(m, state.regs, ticksLeft, &loopCount);
+    if (loopTicks > 0) {
+      ticksLeft -= loopTicks;
+      state.instructions += loopCount;
+      continue;
+    }
+
+    uint64_t result = block(&state, ticksLeft);
+    if ((result >> 16) == ticksLeft) {
+      break;
+    }
+    ticksLeft = result >> 16;
+    cpu->pc = result & 0xFFFF;
+  }
+
+  memcpy(cpu->regs, state.regs, sizeof(cpu->regs));
+  unsigned ticks = maxTicks - ticksLeft; // Ticks the blocks used
+  if (ticks > 0) {
+    cpu->cpuState = IDLE;
+  }
+  cpu->tc += ticks;
+  cpu->runTicks += ticks;
+  cpu->instrCount += state.instructions;
+
+  return ticks + threadedRun(m, ticksLeft);
+}
+
+// Run a program translated by tools/entropy2c for at most maxTicks ticks,
+// falling back to threaded code where it stops. Returns the ticks used.
+static unsigned nativeRunTicks(struct machine *m, nativeRunFn run, unsigned maxTicks) {
+  struct cpuContext *cpu = m->cpu;
+  unsigned long loopCount = 0; // Instructions a counted loop performed
+  uint64_t count = 0;   // Instructions the native code performed
+
+  // Run a counted loop in one step when one starts here
+  unsigned ticks = loopCollapse(m, cpu->regs, maxTicks, &loopCount);
+  unsigned nextPc = cpu->pc; // The pc the native code stops at
+
+  ticks += run(cpu->regs, &nextPc, maxTicks - ticks, &count);
+  count += loopCount;
+  cpu->pc = nextPc;
+  if (ticks > 0) {
+    cpu->cpuState = IDLE;
+  }
+  cpu->tc += ticks;
+  cpu->runTicks += ticks;
+  cpu->instrCount += count;
+
+  return ticks + threadedRun(m, maxTicks - ticks);
+}
+
+// Run the cpu ahead of the clock for at most maxTicks ticks while no other
+// device needs it. Stops before loads and stores, which need the cache, and
+// before any instruction that does not fit. Returns the ticks used.
+unsigned cpuRunAhead(struct machine *m, unsigned maxTicks) {
+  struct cpuContext *cpu = m->cpu;
+  unsigned ticks = 0; // Ticks used
+  nativeRunFn native = iMemNativeProgram(m); // A translated program, if loaded
+
+  // The classic engine leaves every tick to the state machine, as do
+  // the others in wide mode, whose pc and addresses they do not model,
+  // when instructions take time to fetch, and for the pipeline, whose
+  // timing they do not model
+  if ((CLASSIC == cpu->cpuEngine && NULL == native) || cpu->wideAddress || icacheFetchPathOn(m) ||
+      PIPELINE == cpu->cpuModel) {
+    return 0;
+  }
+
+  // A halted cpu does nothing on a tick
+  if (HALTSTATE == cpu->cpuState) {
+    ticks = maxTicks;
+  }
+  // Only start between instructions, with no loads pending
+  else if ((IDLE == cpu->cpuState || INSTRUCTION == cpu->cpuState) && 0 == cpu->loadPending) {
+    // Only threaded code can stop at a breakpoint or block start
+    if (UINT_MAX != cpu->breakPc || cpu->stopAtBlocks) {
+      ticks = threadedRun(m, maxTicks);
+    }
+    else if (NULL != native) {
+      ticks = nativeRunTicks(m, native, maxTicks);
+    }
+    else if (JIT == cpu->cpuEngine) {
+      ticks = jitRun(m, maxTicks);
+    }
+    else {
+      ticks = threadedRun(m, maxTicks);
+    }
+  }
+
+  cpu->aheadTicks += ticks;
+  return ticks;
+}
+
+// Get the number of ticks until the cpu next has work to do, counting the
+// tick it happens on. UINT_MAX means it waits on another device, or forever.
+unsigned cpuTicksToNextEvent(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  // A halted cpu never wakes up
+  if (HALTSTATE == cpu->cpuState) {
+    return UINT_MAX;
+  }
+
+  // The pipeline waits when no stage can move on by itself
+  if (PIPELINE == cpu->cpuModel) {
+    return pipeIsWaiting(cpu) ? UINT_MAX : 1;
+  }
+
+  // A load or store waits for the cache to set fetchDone
+  if (WAIT == cpu->cpuState && !cpu->fetchDone && (LOAD == cpu->instrCode || STORE == cpu->instrCode)) {
+    return UINT_MAX;
+  }
+
+  // A fetch waits for the I-cache or imemory to set instrDone
+  if (FETCHSTATE == cpu->cpuState && !cpu->instrDone) {
+    return UINT_MAX;
+  }
+
+  // An instruction stalled on a load waits for the cache to answer it
+  if (STALL == cpu->cpuState && cpuLoadHazard(m)) {
+    return UINT_MAX;
+  }
+
+  // A branch the cpu does not know never completes
+  if (WAIT == cpu->cpuState && BRANCH == cpu->instrCode && cpu->destReg > BLT) {
+    return UINT_MAX;
+  }
+
+  return 1;
+}
+
+// Account for ticks on which the cpu has no work to do
+void cpuSkipTicks(struct machine *m, unsigned ticks) {
+  struct cpuContext *cpu = m->cpu;
+  if (HALTSTATE != cpu->cpuState) {
+    cpu->tc += ticks;
+    cpu->runTicks += ticks;
+
+    // The pipeline counts the ticks its MEM and IF stages wait
+    if (PIPELINE == cpu->cpuModel) {
+      if (pipeMemoryWait(cpu)) {
+        cpu->memWaitTicks += ticks;
+      }
+      if (pipeFetchWait(cpu)) {
+        cpu->fetchStallTicks += ticks;
+      }
+    }
+    // Branches and multiplies count their ticks while waiting
+    else if (WAIT == cpu->cpuState && (BRANCH == cpu->instrCode || MUL == cpu->instrCode)) {
+      cpu->cpuTicks += ticks;
+    }
+    // As do loads and stores waiting on memory
+    else if (WAIT == cpu->cpuState && (LOAD == cpu->instrCode || STORE == cpu->instrCode)) {
+      cpu->memWaitTicks += ticks;
+    }
+    // And fetches waiting on the instruction
+    else if (FETCHSTATE == cpu->cpuState) {
+      cpu->fetchStallTicks += ticks;
+    }
+    // And instructions stalled on a load
+    else if (STALL == cpu->cpuState) {
+      cpu->loadStallTicks += ticks;
+    }
+  }
+}
+
+// Make the engines stop when the pc reaches address, UINT_MAX for none
+void cpuSetBreakpoint(struct machine *m, unsigned address) {
+  struct cpuContext *cpu = m->cpu;
+  if (address != cpu->breakPc) {
+    cpu->breakPc = address;
+    cpu->threadedValid = false;
+  }
+}
+
+// Make the engines stop at the start of each block, so the clock sees
+// every block start
+void cpuSetStopAtBlocks(struct machine *m, bool stop) {
+  struct cpuContext *cpu = m->cpu;
+  if (stop != cpu->stopAtBlocks) {
+    cpu->stopAtBlocks = stop;
+    cpu->threadedValid = false;
+  }
+}
+
+// Check if the cpu is between instructions at the start of a block. The
+// pipeline never is, as it always holds several.
+bool cpuAtBlockStart(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  return MULTICYCLE == cpu->cpuModel && (IDLE == cpu->cpuState || INSTRUCTION == cpu->cpuState) && iMemIsBranchTarget(m, cpuFullPc(cpu));
+}
+
+// Copy the state that decides what the cpu does next into buf, so the
+// clock can spot the machine repeating itself. Returns the bytes copied.
+unsigned cpuFingerprint(struct machine *m, uint8_t *buf) {
+  struct cpuContext *cpu = m->cpu;
+  unsigned n = 0; // Bytes copied
+  memcpy(buf + n, cpu->regs, sizeof(cpu->regs)); n += sizeof(cpu->regs);
+  buf[n++] = cpu->pc;
+  buf[n++] = cpu->pcPage;
+  buf[n++] = cpu->cpuState;
+  buf[n++] = cpu->fetchDone;
+  buf[n++] = cpu->fetchByte;
+  memcpy(buf + n, &cpu->cpuTicks, sizeof(cpu->cpuTicks)); n += sizeof(cpu->cpuTicks);
+  buf[n++] = cpu->loadPending;
+  return n;
+}
+
+// Get the number of instructions the cpu has started
+unsigned long cpuInstructionCount(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  return cpu->instrCount;
+}
+
+// Get the number of ticks the cpu has waited on loads and stores
+unsigned long cpuMemoryWaitTicks(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  return cpu->memWaitTicks;
+}
+
+// Clear the count of ticks waited on loads and stores
+void cpuResetMemoryWaitTicks(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  cpu->memWaitTicks = 0;
+}
+
+// Get the number of ticks the cpu has waited for instructions to arrive
+unsigned long cpuFetchStallTicks(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  return cpu->fetchStallTicks;
+}
+
+// Clear the count of ticks waited for instructions
+void cpuResetFetchStallTicks(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  cpu->fetchStallTicks = 0;
+}
+
+// Get the number of ticks the cpu has stalled on registers loads had yet to write
+unsigned long cpuLoadStallTicks(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  return cpu->loadStallTicks;
+}
+
+// Clear the count of ticks stalled on loads
+void cpuResetLoadStallTicks(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  cpu->loadStallTicks = 0;
+}
+
+// Move the cpu ahead by ticks that repeat ones already run, during which
+// it performed instructions instructions, waited waitTicks on memory,
+// stallTicks for instructions to arrive and loadTicks on pending loads
+void cpuFastForward(struct machine *m, unsigned ticks, unsigned long instructions,
+                    unsigned long waitTicks, unsigned long stallTicks, unsigned long loadTicks) {
+  struct cpuContext *cpu = m->cpu;
+  cpu->tc += ticks;
+  cpu->runTicks += ticks;
+  cpu->instrCount += instructions;
+  cpu->memWaitTicks += waitTicks;
+  cpu->fetchStallTicks += stallTicks;
+  cpu->loadStallTicks += loadTicks;
+}
+
+// Check if the cpu has halted
+bool cpuIsHalted(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  return HALTSTATE == cpu->cpuState;
+}
+
+// Get the pc, which for the pipeline is its oldest unfinished instruction's
+unsigned cpuGetPc(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  return PIPELINE == cpu->cpuModel ? pipeOldestPc(cpu) : cpuFullPc(cpu);
+}
+
+// Check if the cpu is between instructions, so an ensemble can run whole
+// instructions for it. The lanes only hold 8 bit pcs and fetch for free.
+bool cpuLaneReady(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  return MULTICYCLE == cpu->cpuModel && (IDLE == cpu->cpuState || INSTRUCTION == cpu->cpuState) &&
+         !cpu->wideAddress && !icacheFetchPathOn(m) && 0 == cpu->loadPending;
+}
+
+// Copy the registers and pc out for an ensemble to run
+void cpuLaneLoad(struct machine *m, uint8_t *laneRegs, uint8_t *lanePc) {
+  struct cpuContext *cpu = m->cpu;
+  memcpy(laneRegs, cpu->regs, sizeof(cpu->regs));
+  *lanePc = cpu->pc;
+}
+
+// Take the registers and pc back after an ensemble ran count whole
+// instructions in ticks ticks, leaving the cpu as if it had ticked through them
+void cpuLaneStore(struct machine *m, const uint8_t *laneRegs, uint8_t lanePc,
+                  unsigned ticks, unsigned long count) {
+  struct cpuContext *cpu = m->cpu;
+  memcpy(cpu->regs, laneRegs, sizeof(cpu->regs));
+  cpu->pc = lanePc;
+  if (count > 0) {
+    cpu->cpuState = IDLE;
+  }
+  cpu->tc += ticks;
+  cpu->runTicks += ticks;
+  cpu->instrCount += count;
+  cpu->aheadTicks += ticks;
+}
+
+// Select the engine that runs instructions ahead of the clock
+static void cpuSetEngine(struct machine *m, FILE *infile) {
+  struct cpuContext *cpu = m->cpu;
+
+  char engine[11]; // The name of the engine
+
+  // Get the engine name
+  fscanf(infile, "%10s", engine);
+
+  if (0 == strcmp(engine, "classic")) {
+    cpu->cpuEngine = CLASSIC;
+  }
+  else if (0 == strcmp(engine, "threaded")) {
+    cpu->cpuEngine = THREADED;
+  }
+  else if (0 == strcmp(engine, "jit")) {
+    // Native blocks are only generated for x86-64 Linux
+    if (jitIsSupported()) {
+      cpu->cpuEngine = JIT;
+    }
+    else {
+      fprintf(m->out, "The jit engine is not supported on this host\n\n");
+    }
+  }
+  else {
+    fprintf(m->out, "Unknown cpu engine: %s\n\n", engine);
+  }
+}
+
+// Turn collapsing of counted loops on or off
+static void cpuSetLoops(struct machine *m, FILE *infile) {
+  struct cpuContext *cpu = m->cpu;
+
+  char setting[11]; // "on" or "off"
+
+  // Get the setting
+  fscanf(infile, "%10s", setting);
+
+  cpu->loopsOn = (0 == strcmp(setting, "on"));
+  cpu->threadedValid = false;
+}
+
+// Select 8 bit (narrow) or 16 bit (wide) pc and load and store addresses
+static void cpuSetAddress(struct machine *m, FILE *infile) {
+  struct cpuContext *cpu = m->cpu;
+
+  char mode[11]; // "narrow" or "wide"
+
+  // Get the mode
+  fscanf(infile, "%10s", mode);
+
+  if (0 == strcmp(mode, "narrow")) {
+    cpu->wideAddress = false;
+    cpu->pcPage = 0;
+  }
+  else if (0 == strcmp(mode, "wide")) {
+    cpu->wideAddress = true;
+  }
+  else {
+    fprintf(m->out, "Unknown cpu address mode: %s\n\n", mode);
+    return;
+  }
+  cacheSetWide(m, cpu->wideAddress);
+}
+
+// Select the multi-cycle or the pipelined cpu. Only whole instructions
+// carry over: the pipeline finishes the ones past MEM and drops the rest,
+// which the multi-cycle cpu starts again from the oldest one's pc.
+static void cpuSetModel(struct machine *m, FILE *infile) {
+  struct cpuContext *cpu = m->cpu;
+
+  char model[11]; // The name of the model
+  enum cpuModels next; // The model selected
+  unsigned pc; // The pc to go on from
+  bool busy; // Indicates an instruction is part way through
+
+  // Get the model name
+  fscanf(infile, "%10s", model);
+
+  if (0 == strcmp(model, "multicycle")) {
+    next = MULTICYCLE;
+  }
+  else if (0 == strcmp(model, "pipeline")) {
+    next = PIPELINE;
+  }
+  else {
+    fprintf(m->out, "Unknown cpu model: %s\n\n", model);
+    return;
+  }
+  if (next == cpu->cpuModel) {
+    return;
+  }
+
+  // Neither model can take over a load, store or fetch in flight
+  if (MULTICYCLE == cpu->cpuModel) {
+    busy = !(IDLE == cpu->cpuState || INSTRUCTION == cpu->cpuState || HALTSTATE == cpu->cpuState) ||
+           0 != cpu->loadPending;
+  }
+  else {
+    busy = pipeMemoryWait(cpu) || cpu->fetchBusy;
+  }
+  if (busy) {
+    fprintf(m->out, "The cpu model can only be changed between instructions\n\n");
+    return;
+  }
+
+  // Finish the pipeline's instructions in WB and MEM
+  if (PIPELINE == cpu->cpuModel) {
+    for (unsigned i = 0; i < 2 && HALTSTATE != cpu->cpuState; i++) {
+      if (cpu->pipe[MEM_STAGE].valid && !cpu->pipe[WB_STAGE].valid) {
+        cpu->pipe[WB_STAGE] = cpu->pipe[MEM_STAGE];
+        cpu->pipe[MEM_STAGE].valid = false;
+      }
+      if (cpu->pipe[WB_STAGE].valid) {
+        pipeRetire(m);
+      }
+    }
+    if (HALTSTATE != cpu->cpuState) {
+      pc = pipeOldestPc(cpu);
+      cpu->pc = pc;
+      cpu->pcPage = pc >> 8;
+      cpu->cpuState = IDLE;
+    }
+  }
+  pipeFlush(cpu);
+  cpu->fetchDiscard = false;
+  cpu->fetchDone = false;
+  cpu->instrDone = false;
+  cpu->cpuModel = next;
+}
+
+// Dump the cpu's execution statistics
+static void cpuStats(struct machine *m) {
+  struct cpuContext *cpu = m->cpu;
+  const char *names[] = { "classic", "threaded", "jit" };
+  const char *models[] = { "multicycle", "pipeline" };
+  fprintf(m->out, "Engine: %s\n", names[cpu->cpuEngine]);
+  fprintf(m->out, "Model: %s\n", models[cpu->cpuModel]);
+  fprintf(m->out, "Instructions: %lu\n", cpu->instrCount);
+  fprintf(m->out, "IPC: %.3f\n", 0 == cpu->runTicks ? 0.0 : (double)cpu->instrCount / cpu->runTicks);
+  if (PIPELINE == cpu->cpuModel || 0 != cpu->loadUseStalls || 0 != cpu->branchFlushes) {
+    fprintf(m->out, "Load-use stalls: %lu\n", cpu->loadUseStalls);
+    fprintf(m->out, "Branch flushes: %lu\n", cpu->branchFlushes);
+  }
+  fprintf(m->out, "Ticks run ahead: %lu\n", cpu->aheadTicks);
+  fprintf(m->out, "Ticks collapsed: %lu\n\n", cpu->collapsedTicks);
+}
+
+// List the cpu's fields that memory, the cache, the I-cache and imemory answer into
+unsigned cpuSnapFields(struct machine *m, struct snapField *fields) {
+  struct cpuContext *cpu = m->cpu;
+  fields[0] = (struct snapField){cpu->regs, sizeof(cpu->regs)};
+  fields[1] = (struct snapField){&cpu->fetchByte, sizeof(cpu->fetchByte)};
+  fields[2] = (struct snapField){&cpu->fetchDone, sizeof(cpu->fetchDone)};
+  fields[3] = (struct snapField){&cpu->instrDone, sizeof(cpu->instrDone)};
+  fields[4] = (struct snapField){cpu->loadByte, sizeof(cpu->loadByte)};
+  fields[5] = (struct snapField){cpu->loadDone, sizeof(cpu->loadDone)};
+  fields[6] = (struct snapField){cpu->pipe, sizeof(cpu->pipe)};
+  return 7;
+}
+
+// Write the cpu's state to a snapshot
+void cpuSave(struct machine *m, FILE *f) {
+  struct cpuContext *cpu = m->cpu;
+  snapWrite(f, cpu->regs, sizeof(cpu->regs));
+  snapWrite(f, &cpu->pc, sizeof(cpu->pc));
+  snapWrite(f, &cpu->pcPage, sizeof(cpu->pcPage));
+  snapWrite(f, &cpu->wideAddress, sizeof(cpu->wideAddress));
+  snapWrite(f, &cpu->tc, sizeof(cpu->tc));
+  snapWrite(f, &cpu->cpuState, sizeof(cpu->cpuState));
+  snapWrite(f, &cpu->fetchDone, sizeof(cpu->fetchDone));
+  snapWrite(f, &cpu->fetchByte, sizeof(cpu->fetchByte));
+  snapWrite(f, &cpu->cpuTicks, sizeof(cpu->cpuTicks));
+  snapWrite(f, &cpu->instrCode, sizeof(cpu->instrCode));
+  snapWrite(f, &cpu->destReg, sizeof(cpu->destReg));
+  snapWrite(f, &cpu->srcReg, sizeof(cpu->srcReg));
+  snapWrite(f, &cpu->trgtReg, sizeof(cpu->trgtReg));
+  snapWrite(f, &cpu->imValue, sizeof(cpu->imValue));
+  snapWrite(f, &cpu->cpuEngine, sizeof(cpu->cpuEngine));
+  snapWrite(f, &cpu->loopsOn, sizeof(cpu->loopsOn));
+  snapWrite(f, &cpu->instrCount, sizeof(cpu->instrCount));
+  snapWrite(f, &cpu->aheadTicks, sizeof(cpu->aheadTicks));
+  snapWrite(f, &cpu->collapsedTicks, sizeof(cpu->collapsedTicks));
+  snapWrite(f, &cpu->memWaitTicks, sizeof(cpu->memWaitTicks));
+  snapWrite(f, &cpu->instrDone, sizeof(cpu->instrDone));
+  snapWrite(f, &cpu->fetchStallTicks, sizeof(cpu->fetchStallTicks));
+  snapWrite(f, &cpu->loadPending, sizeof(cpu->loadPending));
+  snapWrite(f, cpu->loadByte, sizeof(cpu->loadByte));
+  snapWrite(f, cpu->loadDone, sizeof(cpu->loadDone));
+  snapWrite(f, &cpu->loadStallTicks, sizeof(cpu->loadStallTicks));
+  snapWrite(f, &cpu->cpuModel, sizeof(cpu->cpuModel));
+  snapWrite(f, cpu->pipe, sizeof(cpu->pipe));
+  snapWrite(f, &cpu->fetchBusy, sizeof(cpu->fetchBusy));
+  snapWrite(f, &cpu->fetchDiscard, sizeof(cpu->fetchDiscard));
+  snapWrite(f, &cpu->fetchStopped, sizeof(cpu->fetchStopped));
+  snapWrite(f, &cpu->runTicks, sizeof(cpu->runTicks));
+  snapWrite(f, &cpu->loadUseStalls, sizeof(cpu->loadUseStalls));
+  snapWrite(f, &cpu->branchFlushes, sizeof(cpu->branchFlushes));
+}
+
+// Set the cpu's state from a snapshot. Translated code is left to be
+// redone, since restoring imemory gives it a new generation.
+void cpuRestore(struct machine *m, struct snapReader *r) {
+  struct cpuContext *cpu = m->cpu;
+  snapRead(r, cpu->regs, sizeof(cpu->regs));
+  snapRead(r, &cpu->pc, sizeof(cpu->pc));
+  snapRead(r, &cpu->pcPage, sizeof(cpu->pcPage));
+  snapRead(r, &cpu->wideAddress, sizeof(cpu->wideAddress));
+  snapRead(r, &cpu->tc, sizeof(cpu->tc));
+  snapRead(r, &cpu->cpuState, sizeof(cpu->cpuState));
+  snapRead(r, &cpu->fetchDone, sizeof(cpu->fetchDone));
+  snapRead(r, &cpu->fetchByte, sizeof(cpu->fetchByte));
+  snapRead(r, &cpu->cpuTicks, sizeof(cpu->cpuTicks));
+  snapRead(r, &cpu->instrCode, sizeof(cpu->instrCode));
+  snapRead(r, &cpu->destReg, sizeof(cpu->destReg));
+  snapRead(r, &cpu->srcReg, sizeof(cpu->srcReg));
+  snapRead(r, &cpu->trgtReg, sizeof(cpu->trgtReg));
+  snapRead(r, &cpu->imValue, sizeof(cpu->imValue));
+  snapRead(r, &cpu->cpuEngine, sizeof(cpu->cpuEngine));
+  snapRead(r, &cpu->loopsOn, sizeof(cpu->loopsOn));
+  snapRead(r, &cpu->instrCount, sizeof(cpu->instrCount));
+  snapRead(r, &cpu->aheadTicks, sizeof(cpu->aheadTicks));
+  snapRead(r, &cpu->collapsedTicks, sizeof(cpu->collapsedTicks));
+  snapRead(r, &cpu->memWaitTicks, sizeof(cpu->memWaitTicks));
+  snapRead(r, &cpu->instrDone, sizeof(cpu->instrDone));
+  snapRead(r, &cpu->fetchStallTicks, sizeof(cpu->fetchStallTicks));
+  snapRead(r, &cpu->loadPending, sizeof(cpu->loadPending));
+  snapRead(r, cpu->loadByte, sizeof(cpu->loadByte));
+  snapRead(r, cpu->loadDone, sizeof(cpu->loadDone));
+  snapRead(r, &cpu->loadStallTicks, sizeof(cpu->loadStallTicks));
+  snapRead(r, &cpu->cpuModel, sizeof(cpu->cpuModel));
+  snapRead(r, cpu->pipe, sizeof(cpu->pipe));
+  snapRead(r, &cpu->fetchBusy, sizeof(cpu->fetchBusy));
+  snapRead(r, &cpu->fetchDiscard, sizeof(cpu->fetchDiscard));
+  snapRead(r, &cpu->fetchStopped, sizeof(cpu->fetchStopped));
+  snapRead(r, &cpu->runTicks, sizeof(cpu->runTicks));
+  snapRead(r, &cpu->loadUseStalls, sizeof(cpu->loadUseStalls));
+  snapRead(r, &cpu->branchFlushes, sizeof(cpu->branchFlushes));
+
+  // A damaged model or engine would index past the stats' names
+  if (cpu->cpuModel > PIPELINE) {
+    cpu->cpuModel = MULTICYCLE;
+    r->bad = true;
+  }
+  if (cpu->cpuEngine > JIT) {
+    cpu->cpuEngine = CLASSIC;
+    r->bad = true;
+  }
+  if (cpu->cpuState > STALL) {
+    cpu->cpuState = IDLE;
+    r->bad = true;
+  }
+
+  // And damaged register numbers would index past the registers
+  if ((cpu->destReg | cpu->srcReg | cpu->trgtReg) > 7) {
+    cpu->destReg = 0;
+    cpu->srcReg = 0;
+    cpu->trgtReg = 0;
+    cpu->cpuState = IDLE;
+    r->bad = true;
+  }
+  for (unsigned i = 0; i < PIPE_STAGES; i++) {
+    struct pipeSlot *slot = &cpu->pipe[i]; // The stage checked
+    if (slot->valid && (slot->dest | slot->src | slot->trgt) > 7) {
+      slot->valid = false;
+      r->bad = true;
+    }
+  }
+
+  // The cache follows the cpu's address width
+  cacheSetWide(m, cpu->wideAddress);
+
+  // A jit snapshot restored where the jit is not supported runs threaded
+  if (JIT == cpu->cpuEngine && !jitIsSupported()) {
+    cpu->cpuEngine = THREADED;
+  }
+}
+
+// Free the cpu's translated code
+void cpuClean(struct machine *m) {
+  jitClean(m);
+}
+
 // Read cpu commands from the file and call the functions
-void parseCpu(FILE *infile) {
+void parseCpu(struct machine *m, FILE *infile) {
 
   char cmd[11]; // Holds the command
 
@@ -297,7 +1876,7 @@ void parseCpu(FILE *infile) {
   // Call the command's function
   // Calls the reset function
   if (0 == strcmp(cmd, "reset")) {
-    cpuReset();
+    cpuReset(m);
   }
   // Calls the set function
   else if (0 == strcmp(cmd, "set")) {
@@ -305,11 +1884,31 @@ void parseCpu(FILE *infile) {
     // Read "reg" to "skip" over it
     fscanf(infile, "%10s", cmd);
 
-    cpuSetReg(infile);
+    cpuSetReg(m, infile);
 
   }
   // Calls the dump function
   else if (0 == strcmp(cmd, "dump")) {
-    cpuDump();
+    cpuDump(m);
+  }
+  // Calls the engine function
+  else if (0 == strcmp(cmd, "engine")) {
+    cpuSetEngine(m, infile);
+  }
+  // Calls the stats function
+  else if (0 == strcmp(cmd, "stats")) {
+    cpuStats(m);
+  }
+  // Calls the loops function
+  else if (0 == strcmp(cmd, "loops")) {
+    cpuSetLoops(m, infile);
+  }
+  // Calls the address function
+  else if (0 == strcmp(cmd, "address")) {
+    cpuSetAddress(m, infile);
+  }
+  // Calls the model function
+  else if (0 == strcmp(cmd, "model")) {
+    cpuSetModel(m, infile);
   }
 }
\ No newline at end of file
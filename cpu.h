@@ -2,10 +2,40 @@
 #define CPU_H
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "machine.h"
+#include "snapshot.h"
 
-int parseCpu(FILE *infile);
-void cpuStartTick();
-bool cpuIsMoreCycleWorkNeeded();
-void cpuDoCycleWork();
+struct cpuContext *cpuContextCreate();
+int parseCpu(struct machine *m, FILE *infile);
+void cpuStartTick(struct machine *m);
+bool cpuIsMoreCycleWorkNeeded(struct machine *m);
+void cpuDoCycleWork(struct machine *m);
+unsigned cpuRunAhead(struct machine *m, unsigned maxTicks);
+unsigned cpuTicksToNextEvent(struct machine *m);
+void cpuSkipTicks(struct machine *m, unsigned ticks);
+void cpuSetBreakpoint(struct machine *m, unsigned address);
+bool cpuIsHalted(struct machine *m);
+void cpuSetStopAtBlocks(struct machine *m, bool stop);
+bool cpuAtBlockStart(struct machine *m);
+unsigned cpuFingerprint(struct machine *m, uint8_t *buf);
+unsigned long cpuInstructionCount(struct machine *m);
+void cpuFastForward(struct machine *m, unsigned ticks, unsigned long instructions,
+                    unsigned long waitTicks, unsigned long stallTicks, unsigned long loadTicks);
+unsigned long cpuMemoryWaitTicks(struct machine *m);
+void cpuResetMemoryWaitTicks(struct machine *m);
+unsigned long cpuFetchStallTicks(struct machine *m);
+void cpuResetFetchStallTicks(struct machine *m);
+unsigned long cpuLoadStallTicks(struct machine *m);
+void cpuResetLoadStallTicks(struct machine *m);
+unsigned cpuGetPc(struct machine *m);
+bool cpuLaneReady(struct machine *m);
+void cpuLaneLoad(struct machine *m, uint8_t *laneRegs, uint8_t *lanePc);
+void cpuLaneStore(struct machine *m, const uint8_t *laneRegs, uint8_t lanePc,
+                  unsigned ticks, unsigned long count);
+void cpuClean(struct machine *m);
+unsigned cpuSnapFields(struct machine *m, struct snapField *fields);
+void cpuSave(struct machine *m, FILE *f);
+void cpuRestore(struct machine *m, struct snapReader *r);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,395 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "machine.h"
+#include "clock.h"
+#include "cpu.h"
+#include "imemory.h"
+
+#define ensembleWidth 16     // Lanes run together, one byte of a vector each
+#define spillSteps 100       // Steps between moving the byte counters to the lane totals
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The lanes' bytes and flags, one element per lane. The compiler turns
+// operations on them into SSE/AVX2 (or NEON) instructions.
+typedef uint8_t laneBytes __attribute__((vector_size(ensembleWidth)));
+typedef int8_t laneFlags __attribute__((vector_size(ensembleWidth)));
+
+// The cpus of a group of lanes in struct of arrays form
+struct laneGroup {
+  laneBytes regs[8];  // Registers RA-RH of every lane
+  laneBytes pc;       // The pc of every lane
+  laneFlags active;   // Lanes still running
+  unsigned left[ensembleWidth];  // Ticks each lane may still run
+  unsigned long count[ensembleWidth]; // Instructions each lane has performed
+};
+
+// One machine of the ensemble and the script it runs
+struct ensembleLane {
+  struct machine *m;      // The machine
+  FILE *infile;           // The script
+  FILE *outfile;          // Where the machine prints
+  bool done;              // Indicates the script has ended
+  unsigned ticksLeft;     // Ticks of the current "clock tick" still to do
+  unsigned aheadMax;      // Ticks the cpu may run ahead now, 0 for none
+  struct machine *checkedLeader; // The lane the program was last compared with
+  unsigned checkedGen;    // This lane's imemory generation at the time
+  unsigned leaderGen;     // The other lane's imemory generation at the time
+  bool sameProgram;       // The result of the comparison
+};
+
+// Check if the lane runs the same program as leader, comparing imemory
+// only when either has changed since the last time
+static bool ensembleSameProgram(struct ensembleLane *lane, struct machine *leader) {
+  if (lane->m == leader) {
+    return true;
+  }
+  if (lane->checkedLeader != leader || lane->checkedGen != iMemGeneration(lane->m) ||
+      lane->leaderGen != iMemGeneration(leader)) {
+    lane->sameProgram = iMemSameProgram(lane->m, leader);
+    lane->checkedLeader = leader;
+    lane->checkedGen = iMemGeneration(lane->m);
+    lane->leaderGen = iMemGeneration(leader);
+  }
+  return lane->sameProgram;
+}
+
+// Get a bit mask of the lanes whose flag is set
+static unsigned laneMask(laneFlags flags) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8((__m128i)flags);
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < ensembleWidth; i++) {
+    mask |= (flags[i] ? 1u : 0u) << i;
+  }
+  return mask;
+#endif
+}
+
+// Move the ticks and instructions counted in bytes to the lanes' totals
+static void laneSpill(struct laneGroup *g, laneBytes *ticks, laneBytes *count) {
+  for (int i = 0; i < ensembleWidth; i++) {
+    g->left[i] -= (*ticks)[i];
+    g->count[i] += (*count)[i];
+  }
+  *ticks = (laneBytes){ 0 };
+  *count = (laneBytes){ 0 };
+}
+
+// Run whole instructions for every active lane of the group, each for at
+// most its ticks left, with the same timing as the cpu's state machine.
+// Each step follows the pc of the first active lane; lanes at another pc
+// are masked off until the others come back to it. A lane stops at a
+// load, store or halt, or when the next instruction does not fit.
+// Ticks and instructions are counted per lane in bytes and moved to the
+// totals every spillSteps steps, and no lane's ticks are checked while
+// every lane has the ticks for two more per step.
+static void ensembleKernel(struct machine *leader, struct laneGroup *g) {
+  unsigned size = iMemGetSize(leader); // Words of the shared program
+  const struct decodedInstr *program = iMemFetchDecoded(leader, 0); // The shared program
+  laneBytes ticks = { 0 };  // Ticks each lane used since the last spill
+  laneBytes count = { 0 };  // Instructions each lane performed since then
+  unsigned steps = 0;       // Steps since then
+  unsigned safe = 0;        // Steps that can be taken without checking ticks
+  unsigned mask;            // The active lanes
+
+  while (0 != (mask = laneMask(g->active))) {
+    // Keep the byte counters from overflowing and find how far every lane
+    // can go without running out of ticks. With none safe, the counters are
+    // spilled before every step so each lane's ticks left are exact.
+    if (steps == spillSteps || 0 == safe) {
+      laneSpill(g, &ticks, &count);
+      steps = 0;
+      unsigned least = UINT_MAX; // The fewest ticks an active lane has left
+      for (int i = 0; i < ensembleWidth; i++) {
+        if (g->active[i] && g->left[i] < least) {
+          least = g->left[i];
+        }
+      }
+      safe = least / 2;
+    }
+
+    uint8_t pc = g->pc[__builtin_ctz(mask)]; // Follow the first lane still running
+    laneFlags here = g->active & (g->pc == pc); // The lanes at pc
+    laneFlags run = here; // The lanes that run the instruction
+
+    // Outside of imemory the cycle accurate path takes over
+    if (pc >= size) {
+      g->active &= ~here;
+      continue;
+    }
+    const struct decodedInstr *instr = &program[pc];
+    laneBytes src = g->regs[instr->src];   // The source register of every lane
+    laneBytes trgt = g->regs[instr->trgt]; // The target register of every lane
+    laneBytes cost; // The ticks the instruction takes in every lane
+
+    if (instr->code <= INV) {
+      laneBytes result; // The value written to the destination register
+
+      if (ADD == instr->code) {
+        result = src + trgt;
+      }
+      else if (ADDI == instr->code) {
+        result = src + instr->imm;
+      }
+      else if (MUL == instr->code) {
+        result = (src & 0x0F) * (src >> 4);
+      }
+      else {
+        result = ~src;
+      }
+      cost = (laneBytes){ 0 } + (uint8_t)((MUL == instr->code) ? 2 : 1);
+
+      // Near the end of a lane's ticks, check each lane has the ticks for it
+      if (0 == safe) {
+        for (int i = 0; i < ensembleWidth; i++) {
+          if (here[i] && g->left[i] < cost[i]) {
+            run[i] = 0;
+          }
+        }
+        g->active &= ~here | run;
+      }
+
+      g->regs[instr->dest] = (result & (laneBytes)run) | (g->regs[instr->dest] & ~(laneBytes)run);
+      g->pc += (laneBytes)run & 1;
+    }
+    else if (BRANCH == instr->code && instr->dest <= BLT) {
+      laneFlags taken; // The lanes taking the branch
+
+      if (BEQ == instr->dest) {
+        taken = src == trgt;
+      }
+      else if (BNEQ == instr->dest) {
+        taken = src != trgt;
+      }
+      else {
+        taken = src < trgt;
+      }
+
+      // A taken branch takes two ticks, one that is not taken takes one
+      cost = 1 + ((laneBytes)taken & 1);
+      if (0 == safe) {
+        for (int i = 0; i < ensembleWidth; i++) {
+          if (here[i] && g->left[i] < cost[i]) {
+            run[i] = 0;
+          }
+        }
+        g->active &= ~here | run;
+      }
+
+      laneBytes next = (instr->imm & (laneBytes)taken) | ((g->pc + 1) & ~(laneBytes)taken);
+      g->pc = (next & (laneBytes)run) | (g->pc & ~(laneBytes)run);
+    }
+    else {
+      // Loads, stores and halts go through the cycle accurate path
+      g->active &= ~here;
+      continue;
+    }
+
+    ticks += cost & (laneBytes)run;
+    count += (laneBytes)run & 1;
+    steps++;
+    if (safe > 0) {
+      safe--;
+    }
+  }
+
+  laneSpill(g, &ticks, &count);
+}
+
+// Run the cpus of up to ensembleWidth lanes ahead of the clock. Lanes with
+// the first ready lane's program run together in the kernel, the others
+// run ahead on their own. A lane that cannot run ahead at all is ticked
+// once instead, so every lane makes progress.
+static void ensembleRunAhead(struct ensembleLane **lanes, unsigned n) {
+  struct laneGroup g; // The lanes run together
+  struct machine *leader = NULL; // The lane whose program the kernel runs
+  bool inKernel[ensembleWidth]; // Lanes the kernel runs
+
+  memset(&g, 0, sizeof(g));
+
+  // Gather the lanes that can run together
+  for (unsigned i = 0; i < n; i++) {
+    struct ensembleLane *lane = lanes[i];
+    inKernel[i] = false;
+    if (0 == lane->aheadMax || !cpuLaneReady(lane->m)) {
+      continue;
+    }
+    if (NULL == leader) {
+      leader = lane->m;
+    }
+    if (!ensembleSameProgram(lane, leader)) {
+      continue;
+    }
+
+    uint8_t regs[8]; // The lane's registers
+    uint8_t pc;      // The lane's pc
+    cpuLaneLoad(lane->m, regs, &pc);
+    for (int r = 0; r < 8; r++) {
+      g.regs[r][i] = regs[r];
+    }
+    g.pc[i] = pc;
+    g.left[i] = lane->aheadMax;
+    g.active[i] = -1;
+    inKernel[i] = true;
+  }
+
+  if (NULL != leader) {
+    ensembleKernel(leader, &g);
+  }
+
+  // Hand the results back to the lanes' clocks
+  for (unsigned i = 0; i < n; i++) {
+    struct ensembleLane *lane = lanes[i];
+    unsigned ticks; // Ticks the lane's cpu ran ahead
+
+    if (0 == lane->aheadMax) {
+      continue;
+    }
+
+    if (inKernel[i]) {
+      uint8_t regs[8]; // The lane's registers
+      for (int r = 0; r < 8; r++) {
+        regs[r] = g.regs[r][i];
+      }
+      ticks = lane->aheadMax - g.left[i];
+      cpuLaneStore(lane->m, regs, g.pc[i], ticks, g.count[i]);
+    }
+    else {
+      ticks = cpuRunAhead(lane->m, lane->aheadMax);
+    }
+
+    if (ticks > 0) {
+      clockAheadDone(lane->m, ticks);
+    }
+    else {
+      clockTickOnce(lane->m);
+      ticks = 1;
+    }
+    lane->ticksLeft -= ticks;
+    lane->aheadMax = 0;
+  }
+}
+
+// Perform the ticks the lanes of a group are waiting on. Each lane ticks
+// on its own until its cpu could run ahead, then the group runs ahead
+// together.
+static void ensembleTickGroup(struct ensembleLane **lanes, unsigned n) {
+  bool busy = true; // Indicates a lane has ticks left
+
+  while (busy) {
+    for (unsigned i = 0; i < n; i++) {
+      struct ensembleLane *lane = lanes[i];
+      if (lane->ticksLeft > 0) {
+        lane->ticksLeft -= clockRunToAhead(lane->m, lane->ticksLeft, &lane->aheadMax);
+      }
+    }
+
+    ensembleRunAhead(lanes, n);
+
+    busy = false;
+    for (unsigned i = 0; i < n; i++) {
+      busy = busy || lanes[i]->ticksLeft > 0;
+    }
+  }
+}
+
+// Run a lane's script up to its next "clock tick", leaving the ticks for
+// the ensemble. Marks the lane done when the script ends.
+static void ensembleReadLane(struct ensembleLane *lane) {
+  char device[11]; // The device being called
+  char cmd[11];    // The clock command
+  int ticks;       // The ticks of a "clock tick"
+
+  while (1 == fscanf(lane->infile, "%10s", device)) {
+    if (0 != strcmp(device, "clock")) {
+      machineCommand(lane->m, device, lane->infile);
+      continue;
+    }
+
+    fscanf(lane->infile, "%10s", cmd);
+    if (0 != strcmp(cmd, "tick")) {
+      clockCommand(lane->m, cmd, lane->infile);
+      continue;
+    }
+
+    fscanf(lane->infile, "%d", &ticks);
+    if (ticks > 0) {
+      lane->ticksLeft = ticks;
+      return;
+    }
+  }
+  lane->done = true;
+}
+
+// Run count scripts as an ensemble: each on a machine of its own, writing
+// its output to the script's path with ".out" added, with the cpus of
+// machines running the same program run together in vector lanes.
+// Returns the number of scripts that could not be run.
+int ensembleRun(char **scripts, unsigned count) {
+  struct ensembleLane *lanes = calloc(count, sizeof(struct ensembleLane));
+  struct ensembleLane **group = malloc(count * sizeof(struct ensembleLane *));
+  char outName[PATH_MAX + 5]; // The path of an output file
+  int failed = 0; // Scripts that could not be run
+
+  // Open the scripts and create their machines
+  for (unsigned i = 0; i < count; i++) {
+    struct ensembleLane *lane = &lanes[i];
+    snprintf(outName, sizeof(outName), "%s.out", scripts[i]);
+
+    lane->infile = fopen(scripts[i], "r");
+    lane->outfile = (NULL == lane->infile) ? NULL : fopen(outName, "w");
+    if (NULL == lane->outfile) {
+      fprintf(stderr, "Cannot run %s\n", scripts[i]);
+      if (NULL != lane->infile) {
+        fclose(lane->infile);
+      }
+      lane->done = true;
+      failed++;
+      continue;
+    }
+    lane->m = machineCreate(lane->outfile);
+  }
+
+  while (true) {
+    unsigned waiting = 0; // Lanes waiting on ticks
+
+    // Run every script up to its next tick
+    for (unsigned i = 0; i < count; i++) {
+      if (!lanes[i].done && 0 == lanes[i].ticksLeft) {
+        ensembleReadLane(&lanes[i]);
+      }
+      if (lanes[i].ticksLeft > 0) {
+        group[waiting++] = &lanes[i];
+      }
+    }
+    if (0 == waiting) {
+      break;
+    }
+
+    // Tick them a vector's worth of lanes at a time
+    for (unsigned first = 0; first < waiting; first += ensembleWidth) {
+      unsigned n = waiting - first; // Lanes in this group
+      ensembleTickGroup(group + first, (n < ensembleWidth) ? n : ensembleWidth);
+    }
+  }
+
+  for (unsigned i = 0; i < count; i++) {
+    if (NULL != lanes[i].m) {
+      machineDestroy(lanes[i].m);
+      fclose(lanes[i].outfile);
+      fclose(lanes[i].infile);
+    }
+  }
+  free(group);
+  free(lanes);
+
+  return failed;
+}
@@ -0,0 +1,6 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+int ensembleRun(char **scripts, unsigned count);
+
+#endif
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+
+// Map an image file into memory and check it has the magic and holds the
+// count of unit sized words or bytes its header says. Returns NULL when it
+// does, or what is wrong with it.
+const char *imageMap(struct image *image, const char *path, const char *magic, size_t unit) {
+  int fd = open(path, O_RDONLY); // The image file
+  struct stat st; // The file's size
+
+  image->map = MAP_FAILED;
+  if (fd < 0 || 0 != fstat(fd, &st)) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return "cannot be opened";
+  }
+  image->mapSize = st.st_size;
+  if (image->mapSize >= sizeof(struct imageHeader)) {
+    image->map = mmap(NULL, image->mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (MAP_FAILED == image->map) {
+    return "is not an image";
+  }
+
+  memcpy(&image->header, image->map, sizeof(struct imageHeader));
+  image->header.version = le32toh(image->header.version);
+  image->header.address = le32toh(image->header.address);
+  image->header.count = le32toh(image->header.count);
+  image->contents = (const uint8_t *)image->map + sizeof(struct imageHeader);
+  if (0 != memcmp(image->header.magic, magic, sizeof(image->header.magic))) {
+    imageUnmap(image);
+    return "is not an image of this kind";
+  }
+  if (imageVersion != image->header.version) {
+    imageUnmap(image);
+    return "was written in another image format";
+  }
+  if ((image->mapSize - sizeof(struct imageHeader)) / unit < image->header.count) {
+    imageUnmap(image);
+    return "is cut short";
+  }
+  return NULL;
+}
+
+// Unmap an image mapped by imageMap
+void imageUnmap(struct image *image) {
+  if (MAP_FAILED != image->map) {
+    munmap(image->map, image->mapSize);
+    image->map = MAP_FAILED;
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+#include <stdint.h>
+#include <stddef.h>
+
+// Binary images of a program for "imemory load" and of data for "memory
+// load", written by tools/entropy2img. An image is this header followed by
+// its contents: 32 bit words for a program, bytes for data. The header's
+// values and the words are little endian.
+#define imageVersion 1
+#define imageProgramMagic "ENTRPROG"
+#define imageDataMagic "ENTRDATA"
+
+struct imageHeader {
+  char magic[8];     // imageProgramMagic or imageDataMagic
+  uint32_t version;  // imageVersion
+  uint32_t address;  // Where a program is set in imemory, 0 for data
+  uint32_t count;    // The words or bytes that follow
+  uint32_t reserved; // Keeps the contents 8 byte aligned
+};
+
+// An image mapped into memory
+struct image {
+  struct imageHeader header; // The image's header
+  const void *contents;      // The words or bytes after the header
+  void *map;                 // The whole file as mapped
+  size_t mapSize;            // The size of the file
+};
+
+const char *imageMap(struct image *image, const char *path, const char *magic, size_t unit);
+void imageUnmap(struct image *image);
+
+#endif
@@ -2,29 +2,85 @@
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <stdbool.h>
+#include <dlfcn.h>
+#include <endian.h>
+#include "imemory.h"
+#include "image.h"
+#include "snapshot.h"
 
-static unsigned *iMemPtr; // The imemory array
-static unsigned iMemSize; // The size of the imemory array
+
+// The state of one machine's imemory
+struct iMemContext {
+  unsigned *iMemPtr; // The imemory array
+  struct decodedInstr *iMemDecoded; // The imemory array decoded into fields
+  unsigned iMemSize; // The size of the imemory array
+  unsigned iMemGen; // Bumped whenever the contents of imemory change
+  bool iMemBranchTargets[256]; // Marks the pcs a branch in imemory jumps to
+  void *nativeHandle; // The translated program loaded with "set native"
+  nativeRunFn nativeRun; // The translated program's entry point
+  unsigned nativeGen; // The imemory generation the translated program matches
+  unsigned fetchLatency; // Ticks a fetch takes, 0 when fetches are free
+  bool fetchBusy; // Indicates a fetch is in progress
+  unsigned fetchTicks; // Ticks the fetch in progress has taken
+  bool *fetchDonePtr; // Set when the fetch in progress is done
+};
+
+// Allocate the imemory of a new machine
+struct iMemContext *iMemContextCreate() {
+  struct iMemContext *imem = calloc(1, sizeof(struct iMemContext));
+  return imem;
+}
+
+// Split an instruction word into its fields
+static void decodeInstr(unsigned word, struct decodedInstr *decoded) {
+  decoded->code = (word >> 17) & 0x7;
+  decoded->dest = (word >> 14) & 0x7;
+  decoded->src = (word >> 11) & 0x7;
+  decoded->trgt = (word >> 8) & 0x7;
+  decoded->imm = word & 0xFF;
+}
+
+// Mark every pc that a branch in imemory jumps to
+static void iMemoryMarkBranchTargets(struct machine *m) {
+  struct iMemContext *imem = m->imem;
+  memset(imem->iMemBranchTargets, 0, sizeof(imem->iMemBranchTargets));
+  for (unsigned i = 0; i < imem->iMemSize; i++) {
+    if (BRANCH == imem->iMemDecoded[i].code) {
+      imem->iMemBranchTargets[imem->iMemDecoded[i].imm] = true;
+    }
+  }
+}
 
 // Allocates the designated ammount of imemory
-static void iMemoryCreate(FILE *infile) {
+static void iMemoryCreate(struct machine *m, FILE *infile) {
+  struct iMemContext *imem = m->imem;
   // Get the size
-  fscanf(infile, "%x", &iMemSize);
+  fscanf(infile, "%x", &imem->iMemSize);
 
-  iMemPtr = malloc(iMemSize*sizeof(unsigned));
+  imem->iMemPtr = malloc(imem->iMemSize*sizeof(unsigned));
+  imem->iMemDecoded = malloc(imem->iMemSize*sizeof(struct decodedInstr));
+  imem->iMemGen++;
 }
 
 // Reset the imemory allocated to zeros
-static void iMemoryReset() {
+static void iMemoryReset(struct machine *m) {
+  struct iMemContext *imem = m->imem;
   
-  for (unsigned i = 0; i < iMemSize; i++) {
-    iMemPtr[i] = 0;
+  for (unsigned i = 0; i < imem->iMemSize; i++) {
+    imem->iMemPtr[i] = 0;
   } 
+
+  // A zero word decodes to all zero fields
+  memset(imem->iMemDecoded, 0, imem->iMemSize*sizeof(struct decodedInstr));
+  iMemoryMarkBranchTargets(m);
+  imem->iMemGen++;
 }
 
 // Dump the imemory starting at the given address
 // and dumping the given number of words
-static void iMemoryDump(FILE *infile) {
+static void iMemoryDump(struct machine *m, FILE *infile) {
+  struct iMemContext *imem = m->imem;
   unsigned address; // The address to start at
   unsigned count; // The amount to print
   
@@ -35,23 +91,23 @@ static void iMemoryDump(FILE *infile) {
   fscanf(infile, "%x", &count);
   
   // Print the header
-  printf("Addr");
+  fprintf(m->out, "Addr");
   for (int i = 0; i < 8; i++) {
-    printf("    %2X",i);
+    fprintf(m->out, "    %2X",i);
   }
-  printf("\n"); 
+  fprintf(m->out, "\n"); 
 
   // Print the address of the start row
-  printf("0x%02X",(address / 0x8) * 0x8);
+  fprintf(m->out, "0x%02X",(address / 0x8) * 0x8);
 
   // Print the blank spaces before the first word to print
   for (unsigned i = 0; i < (address % 0x8); i++) {
-    printf("      ");
+    fprintf(m->out, "      ");
   }
 
   // Print the memory contents 
   for (unsigned i = address; i < address+count; i++) {
-    printf(" %05X",iMemPtr[i]);
+    fprintf(m->out, " %05X",imem->iMemPtr[i]);
 
     // Print a newline at mutliples of 0x8
     if(7 == i % 0x8) {
@@ -59,22 +115,89 @@ static void iMemoryDump(FILE *infile) {
       // Unless the last word has been printed
       if(i != address+count-1) {     
         // Print a new line and the row's address label
-        printf("\n0x%02X",(i+0x01));
+        fprintf(m->out, "\n0x%02X",(i+0x01));
       }
     }
   }
   // Put an empty newline after the dump
-  printf("\n\n"); 
+  fprintf(m->out, "\n\n"); 
   
 }
 
+// Set the words of a program into imemory starting at address
+static void iMemoryStore(struct machine *m, unsigned address, const unsigned *words, unsigned count) {
+  struct iMemContext *imem = m->imem;
+  for (unsigned i = 0; i < count; i++) {
+    imem->iMemPtr[address + i] = words[i];
+    decodeInstr(words[i], &imem->iMemDecoded[address + i]);
+  }
+}
+
+// Load a program translated by tools/entropy2c. Its words are set into
+// imemory as usual and its native code runs them for the cpu.
+static void iMemorySetNative(struct machine *m, unsigned address, const char *libName) {
+  struct iMemContext *imem = m->imem;
+  char libPath[NAME_MAX + PATH_MAX + 3]; // The path to give dlopen
+
+  // A bare file name is relative to the current directory, not a library
+  snprintf(libPath, sizeof(libPath), "%s%s", strchr(libName, '/') ? "" : "./", libName);
+
+  // Unload the last translated program
+  if (NULL != imem->nativeHandle) {
+    dlclose(imem->nativeHandle);
+    imem->nativeHandle = NULL;
+    imem->nativeRun = NULL;
+  }
+
+  void *handle = dlopen(libPath, RTLD_NOW | RTLD_LOCAL);
+  if (NULL == handle) {
+    fprintf(m->out, "Cannot load %s: %s\n\n", libPath, dlerror());
+    return;
+  }
+
+  // Look up the program
+  const unsigned *version = dlsym(handle, "entropyAbiVersion");
+  const unsigned *base = dlsym(handle, "entropyBase");
+  const unsigned *count = dlsym(handle, "entropyWordCount");
+  const unsigned *words = dlsym(handle, "entropyWords");
+  nativeRunFn run = (nativeRunFn)dlsym(handle, "entropyRun");
+  if (NULL == version || NULL == base || NULL == count || NULL == words ||
+      NULL == run || 1 != *version) {
+    fprintf(m->out, "%s is not a translated Entropy program\n\n", libPath);
+    dlclose(handle);
+    return;
+  }
+  if (address > imem->iMemSize || *count > imem->iMemSize - address) {
+    fprintf(m->out, "%s does not fit in imemory\n\n", libPath);
+    dlclose(handle);
+    return;
+  }
+
+  iMemoryStore(m, address, words, *count);
+  iMemoryMarkBranchTargets(m);
+  imem->iMemGen++;
+
+  // The native code only matches imemory if it was translated for address
+  if (*base != address) {
+    fprintf(m->out, "%s was translated for 0x%02X, running it from imemory\n\n", libPath, *base);
+    dlclose(handle);
+    return;
+  }
+  imem->nativeHandle = handle;
+  imem->nativeRun = run;
+  imem->nativeGen = imem->iMemGen;
+}
+
 // Set the iMemory to the given values
 // This method works with two different files:
 //     The input file with system commands called infile
 //     The cpu instruction file with cpu instructions called instrFile
-static void iMemorySet(FILE *infile) {
+// or, with "native" in place of "file", a program translated by entropy2c
+static void iMemorySet(struct machine *m, FILE *infile) {
+  struct iMemContext *imem = m->imem;
   
   unsigned address; // The address to start at
+  char form[11]; // "file" or "native"
   char instrFileName[NAME_MAX + PATH_MAX + 1]; // The path of the instruction file
   FILE *instrFile; // The file with the cpu instructions
   unsigned inWord; // The input word 
@@ -82,12 +205,18 @@ static void iMemorySet(FILE *infile) {
   // Get the address
   fscanf(infile, "%x", &address);  
 
-  // Read "file" to skip over it
-  fscanf(infile, "%10s", instrFileName);
+  // Read "file" or "native"
+  fscanf(infile, "%10s", form);
 
   // Read the instruction file's path
   fscanf(infile, "%1000s", instrFileName);
 
+  // Load a translated program
+  if (0 == strcmp(form, "native")) {
+    iMemorySetNative(m, address, instrFileName);
+    return;
+  }
+
   // Open the instruction file
   instrFile = fopen(instrFileName, "r"); 
 
@@ -97,31 +226,248 @@ static void iMemorySet(FILE *infile) {
   // Read the whole file and set the values at the given address
   while (1 == fscanf(instrFile, "%x", &inWord)) {
 
-    // Set the word into memory
-    iMemPtr[i] = inWord; 
+    // Set the word into memory and keep its decoded form in sync
+    iMemoryStore(m, i, &inWord, 1);
 
     i++; // Increment the index variable
   }
 
   // Close the file
   fclose(instrFile);
+
+  iMemoryMarkBranchTargets(m);
+  imem->iMemGen++;
+}
+
+// Set a program image written by tools/entropy2img into imemory at the
+// address it was made for. The file is mapped and its words decoded
+// straight out of the mapping rather than parsed as text.
+static void iMemoryLoad(struct machine *m, FILE *infile) {
+  struct iMemContext *imem = m->imem;
+  char imageName[NAME_MAX + PATH_MAX + 1]; // The path of the image
+  struct image image; // The image mapped into memory
+  const char *error; // What is wrong with the image
+
+  // Read the image's path
+  fscanf(infile, "%1000s", imageName);
+
+  error = imageMap(&image, imageName, imageProgramMagic, sizeof(uint32_t));
+  if (NULL != error) {
+    fprintf(m->out, "%s %s\n\n", imageName, error);
+    return;
+  }
+
+  unsigned address = image.header.address; // Where the program goes
+  unsigned count = image.header.count; // The words in the program
+  if (address > imem->iMemSize || count > imem->iMemSize - address) {
+    fprintf(m->out, "%s does not fit in imemory\n\n", imageName);
+    imageUnmap(&image);
+    return;
+  }
+
+  // Set the words and keep their decoded form in sync
+  const uint32_t *words = image.contents; // The words as mapped
+  for (unsigned i = 0; i < count; i++) {
+    imem->iMemPtr[address + i] = le32toh(words[i]);
+    decodeInstr(imem->iMemPtr[address + i], &imem->iMemDecoded[address + i]);
+  }
+  imageUnmap(&image);
+
+  iMemoryMarkBranchTargets(m);
+  imem->iMemGen++;
 }
 
 // Fetch an instruction and 
-unsigned iMemFetch(unsigned address) {
-  unsigned rVal = iMemPtr[address];
+unsigned iMemFetch(struct machine *m, unsigned address) {
+  struct iMemContext *imem = m->imem;
+  unsigned rVal = imem->iMemPtr[address];
   return rVal;
 }
 
+// Start a timed fetch of instructions for the cpu or the I-cache, setting
+// *donePtr once fetchLatency ticks have passed, or at once when it is 0.
+// The instructions are read from imemory as they are performed, so only
+// the time a fetch takes is modeled.
+void iMemStartFetch(struct machine *m, bool *donePtr) {
+  struct iMemContext *imem = m->imem;
+  imem->fetchTicks = 0;
+  imem->fetchDonePtr = donePtr;
+  imem->fetchBusy = (imem->fetchLatency > 0);
+  if (!imem->fetchBusy) {
+    *donePtr = true;
+  }
+}
+
+// Count down the fetch in progress at the start of a tick
+void iMemStartTick(struct machine *m) {
+  struct iMemContext *imem = m->imem;
+  if (imem->fetchBusy && ++imem->fetchTicks >= imem->fetchLatency) {
+    imem->fetchBusy = false;
+    *imem->fetchDonePtr = true;
+  }
+}
+
+// Get the number of ticks until the fetch in progress is done, counting
+// the tick it happens on. UINT_MAX means there is none.
+unsigned iMemTicksToNextEvent(struct machine *m) {
+  struct iMemContext *imem = m->imem;
+  if (!imem->fetchBusy) {
+    return UINT_MAX;
+  }
+  return (imem->fetchTicks < imem->fetchLatency) ? imem->fetchLatency - imem->fetchTicks : 1;
+}
+
+// Account for ticks on which imemory only counts down its fetch
+void iMemSkipTicks(struct machine *m, unsigned ticks) {
+  struct iMemContext *imem = m->imem;
+  if (imem->fetchBusy) {
+    imem->fetchTicks += ticks;
+  }
+}
+
+// Get the ticks a fetch takes, 0 when fetches are free
+unsigned iMemFetchLatency(struct machine *m) {
+  struct iMemContext *imem = m->imem;
+  return imem->fetchLatency;
+}
+
+// Set the ticks a fetch takes, 0 to make fetches free again
+static void iMemorySetLatency(struct machine *m, FILE *infile) {
+  struct iMemContext *imem = m->imem;
+
+  unsigned latency = 0; // The ticks
+
+  // Get the latency
+  if (1 != fscanf(infile, "%u", &latency)) {
+    fprintf(m->out, "Usage: imemory latency <ticks>\n\n");
+    return;
+  }
+  imem->fetchLatency = latency;
+}
+
+// Fetch the decoded form of the instruction at address. A wide pc can pass
+// the end of imemory; fetches there read a zero word, as loads past the
+// end of memory read zeros.
+const struct decodedInstr *iMemFetchDecoded(struct machine *m, unsigned address) {
+  struct iMemContext *imem = m->imem;
+  static const struct decodedInstr zeroInstr; // The decoded zero word
+  if (address >= imem->iMemSize) {
+    return &zeroInstr;
+  }
+  return &imem->iMemDecoded[address];
+}
+
+
+// Check if a branch in imemory jumps to address. Branches stay within the
+// page they are taken in, so in wide mode any page's offset can be a target.
+bool iMemIsBranchTarget(struct machine *m, unsigned address) {
+  struct iMemContext *imem = m->imem;
+  return imem->iMemBranchTargets[address & 0xFF];
+}
+
+// Get the number of words in imemory
+unsigned iMemGetSize(struct machine *m) {
+  struct iMemContext *imem = m->imem;
+  return imem->iMemSize;
+}
+
+// Check if two machines have the same program in imemory
+bool iMemSameProgram(struct machine *m, struct machine *other) {
+  struct iMemContext *imem = m->imem;
+  return imem->iMemSize == other->imem->iMemSize &&
+         0 == memcmp(imem->iMemPtr, other->imem->iMemPtr, imem->iMemSize * sizeof(unsigned));
+}
+
+// Get the current generation of imemory so translations of it can
+// tell when they are out of date
+unsigned iMemGeneration(struct machine *m) {
+  struct iMemContext *imem = m->imem;
+  return imem->iMemGen;
+}
+
+// Get the native code of the translated program in imemory, NULL if
+// there is none or imemory has changed since it was set
+nativeRunFn iMemNativeProgram(struct machine *m) {
+  struct iMemContext *imem = m->imem;
+  return (imem->nativeGen == imem->iMemGen) ? imem->nativeRun : NULL;
+}
+
+// Write the imemory's fetch latency and fetch in progress to a snapshot
+void iMemSaveState(struct machine *m, FILE *f) {
+  struct iMemContext *imem = m->imem;
+  snapWrite(f, &imem->fetchLatency, sizeof(imem->fetchLatency));
+  snapWrite(f, &imem->fetchBusy, sizeof(imem->fetchBusy));
+  snapWrite(f, &imem->fetchTicks, sizeof(imem->fetchTicks));
+  snapWritePointer(m, f, imem->fetchDonePtr);
+}
+
+// Set the imemory's fetch latency and fetch in progress from a snapshot
+void iMemRestoreState(struct machine *m, struct snapReader *r) {
+  struct iMemContext *imem = m->imem;
+  snapRead(r, &imem->fetchLatency, sizeof(imem->fetchLatency));
+  snapRead(r, &imem->fetchBusy, sizeof(imem->fetchBusy));
+  snapRead(r, &imem->fetchTicks, sizeof(imem->fetchTicks));
+  imem->fetchDonePtr = snapReadPointer(m, r);
+
+  // A fetch must have somewhere to answer
+  if (imem->fetchBusy && NULL == imem->fetchDonePtr) {
+    imem->fetchBusy = false;
+    r->bad = true;
+  }
+}
+
+// Write the imemory and its fetch in progress to a snapshot
+void iMemSave(struct machine *m, FILE *f) {
+  struct iMemContext *imem = m->imem;
+  snapWrite(f, &imem->iMemSize, sizeof(imem->iMemSize));
+  snapWrite(f, imem->iMemPtr, imem->iMemSize*sizeof(unsigned));
+  iMemSaveState(m, f);
+}
+
+// Set the imemory and its fetch in progress from a snapshot, decoding its words again
+void iMemRestore(struct machine *m, struct snapReader *r) {
+  struct iMemContext *imem = m->imem;
+  unsigned size = 0; // The number of saved words
+  const void *words; // The saved words where the snapshot is mapped
+
+  snapRead(r, &size, sizeof(size));
+  words = snapReadInPlace(r, size*sizeof(unsigned));
+  if (NULL == words) {
+    return;
+  }
+
+  // Make room for the saved words when their number differs
+  if (size != imem->iMemSize) {
+    free(imem->iMemPtr);
+    free(imem->iMemDecoded);
+    imem->iMemSize = size;
+    imem->iMemPtr = malloc(imem->iMemSize*sizeof(unsigned));
+    imem->iMemDecoded = malloc(imem->iMemSize*sizeof(struct decodedInstr));
+  }
+
+  // The mapping need not be aligned for unsigned, so copy it out first
+  memcpy(imem->iMemPtr, words, size*sizeof(unsigned));
+  for (unsigned i = 0; i < size; i++) {
+    decodeInstr(imem->iMemPtr[i], &imem->iMemDecoded[i]);
+  }
+  iMemoryMarkBranchTargets(m);
+  imem->iMemGen++;
+  iMemRestoreState(m, r);
+}
 
 // Free the imemory
-void iMemClean() {
-  free(iMemPtr);
+void iMemClean(struct machine *m) {
+  struct iMemContext *imem = m->imem;
+  free(imem->iMemPtr);
+  free(imem->iMemDecoded);
+  if (NULL != imem->nativeHandle) {
+    dlclose(imem->nativeHandle);
+  }
 }
 
 
 // Read imemory commands from the file and call the functions
-void parseIMemory(FILE *infile) {
+void parseIMemory(struct machine *m, FILE *infile) {
 
   char cmd[11]; // The command to do
 
@@ -132,18 +478,26 @@ void parseIMemory(FILE *infile) {
 
   // Calls the create function
   if (0 == strcmp(cmd, "create")) {
-    iMemoryCreate(infile);
+    iMemoryCreate(m, infile);
   }
   // Calls the reset function
   else if (0 == strcmp(cmd, "reset")) {
-    iMemoryReset();
+    iMemoryReset(m);
   }
   // Calls the dump function
   else if (0 == strcmp(cmd, "dump")) {
-    iMemoryDump(infile);
+    iMemoryDump(m, infile);
   }
   // Calls the set function
   else if (0 == strcmp(cmd, "set")) {
-    iMemorySet(infile);
+    iMemorySet(m, infile);
+  }
+  // Calls the load function
+  else if (0 == strcmp(cmd, "load")) {
+    iMemoryLoad(m, infile);
+  }
+  // Calls the latency function
+  else if (0 == strcmp(cmd, "latency")) {
+    iMemorySetLatency(m, infile);
   }
 }
\ No newline at end of file
@@ -1,9 +1,46 @@
 #ifndef IMEMORY_H
 #define IMEMORY_H
 #include <stdio.h> 
+#include <stdint.h>
+#include <stdbool.h>
+#include "machine.h"
+#include "snapshot.h"
 
-int parseIMemory(FILE *infile); 
-unsigned iMemFetch();
-void iMemClean();
+enum cpu_instr_T { ADD = 0, ADDI = 1, MUL = 2, INV = 3, BRANCH = 4, LOAD = 5, STORE = 6, HALTINSTR = 7};
+enum cpu_branch_T { BEQ = 0, BNEQ = 1, BLT = 2};
+
+// An instruction word split into its fields once, when imemory is set
+struct decodedInstr {
+  uint8_t code; // The three bit instruction encoding
+  uint8_t dest; // The destination register selector
+  uint8_t src;  // The source register selector
+  uint8_t trgt; // The target register selector
+  uint8_t imm;  // The immediate value
+};
+
+// Entry point of a program translated by tools/entropy2c: runs whole
+// instructions from *pc while they fit in maxTicks, returns the ticks used
+typedef uint64_t (*nativeRunFn)(uint8_t *regs, unsigned *pc, uint64_t maxTicks,
+                                uint64_t *instructions);
+
+struct iMemContext *iMemContextCreate();
+void parseIMemory(struct machine *m, FILE *infile); 
+unsigned iMemFetch(struct machine *m, unsigned address);
+const struct decodedInstr *iMemFetchDecoded(struct machine *m, unsigned address);
+void iMemStartFetch(struct machine *m, bool *donePtr);
+void iMemStartTick(struct machine *m);
+unsigned iMemTicksToNextEvent(struct machine *m);
+void iMemSkipTicks(struct machine *m, unsigned ticks);
+unsigned iMemFetchLatency(struct machine *m);
+unsigned iMemGetSize(struct machine *m);
+bool iMemIsBranchTarget(struct machine *m, unsigned address);
+unsigned iMemGeneration(struct machine *m);
+bool iMemSameProgram(struct machine *m, struct machine *other);
+nativeRunFn iMemNativeProgram(struct machine *m);
+void iMemClean(struct machine *m);
+void iMemSave(struct machine *m, FILE *f);
+void iMemRestore(struct machine *m, struct snapReader *r);
+void iMemSaveState(struct machine *m, FILE *f);
+void iMemRestoreState(struct machine *m, struct snapReader *r);
 
 #endif
\ No newline at end of file
@@ -1,40 +1,61 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <limits.h>
 #include <stdbool.h>
 #include "memory.h"
+#include "iodev.h"
+#include "snapshot.h"
 
 enum iodev_ops_T {READ = 1, WRITE = 2};
-static uint8_t reg; // IO device register
-static unsigned iodevTicks[100]; // Holds the ticks read in from the file sequentially
-static enum iodev_ops_T iodevOps[100]; // Holds the operations read in from the file sequentially 
-static unsigned iodevAddresses[100]; // Holds the Addresses read in from the file sequentially
-static unsigned iodevValues[100]; // Holds the inpute values read in from the file sequentially
-static bool iodevOpDone = true; // Indicates when the IO device has completed an operation with memory
-static unsigned currentOp = 0; // Keeps track of the operation to be completed next
-static uint8_t storeVal[1]; // Pointer that holds the value to be stored
-static bool iodevValid[1]; // Tells memory the value stored in the register is valid
-static uint16_t iodevTotTicks = 0; // Count the total ticks the device is called for from the clock
+
+// The state of one machine's io device
+struct iodevContext {
+  uint8_t reg; // IO device register
+  unsigned iodevTicks[100]; // Holds the ticks read in from the file sequentially
+  enum iodev_ops_T iodevOps[100]; // Holds the operations read in from the file sequentially 
+  unsigned iodevAddresses[100]; // Holds the Addresses read in from the file sequentially
+  unsigned iodevValues[100]; // Holds the inpute values read in from the file sequentially
+  bool iodevOpDone; // Indicates when the IO device has completed an operation with memory
+  unsigned currentOp; // Keeps track of the operation to be completed next
+  uint8_t storeVal[maxMemQueueDepth]; // The values of the stores memory holds, one per request it can queue
+  unsigned storeSlot; // The entry of storeVal the next store uses
+  bool waiting; // Indicates memory's queue was full, so the current operation is tried again next tick
+  bool iodevValid[1]; // Tells memory the value stored in the register is valid
+  uint16_t iodevTotTicks; // Count the total ticks the device is called for from the clock
+  unsigned scheduleGen; // Bumped whenever the schedule is replaced
+};
+
+// Allocate the io device of a new machine
+struct iodevContext *iodevContextCreate() {
+    struct iodevContext *io = calloc(1, sizeof(struct iodevContext));
+    io->iodevOpDone = true;
+    return io;
+}
 
 // Clear the io device's register
-static void iodevReset() {
-  reg = 0;
+static void iodevReset(struct machine *m) {
+  struct iodevContext *io = m->iodev;
+  io->reg = 0;
 
   // Clear the schedule arrays
   for(int i=0; i<100;i++) {
-    iodevTicks[i] = 0;
-    iodevOps[i] = 0;
-    iodevAddresses[i] = 0;
-    iodevValues[i] = 0;
+    io->iodevTicks[i] = 0;
+    io->iodevOps[i] = 0;
+    io->iodevAddresses[i] = 0;
+    io->iodevValues[i] = 0;
   }
+  io->waiting = false;
+  io->scheduleGen++;
 }
 
 // Load the IO devices event schedule from a file
 // This method works with two different files:
 //     The input file with system commands called infile
 //     The IO Device file with its event schedule called eventFile
-static void iodevLoad(FILE *infile) {
+static void iodevLoad(struct machine *m, FILE *infile) {
+    struct iodevContext *io = m->iodev;
     char eventFileName[NAME_MAX + PATH_MAX + 1]; // The path of the instruction file
     FILE *eventFile; // The file with the I/O event schedule
     unsigned tick; // The tick the event is to occur during
@@ -53,27 +74,27 @@ static void iodevLoad(FILE *infile) {
   
     // Read the whole file and set the values at the given address
     while (1 == fscanf(eventFile, "%d", &tick)) { // Get the target tick
-        iodevTicks[i] = tick; // Save the target tick to the array
+        io->iodevTicks[i] = tick; // Save the target tick to the array
 
         // Get the operation
         fscanf(eventFile, "%5s", operation);
     
         // Save the operation to the array
         if(0 == strcmp(operation, "read")) {
-            iodevOps[i] = READ;
+            io->iodevOps[i] = READ;
         } else if (0 == strcmp(operation, "write")) {
-            iodevOps[i] = WRITE;
+            io->iodevOps[i] = WRITE;
         }
 
         // Get the address
         fscanf(eventFile, "%x", &address);
-        iodevAddresses[i] = address; // Save the address to the array
+        io->iodevAddresses[i] = address; // Save the address to the array
 
         // If the operation is a "write" get the value to write
         if(0 == strcmp(operation, "write")) {
             // Get the input value
             fscanf(eventFile, "%x", &inValue);
-            iodevValues[i] = inValue; // Save the input value to the array
+            io->iodevValues[i] = inValue; // Save the input value to the array
         }
 
          i++; // Increment the index variable
@@ -82,37 +103,161 @@ static void iodevLoad(FILE *infile) {
 
     // Close the file
     fclose(eventFile);
+    io->waiting = false;
+    io->scheduleGen++;
 }
 
 // Dump the contents of the register
-static void iodevDump() {
-    printf("IO Device: 0x%02X\n\n", reg);
+static void iodevDump(struct machine *m) {
+    struct iodevContext *io = m->iodev;
+    fprintf(m->out, "IO Device: 0x%02X\n\n", io->reg);
 }
 
 // Handle the work done in a tick
-void iodevStartTick() {
+void iodevStartTick(struct machine *m) {
+    struct iodevContext *io = m->iodev;
     
-    iodevTotTicks++;
+    io->iodevTotTicks++;
 
-    // Determine if there is an operation to complete on this tick
-    if(iodevTotTicks == iodevTicks[currentOp]) {
+    // Determine if there is an operation to complete on this tick, or one
+    // memory had no room for
+    if(io->waiting || io->iodevTotTicks == io->iodevTicks[io->currentOp]) {
         // Perform the appropriate operation
-        if(iodevOps[currentOp] == READ) {
-            memStartFetch(iodevAddresses[currentOp], 1, &reg, &iodevOpDone);
-            currentOp++; // Increment to the next operation
-        } else if (iodevOps[currentOp] == WRITE) {
-            storeVal[0] = iodevValues[currentOp];
-            iodevValid[0] = true; 
-            memStartStore(iodevAddresses[currentOp], 1, storeVal, iodevValid, &iodevOpDone); 
-            currentOp++; // Increment to the next operation      
+        if(io->iodevOps[io->currentOp] == READ) {
+            io->waiting = !memStartFetch(m, MEM_PORT_IODEV, io->iodevAddresses[io->currentOp], 1, &io->reg,
+                                         &io->iodevOpDone);
+        } else if (io->iodevOps[io->currentOp] == WRITE) {
+            uint8_t *storeVal = &io->storeVal[io->storeSlot]; // Holds the value until memory stores it
+            *storeVal = io->iodevValues[io->currentOp];
+            io->iodevValid[0] = true; 
+            io->waiting = !memStartStore(m, MEM_PORT_IODEV, io->iodevAddresses[io->currentOp], 1, storeVal,
+                                         io->iodevValid, &io->iodevOpDone); 
+            if(!io->waiting) {
+                io->storeSlot = (io->storeSlot + 1) % maxMemQueueDepth;
+            }
+        }
+        if(!io->waiting) {
+            io->currentOp++; // Increment to the next operation
         }
     }
 
     
 }
 
+// Get the number of ticks until iodevStartTick() next starts a memory
+// operation, counting the tick it happens on. UINT_MAX means never.
+unsigned iodevTicksToNextEvent(struct machine *m) {
+    struct iodevContext *io = m->iodev;
+    // An operation memory had no room for is tried every tick
+    if(io->waiting) {
+        return 1;
+    }
+
+    // Only reads and writes do anything when their tick comes up
+    if(io->iodevOps[io->currentOp] != READ && io->iodevOps[io->currentOp] != WRITE) {
+        return UINT_MAX;
+    }
+
+    // The tick counter is 16 bits, so larger ticks are never reached
+    if(io->iodevTicks[io->currentOp] > UINT16_MAX) {
+        return UINT_MAX;
+    }
+
+    // Distance to the event, going all the way around if it is this tick
+    uint16_t distance = io->iodevTicks[io->currentOp] - io->iodevTotTicks;
+    if(0 == distance) {
+        return UINT16_MAX + 1;
+    }
+    return distance;
+}
+
+// Account for ticks on which the device has no operation to start
+void iodevSkipTicks(struct machine *m, unsigned ticks) {
+    struct iodevContext *io = m->iodev;
+    io->iodevTotTicks += ticks;
+}
+
+// Copy the state that decides what the device does next, other than the
+// tick count, into buf. Returns the bytes copied.
+unsigned iodevFingerprint(struct machine *m, uint8_t *buf) {
+    struct iodevContext *io = m->iodev;
+    unsigned n = 0; // Bytes copied
+    buf[n++] = io->reg;
+    buf[n++] = io->waiting;
+    memcpy(buf + n, &io->currentOp, sizeof(io->currentOp)); n += sizeof(io->currentOp);
+    return n;
+}
+
+// Get the current generation of the schedule so checkpoints can tell
+// when it has been replaced since they were taken
+unsigned iodevScheduleGeneration(struct machine *m) {
+    struct iodevContext *io = m->iodev;
+    return io->scheduleGen;
+}
+
+// List the io device's fields that memory answers into
+unsigned iodevSnapFields(struct machine *m, struct snapField *fields) {
+    struct iodevContext *io = m->iodev;
+    fields[0] = (struct snapField){&io->reg, sizeof(io->reg)};
+    fields[1] = (struct snapField){io->storeVal, sizeof(io->storeVal)};
+    fields[2] = (struct snapField){io->iodevValid, sizeof(io->iodevValid)};
+    fields[3] = (struct snapField){&io->iodevOpDone, sizeof(io->iodevOpDone)};
+    return 4;
+}
+
+// Write the io device's schedule and state to a snapshot
+void iodevSave(struct machine *m, FILE *f) {
+    struct iodevContext *io = m->iodev;
+    snapWrite(f, io->iodevTicks, sizeof(io->iodevTicks));
+    snapWrite(f, io->iodevOps, sizeof(io->iodevOps));
+    snapWrite(f, io->iodevAddresses, sizeof(io->iodevAddresses));
+    snapWrite(f, io->iodevValues, sizeof(io->iodevValues));
+    iodevSaveState(m, f);
+}
+
+// Write the io device's register and place in its schedule to a snapshot
+void iodevSaveState(struct machine *m, FILE *f) {
+    struct iodevContext *io = m->iodev;
+    snapWrite(f, &io->reg, sizeof(io->reg));
+    snapWrite(f, &io->iodevOpDone, sizeof(io->iodevOpDone));
+    snapWrite(f, &io->currentOp, sizeof(io->currentOp));
+    snapWrite(f, io->storeVal, sizeof(io->storeVal));
+    snapWrite(f, &io->storeSlot, sizeof(io->storeSlot));
+    snapWrite(f, &io->waiting, sizeof(io->waiting));
+    snapWrite(f, io->iodevValid, sizeof(io->iodevValid));
+    snapWrite(f, &io->iodevTotTicks, sizeof(io->iodevTotTicks));
+}
+
+// Set the io device's schedule and state from a snapshot
+void iodevRestore(struct machine *m, struct snapReader *r) {
+    struct iodevContext *io = m->iodev;
+    snapRead(r, io->iodevTicks, sizeof(io->iodevTicks));
+    snapRead(r, io->iodevOps, sizeof(io->iodevOps));
+    snapRead(r, io->iodevAddresses, sizeof(io->iodevAddresses));
+    snapRead(r, io->iodevValues, sizeof(io->iodevValues));
+    io->scheduleGen++;
+    iodevRestoreState(m, r);
+}
+
+// Set the io device's register and place in its schedule from a snapshot
+void iodevRestoreState(struct machine *m, struct snapReader *r) {
+    struct iodevContext *io = m->iodev;
+    snapRead(r, &io->reg, sizeof(io->reg));
+    snapRead(r, &io->iodevOpDone, sizeof(io->iodevOpDone));
+    snapRead(r, &io->currentOp, sizeof(io->currentOp));
+    snapRead(r, io->storeVal, sizeof(io->storeVal));
+    snapRead(r, &io->storeSlot, sizeof(io->storeSlot));
+    snapRead(r, &io->waiting, sizeof(io->waiting));
+    if(io->storeSlot >= maxMemQueueDepth) {
+        io->storeSlot = 0;
+        r->bad = true;
+    }
+    snapRead(r, io->iodevValid, sizeof(io->iodevValid));
+    snapRead(r, &io->iodevTotTicks, sizeof(io->iodevTotTicks));
+}
+
 // Read cpu commands from the file and call the functions
-void parseIODevice(FILE *infile) {
+void parseIODevice(struct machine *m, FILE *infile) {
     
     char cmd[11]; // Holds the command
 
@@ -122,16 +267,16 @@ void parseIODevice(FILE *infile) {
     // Call the command's function
     // Calls the reset function
     if (0 == strcmp(cmd, "reset")) {
-        iodevReset();
+        iodevReset(m);
     }
     
     // Calls the load function 
     else if (0 == strcmp(cmd, "load")) {
-        iodevLoad(infile);
+        iodevLoad(m, infile);
     }
 
     // Calls the dump function
     else if (0 == strcmp(cmd, "dump")) {
-        iodevDump();
+        iodevDump(m);
     }
 }
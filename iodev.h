@@ -2,8 +2,21 @@
 #define IODEV_H
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "machine.h"
+#include "snapshot.h"
 
-void parseIODevice(FILE *infile);
-void iodevStartTick();
+struct iodevContext *iodevContextCreate();
+void parseIODevice(struct machine *m, FILE *infile);
+void iodevStartTick(struct machine *m);
+unsigned iodevTicksToNextEvent(struct machine *m);
+void iodevSkipTicks(struct machine *m, unsigned ticks);
+unsigned iodevFingerprint(struct machine *m, uint8_t *buf);
+unsigned iodevSnapFields(struct machine *m, struct snapField *fields);
+void iodevSave(struct machine *m, FILE *f);
+void iodevRestore(struct machine *m, struct snapReader *r);
+unsigned iodevScheduleGeneration(struct machine *m);
+void iodevSaveState(struct machine *m, FILE *f);
+void iodevRestoreState(struct machine *m, struct snapReader *r);
 
 #endif
\ No newline at end of file
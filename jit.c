@@ -0,0 +1,333 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "imemory.h"
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define JIT_SUPPORTED
+#endif
+
+#define maxBlockLength 64 // The most instructions translated into one block
+#define noBlock SIZE_MAX  // Marks a pc without a block while translating
+
+
+// Host register holding each of RA-RH: r8, r9, r10, r11, rbx, rbp, r12, r13
+static const uint8_t hostReg[8] = { 8, 9, 10, 11, 3, 5, 12, 13 };
+
+
+// The state of one machine's translated code
+struct jitContext {
+  uint8_t *jitCode; // Executable memory holding every translated block
+  size_t jitCodeSize; // The size of jitCode
+  jitBlock jitBlocks[256]; // The block starting at each pc, NULL for none
+  bool jitValid; // Indicates jitBlocks matches imemory
+  unsigned jitGen; // The imemory generation the blocks were translated from
+  uint8_t *codeBuf; // Code is assembled here before it is made executable
+  size_t codeLen; // Bytes used in codeBuf
+  size_t codeCap; // Bytes allocated for codeBuf
+};
+
+// Allocate the translated code state of a new machine
+struct jitContext *jitContextCreate() {
+  struct jitContext *jit = calloc(1, sizeof(struct jitContext));
+  return jit;
+}
+
+// Append a byte of code
+static void emit(struct machine *m, uint8_t byte) {
+  struct jitContext *jit = m->jit;
+  // Grow the buffer when it is full
+  if (jit->codeLen == jit->codeCap) {
+    jit->codeCap = jit->codeCap ? jit->codeCap * 2 : 4096;
+    jit->codeBuf = realloc(jit->codeBuf, jit->codeCap);
+  }
+  jit->codeBuf[jit->codeLen++] = byte;
+}
+
+// Append a little endian 32 bit value
+static void emit32(struct machine *m, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emit(m, value >> (8 * i));
+  }
+}
+
+// Append a REX prefix for a byte operation between host registers reg and rm
+static void emitRex(struct machine *m, unsigned reg, unsigned rm) {
+  emit(m, 0x40 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// Append "op al, guest" (mov 8A, add 02, cmp 3A) or "mov guest, al" (88)
+static void emitAl(struct machine *m, uint8_t opcode, unsigned guest) {
+  unsigned host = hostReg[guest];
+  emitRex(m, 0, host);
+  emit(m, opcode);
+  emit(m, 0xC0 | (host & 7));
+}
+
+// Append a jump with a 32 bit displacement and return where to patch it
+static size_t emitJump(struct machine *m, uint8_t opcode) {
+  struct jitContext *jit = m->jit;
+  // 0xE9 is jmp, anything else is the second byte of a jcc
+  if (0xE9 != opcode) {
+    emit(m, 0x0F);
+  }
+  emit(m, opcode);
+  emit32(m, 0);
+  return jit->codeLen - 4;
+}
+
+// Point the jump at patch to the current end of the code
+static void patchJump(struct machine *m, size_t patch, size_t target) {
+  struct jitContext *jit = m->jit;
+  uint32_t displacement = target - (patch + 4);
+  memcpy(jit->codeBuf + patch, &displacement, 4);
+}
+
+// Append "sub rsi, ticks" and "add [r14 + 8], count" to charge ticks and
+// instructions for the path just taken
+static void emitCharge(struct machine *m, unsigned ticks, unsigned count) {
+  emit(m, 0x48); emit(m, 0x81); emit(m, 0xEE); emit32(m, ticks);
+  emit(m, 0x49); emit(m, 0x81); emit(m, 0x46); emit(m, 8); emit32(m, count);
+}
+
+// Append "mov edx, pc" and a jump to the block's exit
+static size_t emitExit(struct machine *m, unsigned pc) {
+  emit(m, 0xBA); emit32(m, pc);
+  return emitJump(m, 0xE9);
+}
+
+// Check if an instruction can be part of a block
+static bool isBlockInstr(const struct decodedInstr *instr) {
+  return instr->code <= INV || (BRANCH == instr->code && instr->dest <= BLT);
+}
+
+// Translate the block starting at start. Returns its offset in the code
+// buffer, or noBlock if the instruction at start cannot be translated.
+static size_t translateBlock(struct machine *m, unsigned start, unsigned size) {
+  struct jitContext *jit = m->jit;
+  unsigned count = 0;  // Instructions in the block
+  unsigned ticks = 0;  // Ticks the block takes with its branch taken
+  unsigned used = 0;   // Bit mask of the registers the block touches
+  unsigned written = 0; // Bit mask of the registers the block writes
+  bool branch = false; // Indicates the block ends in a branch
+  unsigned pc = start; // The pc after the block
+
+  // Find how far the block goes: up to and including a branch, and up to
+  // but not including a load, store or halt
+  while (count < maxBlockLength && pc < size && pc < 256) {
+    const struct decodedInstr *instr = iMemFetchDecoded(m, pc);
+    if (!isBlockInstr(instr)) {
+      break;
+    }
+    count++;
+    used |= (1 << instr->src) | (1 << instr->trgt);
+    if (BRANCH == instr->code) {
+      ticks += 2;
+      branch = true;
+      break;
+    }
+    used |= 1 << instr->dest;
+    written |= 1 << instr->dest;
+    ticks += (MUL == instr->code) ? 2 : 1;
+    pc++;
+  }
+  if (0 == count) {
+    return noBlock;
+  }
+
+  size_t offset = jit->codeLen; // Where the block starts
+  size_t exits[4]; // Jumps to the block's exit
+  unsigned exitCount = 0;
+
+  // Save the callee saved registers used: rbx, rbp, r12, r13, r14
+  emit(m, 0x53); emit(m, 0x55);
+  emit(m, 0x41); emit(m, 0x54); emit(m, 0x41); emit(m, 0x55); emit(m, 0x41); emit(m, 0x56);
+
+  // Keep the state pointer in r14
+  emit(m, 0x49); emit(m, 0x89); emit(m, 0xFE);
+
+  // Load the guest registers: movzx host, byte [r14 + reg]
+  for (unsigned reg = 0; reg < 8; reg++) {
+    if (used & (1 << reg)) {
+      unsigned host = hostReg[reg];
+      emit(m, 0x41 | ((host >> 3) << 2)); emit(m, 0x0F); emit(m, 0xB6);
+      emit(m, 0x40 | ((host & 7) << 3) | 6); emit(m, reg);
+    }
+  }
+
+  // Leave without doing anything unless the whole block fits: cmp rsi, ticks
+  size_t top = jit->codeLen;
+  emit(m, 0x48); emit(m, 0x81); emit(m, 0xFE); emit32(m, ticks);
+  size_t noFit = emitJump(m, 0x82);
+
+  // The body of the block
+  for (unsigned i = 0; i < count; i++) {
+    const struct decodedInstr *instr = iMemFetchDecoded(m, start + i);
+
+    if (ADD == instr->code) {
+      emitAl(m, 0x8A, instr->src);
+      emitAl(m, 0x02, instr->trgt);
+      emitAl(m, 0x88, instr->dest);
+    }
+    else if (ADDI == instr->code) {
+      emitAl(m, 0x8A, instr->src);
+      emit(m, 0x04); emit(m, instr->imm); // add al, imm
+      emitAl(m, 0x88, instr->dest);
+    }
+    else if (INV == instr->code) {
+      emitAl(m, 0x8A, instr->src);
+      emit(m, 0xF6); emit(m, 0xD0); // not al
+      emitAl(m, 0x88, instr->dest);
+    }
+    else if (MUL == instr->code) {
+      // movzx eax, src
+      unsigned host = hostReg[instr->src];
+      emitRex(m, 0, host); emit(m, 0x0F); emit(m, 0xB6); emit(m, 0xC0 | (host & 7));
+      emit(m, 0x89); emit(m, 0xC1);             // mov ecx, eax
+      emit(m, 0x83); emit(m, 0xE0); emit(m, 0x0F); // and eax, 0x0F
+      emit(m, 0xC1); emit(m, 0xE9); emit(m, 0x04); // shr ecx, 4
+      emit(m, 0x0F); emit(m, 0xAF); emit(m, 0xC1); // imul eax, ecx
+      emitAl(m, 0x88, instr->dest);
+    }
+    else if (BRANCH == instr->code) {
+      // Compare the registers and jump if the branch is taken
+      emitAl(m, 0x8A, instr->src);
+      emitAl(m, 0x3A, instr->trgt);
+      uint8_t jcc = (BEQ == instr->dest) ? 0x84 : (BNEQ == instr->dest) ? 0x85 : 0x82;
+      size_t taken = emitJump(m, jcc);
+
+      // Not taken: one tick for the branch
+      emitCharge(m, ticks - 1, count);
+      exits[exitCount++] = emitExit(m, (start + i + 1) & 0xFF);
+
+      // Taken: two ticks, going around again when the block loops on itself
+      patchJump(m, taken, jit->codeLen);
+      emitCharge(m, ticks, count);
+      if (instr->imm == start) {
+        patchJump(m, emitJump(m, 0xE9), top);
+      }
+      else {
+        exits[exitCount++] = emitExit(m, instr->imm);
+      }
+    }
+  }
+
+  // A block without a branch falls through to the next pc
+  if (!branch) {
+    emitCharge(m, ticks, count);
+    exits[exitCount++] = emitExit(m, pc & 0xFF);
+  }
+
+  // Not enough ticks left to run the block, stay at its start
+  patchJump(m, noFit, jit->codeLen);
+  exits[exitCount++] = emitExit(m, start);
+
+  // The exit: store the written registers, mov byte [r14 + reg], host
+  for (unsigned i = 0; i < exitCount; i++) {
+    patchJump(m, exits[i], jit->codeLen);
+  }
+  for (unsigned reg = 0; reg < 8; reg++) {
+    if (written & (1 << reg)) {
+      unsigned host = hostReg[reg];
+      emit(m, 0x41 | ((host >> 3) << 2)); emit(m, 0x88);
+      emit(m, 0x40 | ((host & 7) << 3) | 6); emit(m, reg);
+    }
+  }
+
+  // Return the ticks left and the next pc: (rsi << 16) | rdx
+  emit(m, 0x48); emit(m, 0x89); emit(m, 0xF0);             // mov rax, rsi
+  emit(m, 0x48); emit(m, 0xC1); emit(m, 0xE0); emit(m, 0x10); // shl rax, 16
+  emit(m, 0x48); emit(m, 0x09); emit(m, 0xD0);             // or rax, rdx
+
+  // Restore the callee saved registers and return
+  emit(m, 0x41); emit(m, 0x5E); emit(m, 0x41); emit(m, 0x5D); emit(m, 0x41); emit(m, 0x5C);
+  emit(m, 0x5D); emit(m, 0x5B);
+  emit(m, 0xC3);
+
+  return offset;
+}
+
+// Translate imemory into native blocks, if it changed since the last time.
+// Returns false if the host cannot run translated code.
+bool jitTranslate(struct machine *m) {
+  struct jitContext *jit = m->jit;
+#ifdef JIT_SUPPORTED
+  if (jit->jitValid && jit->jitGen == iMemGeneration(m)) {
+    return true;
+  }
+
+  // Throw away the old translation
+  jitClean(m);
+
+  // Translate a block for every pc the cpu could start at
+  size_t offsets[256];
+  unsigned size = iMemGetSize(m);
+  for (unsigned pc = 0; pc < 256; pc++) {
+    offsets[pc] = (pc < size) ? translateBlock(m, pc, size) : noBlock;
+  }
+
+  // Copy the code to memory that can be executed
+  if (jit->codeLen > 0) {
+    jit->jitCode = mmap(NULL, jit->codeLen, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == jit->jitCode) {
+      jit->jitCode = NULL;
+      return false;
+    }
+    jit->jitCodeSize = jit->codeLen;
+    memcpy(jit->jitCode, jit->codeBuf, jit->codeLen);
+    if (0 != mprotect(jit->jitCode, jit->jitCodeSize, PROT_READ | PROT_EXEC)) {
+      jitClean(m);
+      return false;
+    }
+  }
+
+  for (unsigned pc = 0; pc < 256; pc++) {
+    jit->jitBlocks[pc] = (noBlock == offsets[pc]) ? NULL : (jitBlock)(void *)(jit->jitCode + offsets[pc]);
+  }
+
+  jit->jitValid = true;
+  jit->jitGen = iMemGeneration(m);
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Check if this host can run translated code
+bool jitIsSupported() {
+#ifdef JIT_SUPPORTED
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Get the block starting at pc, NULL if the instruction there is not
+// translated
+jitBlock jitBlockAt(struct machine *m, unsigned pc) {
+  struct jitContext *jit = m->jit;
+  return (pc < 256) ? jit->jitBlocks[pc] : NULL;
+}
+
+// Free the translated code
+void jitClean(struct machine *m) {
+  struct jitContext *jit = m->jit;
+#ifdef JIT_SUPPORTED
+  if (NULL != jit->jitCode) {
+    munmap(jit->jitCode, jit->jitCodeSize);
+  }
+#endif
+  jit->jitCode = NULL;
+  jit->jitCodeSize = 0;
+  jit->jitValid = false;
+  free(jit->codeBuf);
+  jit->codeBuf = NULL;
+  jit->codeLen = 0;
+  jit->codeCap = 0;
+  memset(jit->jitBlocks, 0, sizeof(jit->jitBlocks));
+}
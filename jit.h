@@ -0,0 +1,23 @@
+#ifndef JIT_H
+#define JIT_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "machine.h"
+
+// The state translated code works on
+struct jitState {
+  uint8_t regs[8];       // CPU Registers RA-RH
+  uint64_t instructions; // Instructions performed by translated code
+};
+
+// A translated basic block. Runs while its instructions fit in maxTicks and
+// returns the ticks left shifted up 16 bits, or'd with the next pc.
+typedef uint64_t (*jitBlock)(struct jitState *state, uint64_t maxTicks);
+
+struct jitContext *jitContextCreate();
+bool jitTranslate(struct machine *m);
+bool jitIsSupported();
+jitBlock jitBlockAt(struct machine *m, unsigned pc);
+void jitClean(struct machine *m);
+
+#endif
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "machine.h"
+#include "cpu.h"
+#include "clock.h"
+#include "memory.h"
+#include "imemory.h"
+#include "cache.h"
+#include "iodev.h"
+#include "jit.h"
+#include "snapshot.h"
+
+// Create a machine with every device in its reset state, printing to out
+struct machine *machineCreate(FILE *out) {
+  struct machine *m = calloc(1, sizeof(struct machine));
+
+  m->out = out;
+  m->clock = clockContextCreate();
+  m->cpu = cpuContextCreate();
+  m->mem = memContextCreate();
+  m->imem = iMemContextCreate();
+  m->cache = cacheContextCreate();
+  m->iodev = iodevContextCreate();
+  m->jit = jitContextCreate();
+
+  return m;
+}
+
+// Read device commands from the file until it ends and run them
+void machineRunScript(struct machine *m, FILE *infile) {
+
+  char device[11]; // The device being called (cpu, clock, or memory)
+
+  // Read the whole file
+  while (1 == fscanf(infile, "%10s", device)) {
+    machineCommand(m, device, infile);
+  }
+}
+
+// Run a command for the device, reading the rest of it from the file
+void machineCommand(struct machine *m, const char *device, FILE *infile) {
+
+  // Commands to other devices may change the machine under the clock's checkpoints
+  if (0 != strcmp(device, "clock")) {
+    clockNoteCommand(m);
+  }
+
+  // Handles the clock
+  if (0 == strcmp(device, "clock")) {
+    parseClock(m, infile);
+  }
+  // Handles the memory
+  else if (0 == strcmp(device, "memory")) {
+    parseMemory(m, infile);
+  }
+  // Handles the cpu
+  else if (0 == strcmp(device, "cpu")) {
+    parseCpu(m, infile);
+  }
+
+  // Handles the imemory
+  else if (0 == strcmp( device, "imemory")) {
+    parseIMemory(m, infile);
+  }
+
+  // Handles the cache
+  else if (0 == strcmp( device, "cache")) {
+    parseCache(m, infile);
+  }
+
+  // Handles the L2 below the cache
+  else if (0 == strcmp( device, "l2")) {
+    parseL2(m, infile);
+  }
+
+  // Handles the I-cache in front of imemory
+  else if (0 == strcmp( device, "icache")) {
+    parseICache(m, infile);
+  }
+
+  // Handles the iodevice
+  else if (0 == strcmp( device, "iodev")) {
+    parseIODevice(m, infile);
+  }
+
+  // Handles saving and restoring the whole machine
+  else if (0 == strcmp( device, "machine")) {
+    parseMachine(m, infile);
+  }
+}
+
+// Free the machine's memory, imemory, translated code and device state
+void machineDestroy(struct machine *m) {
+  clockClean(m);
+  memClean(m);
+  iMemClean(m);
+  cpuClean(m);
+  cacheClean(m);
+
+  free(m->clock);
+  free(m->cpu);
+  free(m->mem);
+  free(m->imem);
+  free(m->cache);
+  free(m->iodev);
+  free(m->jit);
+  free(m);
+}
@@ -0,0 +1,23 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+#include <stdio.h>
+
+// One simulated machine. Each device keeps its state in its own context,
+// so one process can run any number of machines side by side.
+struct machine {
+  FILE *out;                   // Where dumps and messages are printed
+  struct clockContext *clock;  // The clock's state
+  struct cpuContext *cpu;      // The cpu's state
+  struct memContext *mem;      // The memory's state
+  struct iMemContext *imem;    // The imemory's state
+  struct cacheContext *cache;  // The cache's state
+  struct iodevContext *iodev;  // The io device's state
+  struct jitContext *jit;      // The cpu's translated code
+};
+
+struct machine *machineCreate(FILE *out);
+void machineRunScript(struct machine *m, FILE *infile);
+void machineCommand(struct machine *m, const char *device, FILE *infile);
+void machineDestroy(struct machine *m);
+
+#endif
@@ -3,40 +3,279 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include "machine.h"
+#include "memory.h"
+#include "snapshot.h"
+#include "image.h"
 
-static uint8_t *memPtr; // The memory array
-static unsigned memSize; // The size of the memory array
-static unsigned memAddress;
-static unsigned memCount; 
-static uint8_t* memAnswerPtr;
-static bool* memValidPtr;
-static bool* memDonePtr;
-static unsigned memTicks;
-enum memStates { IDLE, FETCH, STORE, MOVE_DATA, SAVE_DATA};
-static enum memStates memState= IDLE; // Initialize state to idle
+enum memStates { IDLE, FETCH, STORE, MOVE_DATA, SAVE_DATA, QUEUED};
+#define memPageBits 12 // Memory is allocated in pages of 4096 bytes
+#define memPageSize (1u << memPageBits) // Bytes in a page of memory
+#define memBlockSize 64 // Bytes saved at a time for a checkpoint
+#define memBlocksPerPage (memPageSize / memBlockSize)
+#define maxMemRequests (MEM_PORTS * maxMemQueueDepth) // The most requests memory can hold
+#define memDefaultQueueDepth 4 // Requests a port can have with memory unless set
+#define memPriorityFifo MEM_PORTS // The priority that starts requests in order of arrival
+#define memFixedLatency 4 // Ticks every request takes unless the DRAM timing is on
+#define memNoRow 0xFFFF // A bank with no row open
 
+// The names of the ports for the priority command
+static const char *memPortNames[MEM_PORTS] = {"cache", "iodev"};
+
+// A page of memory, allocated the first time it is written. Its bytes are
+// kept together so requests within it are copied in one go.
+struct memPage {
+  unsigned gen; // The page holds memory's contents when this matches memGen
+  unsigned blockStamp[memBlocksPerPage]; // The cowStamp each block was last saved in
+  uint8_t data[memPageSize]; // The page's bytes
+};
+
+// A block of memory as it was when a checkpoint was taken, saved the first
+// time the block is written after it
+struct memUndo {
+  unsigned checkpoint; // The checkpoint the block belongs to
+  unsigned block; // The block's number
+  uint8_t data[memBlockSize]; // The block's contents at the checkpoint
+};
+
+// A request a device has handed memory, from when it arrives until it
+// completes. It waits QUEUED until the arbiter starts it.
+struct memRequest {
+  enum memStates memState; // IDLE when the slot is free
+  bool store; // Indicates a store rather than a fetch
+  enum memPorts port; // The port it arrived on
+  unsigned long arrival; // Orders requests by when they arrived
+  unsigned memAddress;
+  unsigned memCount;
+  uint8_t* memAnswerPtr;
+  bool* memValidPtr;
+  bool* memDonePtr;
+  unsigned memTicks; // Ticks since it started
+  unsigned latency; // Ticks it takes from when it starts
+};
+
+// The state of one machine's memory
+struct memContext {
+  struct memPage **pages; // The page holding each 4096 bytes, NULL until written
+  unsigned pageCount; // Entries in pages
+  unsigned memGen; // Bumped to reset memory, making every page read as zeros
+  unsigned memSize; // The size of the memory array
+  struct memRequest requests[maxMemRequests]; // The requests queued and in flight
+  unsigned long arrivals; // Requests that have arrived
+  unsigned queueDepth; // The most requests each port can have
+  unsigned maxInFlight; // The most requests in flight at once
+  unsigned priority; // The port whose requests start first, or memPriorityFifo
+  bool dramOn; // Indicates requests are timed by the banked DRAM model rather than memFixedLatency
+  unsigned bankCount; // Banks consecutive rows are interleaved across
+  unsigned rowSize; // Bytes in a row
+  unsigned rowHitTicks; // Ticks to reach the open row
+  unsigned rowMissTicks; // Ticks to open a row in a bank with none open
+  unsigned rowConflictTicks; // Ticks to close the open row and open another
+  unsigned burstBytes; // Bytes a burst moves each tick once the row is reached
+  uint16_t openRow[maxMemBanks]; // The row each bank has open, or memNoRow
+  unsigned memVersion; // Bumped whenever a byte of memory changes value
+  bool cowOn; // Indicates blocks are saved before they are first written
+  unsigned cowStamp; // Bumped at each checkpoint so every block is saved again
+  unsigned cowCheckpoint; // The checkpoint blocks are being saved for
+  unsigned cowFloor; // The first checkpoint taken since memory was created
+  struct memUndo *undo; // The saved blocks, oldest first
+  unsigned undoCount; // Blocks in undo
+  unsigned undoCap; // Room in undo
+  struct memCounters counters; // Requests and bytes moved
+};
+
+// Allocate the memory of a new machine
+struct memContext *memContextCreate() {
+  struct memContext *mem = calloc(1, sizeof(struct memContext));
+  mem->queueDepth = memDefaultQueueDepth;
+  mem->maxInFlight = 1;
+  mem->priority = memPriorityFifo;
+  mem->bankCount = 4;
+  mem->rowSize = 32;
+  mem->rowHitTicks = 1;
+  mem->rowMissTicks = 3;
+  mem->rowConflictTicks = 5;
+  mem->burstBytes = 4;
+  memset(mem->openRow, 0xFF, sizeof(mem->openRow));
+  return mem;
+}
+
+
+// Check if address falls in memory. A 16 bit address can pass the end of
+// a small memory; reads there give zeros and stores are dropped.
+static bool memHolds(struct memContext *mem, unsigned address) {
+  return address < mem->memSize;
+}
+
+// Get the page holding address if it holds memory's contents, or NULL if
+// it has not been written since memory was last reset and reads as zeros
+static struct memPage *memPageAt(struct memContext *mem, unsigned address) {
+  if (!memHolds(mem, address)) {
+    return NULL;
+  }
+  struct memPage *page = mem->pages[address >> memPageBits];
+  return (NULL != page && page->gen == mem->memGen) ? page : NULL;
+}
+
+// Get the page holding address to write to it, allocating it the first
+// time and clearing it the first time after memory is reset
+static struct memPage *memPageForWrite(struct memContext *mem, unsigned address) {
+  struct memPage **page = &mem->pages[address >> memPageBits];
+
+  if (NULL == *page) {
+    *page = calloc(1, sizeof(struct memPage));
+    (*page)->gen = mem->memGen;
+  }
+  else if ((*page)->gen != mem->memGen) {
+    memset((*page)->data, 0, memPageSize);
+    (*page)->gen = mem->memGen;
+  }
+  return *page;
+}
+
+// Read a byte of memory
+static uint8_t memRead(struct memContext *mem, unsigned address) {
+  struct memPage *page = memPageAt(mem, address);
+  return (NULL != page) ? page->data[address & (memPageSize - 1)] : 0;
+}
+
+// Write a byte of memory
+static void memWrite(struct memContext *mem, unsigned address, uint8_t value) {
+  memPageForWrite(mem, address)->data[address & (memPageSize - 1)] = value;
+}
+
+// Copy count bytes of memory starting at address out to data, a page at a
+// time. Bytes past the end of memory read as zeros.
+static void memCopyOut(struct memContext *mem, unsigned address, uint8_t *data, unsigned count) {
+  while (count > 0) {
+    unsigned offset = address & (memPageSize - 1); // Where the copy starts in the page
+    unsigned size = (memPageSize - offset < count) ? memPageSize - offset : count;
+    unsigned held = memHolds(mem, address) ? mem->memSize - address : 0; // Bytes memory holds from address
+    struct memPage *page = memPageAt(mem, address);
+    if (held > size) {
+      held = size;
+    }
+    if (NULL != page) {
+      memcpy(data, page->data + offset, held);
+      memset(data + held, 0, size - held);
+    }
+    else {
+      memset(data, 0, size);
+    }
+    address += size;
+    data += size;
+    count -= size;
+  }
+}
+
+// Copy count bytes from data into memory starting at address, a page at a time
+static void memCopyIn(struct memContext *mem, unsigned address, const uint8_t *data, unsigned count) {
+  while (count > 0) {
+    unsigned offset = address & (memPageSize - 1); // Where the copy starts in the page
+    unsigned size = (memPageSize - offset < count) ? memPageSize - offset : count;
+    memcpy(memPageForWrite(mem, address)->data + offset, data, size);
+    address += size;
+    data += size;
+    count -= size;
+  }
+}
+
+// Free every page of memory
+static void memFreePages(struct memContext *mem) {
+  for (unsigned i = 0; i < mem->pageCount; i++) {
+    free(mem->pages[i]);
+  }
+  free(mem->pages);
+  mem->pages = NULL;
+  mem->pageCount = 0;
+}
+
+// Save the block holding address for the current checkpoint, unless it
+// has been already. Called before memory is written.
+static void memTouch(struct memContext *mem, unsigned address) {
+  if (!mem->cowOn) {
+    return;
+  }
+
+  struct memPage *page = memPageForWrite(mem, address); // The page being written
+  unsigned block = (address & (memPageSize - 1)) / memBlockSize; // The block in the page
+  if (page->blockStamp[block] == mem->cowStamp) {
+    return;
+  }
+  page->blockStamp[block] = mem->cowStamp;
+
+  // Grow the log when it is full
+  if (mem->undoCount == mem->undoCap) {
+    mem->undoCap = mem->undoCap ? mem->undoCap * 2 : 64;
+    mem->undo = realloc(mem->undo, mem->undoCap * sizeof(struct memUndo));
+  }
+
+  struct memUndo *undo = &mem->undo[mem->undoCount++];
+  undo->checkpoint = mem->cowCheckpoint;
+  undo->block = address / memBlockSize;
+  memcpy(undo->data, page->data + block * memBlockSize, memBlockSize);
+}
+
+// Forget the blocks saved for checkpoints when the whole of memory is
+// replaced, so no checkpoint taken before now can be gone back to
+static void memCheckpointsReplaced(struct memContext *mem) {
+  if (mem->cowOn) {
+    mem->cowFloor = mem->cowCheckpoint + 1;
+    mem->undoCount = 0;
+    mem->cowStamp++;
+  }
+}
+
+// Allocate the page table for memory of the given size. Pages themselves
+// are allocated as they are written.
+static void memAllocate(struct memContext *mem, unsigned size) {
+  memFreePages(mem);
+  mem->memSize = size;
+  mem->pageCount = (size >> memPageBits) + (0 != (size & (memPageSize - 1)));
+  mem->pages = calloc(mem->pageCount ? mem->pageCount : 1, sizeof(struct memPage *));
+  mem->memGen++;
+}
 
 // Allocates the designated ammount of memory
-static void memoryCreate(FILE *infile) {
+static void memoryCreate(struct machine *m, FILE *infile) {
+  struct memContext *mem = m->mem;
+  unsigned size; // The size of memory
   
   // Get the size
-  fscanf(infile, "%x", &memSize);
+  fscanf(infile, "%x", &size);
 
-  memPtr = malloc(memSize*sizeof(uint8_t));
+  memAllocate(mem, size);
+  mem->memVersion++;
+
+  memCheckpointsReplaced(mem);
 
 }
 
-// Reset the memory allocated to zeros
-static void memoryReset() {
+// Reset the memory allocated to zeros. Bumping the generation makes every
+// page read as zeros until it is next written, whatever the size.
+static void memoryReset(struct machine *m) {
+  struct memContext *mem = m->mem;
 
-  for (unsigned i = 0; i < memSize; i++) {
-    memPtr[i] = 0;
+  // Checkpoints need the blocks of pages in use saved first
+  if (mem->cowOn) {
+    for (unsigned i = 0; i < mem->pageCount; i++) {
+      if (NULL != memPageAt(mem, i << memPageBits)) {
+        for (unsigned b = 0; b < memBlocksPerPage; b++) {
+          memTouch(mem, (i << memPageBits) + b * memBlockSize);
+        }
+      }
+    }
   }
+
+  mem->memGen++;
+  mem->memVersion++;
 }
 
 // Dump the memory starting at the given address
 // and dumping the given number of bytes
-static void memoryDump(FILE *infile) {
+static void memoryDump(struct machine *m, FILE *infile) {
+  struct memContext *mem = m->mem;
 
   unsigned address; // The address to start at
   unsigned count; // The amount to print
@@ -48,23 +287,23 @@ static void memoryDump(FILE *infile) {
   fscanf(infile, "%x", &count);
   
   // Print the header
-  printf("Addr");
+  fprintf(m->out, "Addr");
   for (int i = 0; i < 16; i++) {
-    printf(" %02X",i);
+    fprintf(m->out, " %02X",i);
   }
-  printf("\n"); 
+  fprintf(m->out, "\n"); 
 
   // Print the address of the start row
-  printf("0x%02X",(address / 0x10) * 0x10);
+  fprintf(m->out, "0x%02X",(address / 0x10) * 0x10);
 
   // Print the blank spaces before the first byte to print
   for (unsigned i = 0; i < (address % 0x10); i++) {
-    printf("   ");
+    fprintf(m->out, "   ");
   }
 
   // Print the memory contents 
   for (unsigned i = address; i < address+count; i++) {
-    printf(" %02X",memPtr[i]);
+    fprintf(m->out, " %02X",memRead(mem, i));
 
     // Print a newline at mutliples of 0x10
     if(15 == i % 0x10) {
@@ -72,16 +311,17 @@ static void memoryDump(FILE *infile) {
       // Unless the last byte has been printed
       if(i != address+count-1) {     
         // Print a new line and the row's address label
-        printf("\n0x%02X",(i+0x01));
+        fprintf(m->out, "\n0x%02X",(i+0x01));
       }
     }
   }
   // Put an empty newline after the dump
-  printf("\n\n"); 
+  fprintf(m->out, "\n\n"); 
 }
 
 // Set the memory to the given values
-static void memorySet(FILE *infile) {
+static void memorySet(struct machine *m, FILE *infile) {
+  struct memContext *mem = m->mem;
 
   unsigned address; // The address to start at
   unsigned count; // The amount to print
@@ -100,27 +340,172 @@ static void memorySet(FILE *infile) {
     fscanf(infile, "%x", &inByte);
 
     // Set the byte into memory
-    memPtr[i] = inByte; 
+    memTouch(mem, i);
+    memWrite(mem, i, inByte);
   }
+  mem->memVersion++;
 }
 
-// Set up memory for the beginning of a cycle
-void memStartTick() {
-  // If memory is in its Fetch state or Store state, it must count 5 ticks
-  if ((FETCH == memState) || (STORE == memState)) {
-    memTicks++; // Increment ticks
-
-    // On the fifth tick change the state to MOVE_DATA or STORE_DATA
-    if (4 == memTicks) {
-      // If the state is FETCH have it complete the FETCH instruction
-      if(FETCH == memState) {
-        memState = MOVE_DATA;  
+// Copy a data image written by tools/entropy2img into memory at the given
+// address. The file is mapped and copied in one go rather than parsed.
+static void memoryLoad(struct machine *m, FILE *infile) {
+  struct memContext *mem = m->mem;
+
+  unsigned address; // The address to start at
+  char imageName[NAME_MAX + PATH_MAX + 1]; // The path of the image
+  struct image image; // The image mapped into memory
+  const char *error; // What is wrong with the image
+
+  // Get the address and the image's path
+  fscanf(infile, "%x", &address);
+  fscanf(infile, "%1000s", imageName);
+
+  error = imageMap(&image, imageName, imageDataMagic, 1);
+  if (NULL != error) {
+    fprintf(m->out, "%s %s\n\n", imageName, error);
+    return;
+  }
+
+  unsigned count = image.header.count; // The bytes in the image
+  if (address > mem->memSize || count > mem->memSize - address) {
+    fprintf(m->out, "%s does not fit in memory at 0x%02X\n\n", imageName, address);
+    imageUnmap(&image);
+    return;
+  }
+
+  // Save each block the image covers for checkpoints before it is written
+  for (unsigned a = address; a < address + count; a = (a / memBlockSize + 1) * memBlockSize) {
+    memTouch(mem, a);
+  }
+  memCopyIn(mem, address, image.contents, count);
+  mem->memVersion++;
+  imageUnmap(&image);
+}
+
+// Get the bank holding the row a request starts in. Consecutive rows are
+// in consecutive banks.
+static unsigned memBank(struct memContext *mem, const struct memRequest *req) {
+  return (req->memAddress / mem->rowSize) % mem->bankCount;
+}
+
+// Get the ticks a request takes from when it starts, and with the DRAM
+// timing on, open its row and count the bank's work. A row hit only
+// reaches the open row, a miss opens it first and a conflict closes the
+// other row before that. The bytes then move as one burst.
+static unsigned memStartLatency(struct memContext *mem, const struct memRequest *req) {
+  if (!mem->dramOn) {
+    return memFixedLatency;
+  }
+
+  unsigned row = req->memAddress / mem->rowSize; // The request's row
+  unsigned bank = memBank(mem, req); // The bank holding it
+  unsigned ticks; // Ticks to reach the row
+
+  if (row == mem->openRow[bank]) {
+    ticks = mem->rowHitTicks;
+    mem->counters.rowHits++;
+  }
+  else if (memNoRow == mem->openRow[bank]) {
+    ticks = mem->rowMissTicks;
+    mem->counters.rowMisses++;
+  }
+  else {
+    ticks = mem->rowConflictTicks;
+    mem->counters.rowConflicts++;
+  }
+  mem->openRow[bank] = row;
+  ticks += (req->memCount + mem->burstBytes - 1) / mem->burstBytes;
+
+  mem->counters.bankAccesses[bank]++;
+  mem->counters.bankBusyTicks[bank] += ticks;
+  return ticks;
+}
+
+// Check if a request has been started by the arbiter and not completed
+static bool memIsStarted(const struct memRequest *req) {
+  return IDLE != req->memState && QUEUED != req->memState;
+}
+
+// Check if two requests touch a byte in common and one of them stores it,
+// so they must not be in flight together or change places
+static bool memConflicts(const struct memRequest *a, const struct memRequest *b) {
+  return (a->store || b->store) && a->memAddress < b->memAddress + b->memCount &&
+         b->memAddress < a->memAddress + a->memCount;
+}
+
+// Check if a queued request can start: nothing in flight conflicts with
+// it or, with the DRAM timing on, uses its bank, and it would not pass an
+// earlier request from its own port or one it conflicts with
+static bool memCanStart(struct memContext *mem, const struct memRequest *req) {
+  for (unsigned i = 0; i < maxMemRequests; i++) {
+    const struct memRequest *other = &mem->requests[i];
+    if (other == req || IDLE == other->memState) {
+      continue;
+    }
+    if (memIsStarted(other) && (memConflicts(req, other) || (mem->dramOn && memBank(mem, req) == memBank(mem, other)))) {
+      return false;
+    }
+    if (QUEUED == other->memState && other->arrival < req->arrival &&
+        (other->port == req->port || memConflicts(req, other))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Check if the arbiter picks request a before request b
+static bool memGoesFirst(struct memContext *mem, const struct memRequest *a, const struct memRequest *b) {
+  if (a->port != b->port && (mem->priority == a->port || mem->priority == b->port)) {
+    return mem->priority == a->port;
+  }
+  return a->arrival < b->arrival;
+}
+
+// Start queued requests, picked by the priority, while fewer than
+// maxInFlight are in flight
+static void memArbitrate(struct memContext *mem) {
+  unsigned inFlight = 0; // Requests started and not completed
+
+  for (unsigned i = 0; i < maxMemRequests; i++) {
+    inFlight += memIsStarted(&mem->requests[i]);
+  }
+
+  while (inFlight < mem->maxInFlight) {
+    struct memRequest *next = NULL; // The request to start
+    for (unsigned i = 0; i < maxMemRequests; i++) {
+      struct memRequest *req = &mem->requests[i];
+      if (QUEUED == req->memState && memCanStart(mem, req) && (NULL == next || memGoesFirst(mem, req, next))) {
+        next = req;
       }
-      // If the state is STORE have it complete the STORE instruction
-      if(STORE == memState) {
-        memState = SAVE_DATA;  
+    }
+    if (NULL == next) {
+      return;
+    }
+    next->memState = next->store ? STORE : FETCH;
+    next->memTicks = 0; // Reset the number of ticks to zero
+    next->latency = memStartLatency(mem, next);
+    inFlight++;
+  }
+}
+
+// Set up memory for the beginning of a cycle
+void memStartTick(struct machine *m) {
+  struct memContext *mem = m->mem;
+  for (unsigned i = 0; i < maxMemRequests; i++) {
+    struct memRequest *req = &mem->requests[i];
+
+    // A request in its Fetch state or Store state must count its latency
+    if ((FETCH == req->memState) || (STORE == req->memState)) {
+      req->memTicks++; // Increment ticks
+
+      // On its last tick change the state to MOVE_DATA or SAVE_DATA
+      if (req->latency == req->memTicks) {
+        req->memState = (FETCH == req->memState) ? MOVE_DATA : SAVE_DATA;
       }
     }
+    else if (QUEUED == req->memState) {
+      mem->counters.queueTicks++;
+    }
   }
 }
 
@@ -132,76 +517,590 @@ bool memIsMoreCycleWorkNeeded() {
   return false; 
 }
 
+// Read a byte of memory without going through a request
+uint8_t memPeek(struct machine *m, unsigned address) {
+  struct memContext *mem = m->mem;
+  return memRead(mem, address);
+}
+
+// Copy the state that decides what memory does next into buf, so the clock
+// can spot the machine repeating itself. Returns the bytes copied.
+unsigned memFingerprint(struct machine *m, uint8_t *buf) {
+  struct memContext *mem = m->mem;
+  unsigned n = 0; // Bytes copied
+  uint8_t held = 0; // Requests queued or in flight
+  for (unsigned i = 0; i < maxMemRequests; i++) {
+    held += (IDLE != mem->requests[i].memState);
+  }
+  buf[n++] = held;
+  memcpy(buf + n, &mem->memVersion, sizeof(mem->memVersion)); n += sizeof(mem->memVersion);
+
+  // The open rows decide how long the next requests take
+  buf[n++] = mem->dramOn;
+  if (mem->dramOn) {
+    memcpy(buf + n, mem->openRow, mem->bankCount * sizeof(mem->openRow[0])); n += mem->bankCount * sizeof(mem->openRow[0]);
+  }
+  return n;
+}
+
+// Check and see if memory has no request queued or in progress
+bool memIsIdle(struct machine *m) {
+  struct memContext *mem = m->mem;
+  for (unsigned i = 0; i < maxMemRequests; i++) {
+    if (IDLE != mem->requests[i].memState) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Get the most ticks a request for count bytes started now takes to
+// complete, counting the tick it completes on
+unsigned memLatency(struct machine *m, unsigned count) {
+  struct memContext *mem = m->mem;
+  unsigned ticks = mem->rowHitTicks; // The longest way to reach a row
+
+  if (!mem->dramOn) {
+    return memFixedLatency;
+  }
+  ticks = (mem->rowMissTicks > ticks) ? mem->rowMissTicks : ticks;
+  ticks = (mem->rowConflictTicks > ticks) ? mem->rowConflictTicks : ticks;
+  return ticks + (count + mem->burstBytes - 1) / mem->burstBytes;
+}
+
+// Get the number of ticks until memory next has work to do, counting the
+// tick it happens on. UINT_MAX means it has no request. Queued requests
+// only start when one in flight completes.
+unsigned memTicksToNextEvent(struct machine *m) {
+  struct memContext *mem = m->mem;
+  unsigned ticks = UINT_MAX; // The soonest a request completes
+  for (unsigned i = 0; i < maxMemRequests; i++) {
+    struct memRequest *req = &mem->requests[i];
+    // A fetch or store completes on the tick memTicks reaches its latency
+    if ((FETCH == req->memState) || (STORE == req->memState)) {
+      if (req->latency - req->memTicks < ticks) {
+        ticks = req->latency - req->memTicks;
+      }
+    }
+    else if ((MOVE_DATA == req->memState) || (SAVE_DATA == req->memState)) {
+      return 1;
+    }
+  }
+  return ticks;
+}
+
+// Account for ticks on which memory only counts down its requests
+void memSkipTicks(struct machine *m, unsigned ticks) {
+  struct memContext *mem = m->mem;
+  for (unsigned i = 0; i < maxMemRequests; i++) {
+    struct memRequest *req = &mem->requests[i];
+    if ((FETCH == req->memState) || (STORE == req->memState)) {
+      req->memTicks += ticks;
+    }
+    else if (QUEUED == req->memState) {
+      mem->counters.queueTicks += ticks;
+    }
+  }
+}
+
 // Perform memory work
-void memDoCycleWork() {
-
-  // if memState is MOVE_DATA then move it
-  if( MOVE_DATA == memState) {
-    
-    // Copy the memory contents to the answer pointer
-    memcpy(memAnswerPtr, memPtr + memAddress, memCount);
-    // could always use memcpy, but useful to show what
-    // is going on with a single byte example
-    *memDonePtr = true; // tell cache copy is done
-    memState = IDLE; // Memory is ready for a new instruction
-  } 
-  
-  // if memState is SAVE_DATA then move it
-  if( SAVE_DATA == memState) {
-
-    // Traverse the array and copy any values that indicate have been written
-    for(int i=0; i<memCount; i++) {
-      // If the value has been written
-      if(memValidPtr[i]) {
-        memPtr[memAddress+i] = memAnswerPtr[i]; // Update the value in memory
+void memDoCycleWork(struct machine *m) {
+  struct memContext *mem = m->mem;
+  bool completed = false; // Indicates a request completed, making room for another
+
+  for (unsigned r = 0; r < maxMemRequests; r++) {
+    struct memRequest *req = &mem->requests[r];
+
+    // if memState is MOVE_DATA then move it
+    if( MOVE_DATA == req->memState) {
+
+      // Copy the memory contents to the answer pointer
+      memCopyOut(mem, req->memAddress, req->memAnswerPtr, req->memCount);
+      // could always use memcpy, but useful to show what
+      // is going on with a single byte example
+      *req->memDonePtr = true; // tell cache copy is done
+      req->memState = IDLE; // The slot is ready for a new request
+      completed = true;
+    }
+
+    // if memState is SAVE_DATA then move it
+    if( SAVE_DATA == req->memState) {
+
+      // Traverse the array and copy any values that indicate have been written
+      for(unsigned i=0; i<req->memCount; i++) {
+        // If the value has been written
+        if(req->memValidPtr[i] && memHolds(mem, req->memAddress+i)) {
+          // Only a store that changes memory needs its page written
+          if(memRead(mem, req->memAddress+i) != req->memAnswerPtr[i]) {
+            memTouch(mem, req->memAddress+i);
+            memWrite(mem, req->memAddress+i, req->memAnswerPtr[i]); // Update the value in memory
+            mem->memVersion++;
+          }
+        }
       }
+      *req->memDonePtr = true; // tell the device the copy is done
+      req->memState = IDLE; // The slot is ready for a new request
+      completed = true;
     }
-    *memDonePtr = true; // tell the device the copy is done
-    memState = IDLE; // Memory is ready for a new instruction
   }
-   
+
+  // Start what was waiting for the requests that completed
+  if (completed) {
+    memArbitrate(mem);
+  }
+}
+
+// Queue a request on a port, starting it at once if the arbiter can.
+// Returns false, leaving memory unchanged, when the port's queue is full.
+static bool memQueue(struct memContext *mem, enum memPorts port, bool store, unsigned address, unsigned count,
+                     uint8_t *dataPtr, bool *validPtr, bool *donePtr) {
+  struct memRequest *slot = NULL; // A free slot for the request
+  unsigned held = 0; // Requests the port already has
+
+  for (unsigned i = 0; i < maxMemRequests; i++) {
+    struct memRequest *req = &mem->requests[i];
+    if (IDLE == req->memState) {
+      slot = (NULL == slot) ? req : slot;
+    }
+    else if (port == req->port) {
+      held++;
+    }
+  }
+  if (held >= mem->queueDepth || NULL == slot) {
+    return false;
+  }
+
+  slot->memState = QUEUED;
+  slot->store = store;
+  slot->port = port;
+  slot->arrival = mem->arrivals++;
+  slot->memAddress = address;
+  slot->memCount = count;
+  slot->memAnswerPtr = dataPtr;
+  slot->memValidPtr = validPtr;
+  slot->memDonePtr = donePtr;
+  slot->memTicks = 0;
+  memArbitrate(mem);
+  if (QUEUED == slot->memState) {
+    mem->counters.queued++;
+  }
+  return true;
 }
 
 // Start a memory fetch at the given address
+// port – the port the requesting device uses
 // address – the offset in memory where the read should begin
 // count – the number of bytes that should be read
 // dataPtr – a pointer where data should be placed
 // memDonePtr – a pointer to a boolean that the Memory Device will set to true when
 // the data transfer has completed (possibly multiple cycles after request)
-void memStartFetch(unsigned address, unsigned count, uint8_t *dataPtr,
+// Returns false if the port already has as many requests as its queue holds.
+bool memStartFetch(struct machine *m, enum memPorts port, unsigned address, unsigned count, uint8_t *dataPtr,
                    bool *donePtr) {
-  memState = FETCH;
-  memAddress = address;
-  memCount = count;
-  memAnswerPtr = dataPtr;
-  memDonePtr = donePtr;
-  memTicks = 0; // Reset the number of ticks to zero
+  struct memContext *mem = m->mem;
+  if (!memQueue(mem, port, false, address, count, dataPtr, NULL, donePtr)) {
+    return false;
+  }
+  mem->counters.fetches++;
+  mem->counters.bytesFetched += count;
+  return true;
 }
 
 // Start a memory store at the given address
+// port – the port the requesting device uses
 // address – the offset in memory where the write should begin
 // count – the number of bytes that should be written
 // dataPtr – a pointer that is the source of data to write
 // validPtr - pointer to list of Booleans indicating if matching byte should be written
 // memDonePtr – a pointer to a boolean that the Memory Device will set to true when
-void memStartStore(unsigned address, unsigned count, uint8_t *dataPtr, bool *validPtr,
-                   bool *donePtr) {
-  memState = STORE;
-  memAddress = address;
-  memCount = count;
-  memAnswerPtr = dataPtr;
-  memValidPtr = validPtr;
-  memDonePtr = donePtr;
-  memTicks = 0; // Reset the number of ticks to zero
+// Returns false if the port already has as many requests as its queue holds.
+bool memStartStore(struct machine *m, enum memPorts port, unsigned address, unsigned count, uint8_t *dataPtr,
+                   bool *validPtr, bool *donePtr) {
+  struct memContext *mem = m->mem;
+  if (!memQueue(mem, port, true, address, count, dataPtr, validPtr, donePtr)) {
+    return false;
+  }
+  mem->counters.stores++;
+  mem->counters.bytesStored += count;
+  return true;
+}
+
+// Drop every request a port has queued or in flight, for a device that
+// has given up on them. Their done flags are never set.
+void memCancel(struct machine *m, enum memPorts port) {
+  struct memContext *mem = m->mem;
+  for (unsigned i = 0; i < maxMemRequests; i++) {
+    if (port == mem->requests[i].port) {
+      mem->requests[i].memState = IDLE;
+    }
+  }
+  memArbitrate(mem);
+}
+
+// Write the memory and the requests it holds to a snapshot. Only the
+// pages in use are written, each after its number.
+void memSave(struct machine *m, FILE *f) {
+  struct memContext *mem = m->mem;
+  unsigned used = 0; // The pages in use
+
+  for (unsigned i = 0; i < mem->pageCount; i++) {
+    used += (NULL != memPageAt(mem, i << memPageBits));
+  }
+  snapWrite(f, &mem->memSize, sizeof(mem->memSize));
+  snapWrite(f, &used, sizeof(used));
+  for (unsigned i = 0; i < mem->pageCount; i++) {
+    struct memPage *page = memPageAt(mem, i << memPageBits);
+    if (NULL != page) {
+      snapWrite(f, &i, sizeof(i));
+      snapWrite(f, page->data, memPageSize);
+    }
+  }
+  memSaveState(m, f);
+}
+
+// Write memory's arbiter settings and the requests it holds to a snapshot
+void memSaveState(struct machine *m, FILE *f) {
+  struct memContext *mem = m->mem;
+  snapWrite(f, &mem->queueDepth, sizeof(mem->queueDepth));
+  snapWrite(f, &mem->maxInFlight, sizeof(mem->maxInFlight));
+  snapWrite(f, &mem->priority, sizeof(mem->priority));
+  snapWrite(f, &mem->arrivals, sizeof(mem->arrivals));
+  snapWrite(f, &mem->dramOn, sizeof(mem->dramOn));
+  snapWrite(f, &mem->bankCount, sizeof(mem->bankCount));
+  snapWrite(f, &mem->rowSize, sizeof(mem->rowSize));
+  snapWrite(f, &mem->rowHitTicks, sizeof(mem->rowHitTicks));
+  snapWrite(f, &mem->rowMissTicks, sizeof(mem->rowMissTicks));
+  snapWrite(f, &mem->rowConflictTicks, sizeof(mem->rowConflictTicks));
+  snapWrite(f, &mem->burstBytes, sizeof(mem->burstBytes));
+  snapWrite(f, mem->openRow, sizeof(mem->openRow));
+  for (unsigned i = 0; i < maxMemRequests; i++) {
+    struct memRequest *req = &mem->requests[i];
+    snapWrite(f, &req->memState, sizeof(req->memState));
+    snapWrite(f, &req->store, sizeof(req->store));
+    snapWrite(f, &req->port, sizeof(req->port));
+    snapWrite(f, &req->arrival, sizeof(req->arrival));
+    snapWrite(f, &req->memAddress, sizeof(req->memAddress));
+    snapWrite(f, &req->memCount, sizeof(req->memCount));
+    snapWrite(f, &req->memTicks, sizeof(req->memTicks));
+    snapWrite(f, &req->latency, sizeof(req->latency));
+    snapWritePointer(m, f, req->memAnswerPtr);
+    snapWritePointer(m, f, req->memValidPtr);
+    snapWritePointer(m, f, req->memDonePtr);
+  }
+  snapWrite(f, &mem->counters, sizeof(mem->counters));
+}
+
+// Set the memory and the requests it holds from a snapshot
+void memRestore(struct machine *m, struct snapReader *r) {
+  struct memContext *mem = m->mem;
+  unsigned size = 0; // The size of the saved memory
+  unsigned used = 0; // The saved pages
+
+  snapRead(r, &size, sizeof(size));
+  snapRead(r, &used, sizeof(used));
+
+  // Start from memory of the saved size reading as zeros
+  if (size != mem->memSize || NULL == mem->pages) {
+    memAllocate(mem, size);
+  }
+  else {
+    mem->memGen++;
+  }
+
+  for (unsigned n = 0; n < used && !r->bad; n++) {
+    unsigned i = 0; // The page's number
+    snapRead(r, &i, sizeof(i));
+    const void *data = snapReadInPlace(r, memPageSize); // The page where the snapshot is mapped
+    if (NULL == data || i >= mem->pageCount) {
+      r->bad = true;
+      return;
+    }
+    memcpy(memPageForWrite(mem, i << memPageBits)->data, data, memPageSize);
+  }
+  mem->memVersion++;
+  memCheckpointsReplaced(mem);
+  memRestoreState(m, r);
+}
+
+// Set memory's arbiter settings and the requests it holds from a snapshot
+void memRestoreState(struct machine *m, struct snapReader *r) {
+  struct memContext *mem = m->mem;
+  snapRead(r, &mem->queueDepth, sizeof(mem->queueDepth));
+  snapRead(r, &mem->maxInFlight, sizeof(mem->maxInFlight));
+  snapRead(r, &mem->priority, sizeof(mem->priority));
+  snapRead(r, &mem->arrivals, sizeof(mem->arrivals));
+  snapRead(r, &mem->dramOn, sizeof(mem->dramOn));
+  snapRead(r, &mem->bankCount, sizeof(mem->bankCount));
+  snapRead(r, &mem->rowSize, sizeof(mem->rowSize));
+  snapRead(r, &mem->rowHitTicks, sizeof(mem->rowHitTicks));
+  snapRead(r, &mem->rowMissTicks, sizeof(mem->rowMissTicks));
+  snapRead(r, &mem->rowConflictTicks, sizeof(mem->rowConflictTicks));
+  snapRead(r, &mem->burstBytes, sizeof(mem->burstBytes));
+  snapRead(r, mem->openRow, sizeof(mem->openRow));
+  if (mem->bankCount < 1 || mem->bankCount > maxMemBanks || 0 == mem->rowSize || 0 == mem->burstBytes) {
+    mem->dramOn = false;
+    mem->bankCount = 1;
+    mem->rowSize = 32;
+    mem->burstBytes = 4;
+    r->bad = true;
+  }
+  for (unsigned i = 0; i < maxMemRequests; i++) {
+    struct memRequest *req = &mem->requests[i];
+    snapRead(r, &req->memState, sizeof(req->memState));
+    snapRead(r, &req->store, sizeof(req->store));
+    snapRead(r, &req->port, sizeof(req->port));
+    snapRead(r, &req->arrival, sizeof(req->arrival));
+    snapRead(r, &req->memAddress, sizeof(req->memAddress));
+    snapRead(r, &req->memCount, sizeof(req->memCount));
+    snapRead(r, &req->memTicks, sizeof(req->memTicks));
+    snapRead(r, &req->latency, sizeof(req->latency));
+    req->memAnswerPtr = snapReadPointer(m, r);
+    req->memValidPtr = snapReadPointer(m, r);
+    req->memDonePtr = snapReadPointer(m, r);
+    if (req->port >= MEM_PORTS || (IDLE != req->memState && NULL == req->memDonePtr)) {
+      req->memState = IDLE;
+      r->bad = true;
+    }
+  }
+  if (mem->queueDepth < 1 || mem->queueDepth > maxMemQueueDepth || mem->maxInFlight < 1 ||
+      mem->maxInFlight > maxMemRequests || mem->priority > memPriorityFifo) {
+    mem->queueDepth = memDefaultQueueDepth;
+    mem->maxInFlight = 1;
+    mem->priority = memPriorityFifo;
+    r->bad = true;
+  }
+  snapRead(r, &mem->counters, sizeof(mem->counters));
+}
+
+// Start saving pages for a checkpoint: each page is saved as it is now
+// the first time it is written from here on
+void memCheckpoint(struct machine *m, unsigned checkpoint) {
+  struct memContext *mem = m->mem;
+
+  if (!mem->cowOn) {
+    mem->cowOn = true;
+    mem->cowFloor = checkpoint;
+  }
+  mem->cowCheckpoint = checkpoint;
+  mem->cowStamp++;
+}
+
+// Check if memory can be set back to how it was at a checkpoint
+bool memCanRestoreCheckpoint(struct machine *m, unsigned checkpoint) {
+  struct memContext *mem = m->mem;
+  return mem->cowOn && checkpoint >= mem->cowFloor && checkpoint <= mem->cowCheckpoint;
+}
+
+// Set memory back to how it was at a checkpoint by putting back, newest
+// first, the blocks saved since then. Later checkpoints are forgotten and
+// blocks are saved for this one again.
+void memRestoreCheckpoint(struct machine *m, unsigned checkpoint) {
+  struct memContext *mem = m->mem;
+
+  while (mem->undoCount > 0 && mem->undo[mem->undoCount - 1].checkpoint >= checkpoint) {
+    struct memUndo *undo = &mem->undo[--mem->undoCount];
+    memCopyIn(mem, undo->block * memBlockSize, undo->data, memBlockSize);
+  }
+  mem->memVersion++;
+  mem->cowCheckpoint = checkpoint;
+  mem->cowStamp++;
+}
+
+// Get the bytes of memory blocks saved for checkpoints
+unsigned long memCheckpointBytes(struct machine *m) {
+  struct memContext *mem = m->mem;
+  return (unsigned long)mem->undoCount * memBlockSize;
+}
+
+// Stop saving blocks and forget the ones saved
+void memCheckpointsOff(struct machine *m) {
+  struct memContext *mem = m->mem;
+  free(mem->undo);
+  mem->undo = NULL;
+  mem->undoCount = 0;
+  mem->undoCap = 0;
+  mem->cowOn = false;
 }
 
 // Free the memory
-void memClean() {
-  free(memPtr);
+void memClean(struct machine *m) {
+  struct memContext *mem = m->mem;
+  memFreePages(mem);
+  memCheckpointsOff(m);
+}
+
+// Dump memory's request counters
+static void memoryStats(struct machine *m) {
+  struct memContext *mem = m->mem;
+  fprintf(m->out, "Fetches: %lu\n", mem->counters.fetches);
+  fprintf(m->out, "Stores: %lu\n", mem->counters.stores);
+  fprintf(m->out, "Bytes fetched: %lu\n", mem->counters.bytesFetched);
+  fprintf(m->out, "Bytes stored: %lu\n", mem->counters.bytesStored);
+  fprintf(m->out, "Requests queued: %lu\n", mem->counters.queued);
+  fprintf(m->out, "Ticks queued: %lu\n", mem->counters.queueTicks);
+
+  // Each bank's share of the ticks banks were busy shows how evenly the
+  // program's data is spread across them
+  unsigned long rowRequests = mem->counters.rowHits + mem->counters.rowMisses + mem->counters.rowConflicts;
+  if (mem->dramOn || 0 != rowRequests) {
+    unsigned long busy = 0; // Ticks all the banks were busy
+    for (unsigned i = 0; i < maxMemBanks; i++) {
+      busy += mem->counters.bankBusyTicks[i];
+    }
+    fprintf(m->out, "Row hits: %lu\n", mem->counters.rowHits);
+    fprintf(m->out, "Row misses: %lu\n", mem->counters.rowMisses);
+    fprintf(m->out, "Row conflicts: %lu\n", mem->counters.rowConflicts);
+    fprintf(m->out, "Row hit rate: %.1f%%\n", rowRequests ? 100.0 * mem->counters.rowHits / rowRequests : 0.0);
+    for (unsigned i = 0; i < mem->bankCount; i++) {
+      fprintf(m->out, "Bank %u: %lu requests, %lu busy ticks (%.1f%%)\n", i, mem->counters.bankAccesses[i],
+              mem->counters.bankBusyTicks[i], busy ? 100.0 * mem->counters.bankBusyTicks[i] / busy : 0.0);
+    }
+  }
+  fprintf(m->out, "\n");
+}
+
+// Set the most requests each port can have queued and in flight
+static void memorySetQueue(struct machine *m, FILE *infile) {
+  struct memContext *mem = m->mem;
+
+  unsigned depth = 0; // The requests
+
+  // Get the depth
+  if (1 != fscanf(infile, "%u", &depth) || depth < 1 || depth > maxMemQueueDepth) {
+    fprintf(m->out, "A port's queue holds 1 to %d requests\n\n", maxMemQueueDepth);
+    return;
+  }
+  mem->queueDepth = depth;
+}
+
+// Set the most requests memory works on at once
+static void memorySetInFlight(struct machine *m, FILE *infile) {
+  struct memContext *mem = m->mem;
+
+  unsigned count = 0; // The requests
+
+  // Get the count
+  if (1 != fscanf(infile, "%u", &count) || count < 1 || count > maxMemRequests) {
+    fprintf(m->out, "Memory works on 1 to %d requests at once\n\n", maxMemRequests);
+    return;
+  }
+  mem->maxInFlight = count;
+  memArbitrate(mem);
+}
+
+// Set the banked DRAM timing from "banks B row R hit H miss M conflict C
+// burst W", closing every row
+static void memoryDramConfig(struct machine *m, FILE *infile) {
+  struct memContext *mem = m->mem;
+
+  unsigned banks = 0; // Banks rows are interleaved across
+  unsigned rowSize = 0; // Bytes in a row
+  unsigned hit = 0; // Ticks to reach the open row
+  unsigned miss = 0; // Ticks to open a row
+  unsigned conflict = 0; // Ticks to close a row and open another
+  unsigned burst = 0; // Bytes moved each tick
+
+  // Get the timing
+  if (6 != fscanf(infile, " banks %u row %u hit %u miss %u conflict %u burst %u", &banks, &rowSize, &hit, &miss,
+                  &conflict, &burst)) {
+    fprintf(m->out, "Usage: memory dram config banks B row R hit H miss M conflict C burst W\n\n");
+    return;
+  }
+
+  // Rows hold at least the bytes a small cache line fetches
+  if (0 == banks || banks > maxMemBanks || rowSize < 8 || rowSize > memPageSize ||
+      0 != (rowSize & (rowSize - 1)) || 0 == burst) {
+    fprintf(m->out, "Banks must be 1 to %d, rows a power of two from 8 to %d bytes and bursts at least 1 byte\n\n",
+            maxMemBanks, memPageSize);
+    return;
+  }
+
+  mem->bankCount = banks;
+  mem->rowSize = rowSize;
+  mem->rowHitTicks = hit;
+  mem->rowMissTicks = miss;
+  mem->rowConflictTicks = conflict;
+  mem->burstBytes = burst;
+  memset(mem->openRow, 0xFF, sizeof(mem->openRow));
+}
+
+// Turn the banked DRAM timing on or off, or set its shape
+static void memoryDram(struct machine *m, FILE *infile) {
+  struct memContext *mem = m->mem;
+
+  char cmd[11]; // "on", "off" or "config"
+
+  // Get the command
+  fscanf(infile, "%10s", cmd);
+
+  if (0 == strcmp(cmd, "on") || 0 == strcmp(cmd, "off")) {
+    mem->dramOn = (0 == strcmp(cmd, "on"));
+    memset(mem->openRow, 0xFF, sizeof(mem->openRow));
+  }
+  else if (0 == strcmp(cmd, "config")) {
+    memoryDramConfig(m, infile);
+  }
+  else {
+    fprintf(m->out, "Usage: memory dram on|off|config\n\n");
+  }
+}
+
+// Set which requests the arbiter starts first: in order of arrival, or a
+// port's before the others'
+static void memorySetPriority(struct machine *m, FILE *infile) {
+  struct memContext *mem = m->mem;
+
+  char name[11]; // The policy or port
+
+  // Get the policy
+  if (1 == fscanf(infile, "%10s", name)) {
+    if (0 == strcmp(name, "fifo")) {
+      mem->priority = memPriorityFifo;
+      return;
+    }
+    for (unsigned port = 0; port < MEM_PORTS; port++) {
+      if (0 == strcmp(name, memPortNames[port])) {
+        mem->priority = port;
+        return;
+      }
+    }
+  }
+  fprintf(m->out, "Usage: memory priority fifo|cache|iodev\n\n");
+}
+
+// Clear memory's request counters
+static void memoryResetStats(struct machine *m) {
+  struct memContext *mem = m->mem;
+  memset(&mem->counters, 0, sizeof(mem->counters));
+}
+
+// Get memory's request counters
+void memGetCounters(struct machine *m, struct memCounters *counters) {
+  struct memContext *mem = m->mem;
+  *counters = mem->counters;
+}
+
+// Add periods repeats of the requests counted since a state the machine
+// has returned to, for ticks the clock jumps over
+void memForwardCounters(struct machine *m, unsigned long periods, const struct memCounters *since) {
+  struct memContext *mem = m->mem;
+  mem->counters.fetches += periods * (mem->counters.fetches - since->fetches);
+  mem->counters.stores += periods * (mem->counters.stores - since->stores);
+  mem->counters.bytesFetched += periods * (mem->counters.bytesFetched - since->bytesFetched);
+  mem->counters.bytesStored += periods * (mem->counters.bytesStored - since->bytesStored);
+  mem->counters.queued += periods * (mem->counters.queued - since->queued);
+  mem->counters.queueTicks += periods * (mem->counters.queueTicks - since->queueTicks);
+  mem->counters.rowHits += periods * (mem->counters.rowHits - since->rowHits);
+  mem->counters.rowMisses += periods * (mem->counters.rowMisses - since->rowMisses);
+  mem->counters.rowConflicts += periods * (mem->counters.rowConflicts - since->rowConflicts);
+  for (unsigned i = 0; i < maxMemBanks; i++) {
+    mem->counters.bankAccesses[i] += periods * (mem->counters.bankAccesses[i] - since->bankAccesses[i]);
+    mem->counters.bankBusyTicks[i] += periods * (mem->counters.bankBusyTicks[i] - since->bankBusyTicks[i]);
+  }
 }
 
 // Read memory commands from the file and call the functions
-void parseMemory(FILE *infile) {
+void parseMemory(struct machine *m, FILE *infile) {
 
   char cmd[11]; // The command to do
 
@@ -212,18 +1111,46 @@ void parseMemory(FILE *infile) {
 
   // Calls the create function
   if (0 == strcmp(cmd, "create")) {
-    memoryCreate(infile);
+    memoryCreate(m, infile);
   }
   // Calls the reset function
   else if (0 == strcmp(cmd, "reset")) {
-    memoryReset();
+    memoryReset(m);
   }
   // Calls the dump function
   else if (0 == strcmp(cmd, "dump")) {
-    memoryDump(infile);
+    memoryDump(m, infile);
   }
   // Calls the set function
   else if (0 == strcmp(cmd, "set")) {
-    memorySet(infile);
+    memorySet(m, infile);
+  }
+  // Calls the load function
+  else if (0 == strcmp(cmd, "load")) {
+    memoryLoad(m, infile);
+  }
+  // Calls the stats function
+  else if (0 == strcmp(cmd, "stats")) {
+    memoryStats(m);
+  }
+  // Calls the resetstats function
+  else if (0 == strcmp(cmd, "resetstats")) {
+    memoryResetStats(m);
+  }
+  // Calls the queue function
+  else if (0 == strcmp(cmd, "queue")) {
+    memorySetQueue(m, infile);
+  }
+  // Calls the inflight function
+  else if (0 == strcmp(cmd, "inflight")) {
+    memorySetInFlight(m, infile);
+  }
+  // Calls the priority function
+  else if (0 == strcmp(cmd, "priority")) {
+    memorySetPriority(m, infile);
+  }
+  // Calls the dram function
+  else if (0 == strcmp(cmd, "dram")) {
+    memoryDram(m, infile);
   }
 }
\ No newline at end of file
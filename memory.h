@@ -3,13 +3,57 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "machine.h"
+#include "snapshot.h"
 
-int parseMemory(FILE *infile); 
-void memStartFetch(unsigned address, unsigned count, uint8_t *dataPtr, bool *donePtr);
-void memStartStore(unsigned address, unsigned count, uint8_t *dataPtr, bool *validPtr, bool *donePtr);
-void memStartTick();
+#define maxMemQueueDepth 8 // The most requests a port can have with memory at once
+#define maxMemBanks 8 // The most banks the DRAM timing can interleave rows across
+
+// The ports devices hand memory their requests on
+enum memPorts { MEM_PORT_CACHE, MEM_PORT_IODEV, MEM_PORTS };
+
+// Counts of memory's requests, kept while the machine runs
+struct memCounters {
+  unsigned long fetches;      // Fetches started
+  unsigned long stores;       // Stores started
+  unsigned long bytesFetched; // Bytes the fetches read
+  unsigned long bytesStored;  // Bytes the stores were handed
+  unsigned long queued;       // Requests that waited for the arbiter to start them
+  unsigned long queueTicks;   // Ticks requests spent waiting
+  unsigned long rowHits;      // Requests that found their row open in the DRAM timing
+  unsigned long rowMisses;    // Requests that found their bank with no row open
+  unsigned long rowConflicts; // Requests that found another row open in their bank
+  unsigned long bankAccesses[maxMemBanks];  // Requests each bank has started
+  unsigned long bankBusyTicks[maxMemBanks]; // Ticks each bank has spent on requests
+};
+
+struct memContext *memContextCreate();
+void parseMemory(struct machine *m, FILE *infile); 
+bool memStartFetch(struct machine *m, enum memPorts port, unsigned address, unsigned count, uint8_t *dataPtr,
+                   bool *donePtr);
+bool memStartStore(struct machine *m, enum memPorts port, unsigned address, unsigned count, uint8_t *dataPtr,
+                   bool *validPtr, bool *donePtr);
+void memCancel(struct machine *m, enum memPorts port);
+void memStartTick(struct machine *m);
 bool memIsMoreCycleWorkNeeded();
-void memDoCycleWork();
-void memClean();
+void memDoCycleWork(struct machine *m);
+bool memIsIdle(struct machine *m);
+unsigned memLatency(struct machine *m, unsigned count);
+uint8_t memPeek(struct machine *m, unsigned address);
+unsigned memFingerprint(struct machine *m, uint8_t *buf);
+unsigned memTicksToNextEvent(struct machine *m);
+void memSkipTicks(struct machine *m, unsigned ticks);
+void memClean(struct machine *m);
+void memSave(struct machine *m, FILE *f);
+void memRestore(struct machine *m, struct snapReader *r);
+void memSaveState(struct machine *m, FILE *f);
+void memRestoreState(struct machine *m, struct snapReader *r);
+void memCheckpoint(struct machine *m, unsigned checkpoint);
+bool memCanRestoreCheckpoint(struct machine *m, unsigned checkpoint);
+void memRestoreCheckpoint(struct machine *m, unsigned checkpoint);
+unsigned long memCheckpointBytes(struct machine *m);
+void memCheckpointsOff(struct machine *m);
+void memGetCounters(struct machine *m, struct memCounters *counters);
+void memForwardCounters(struct machine *m, unsigned long periods, const struct memCounters *since);
 
 #endif
\ No newline at end of file
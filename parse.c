@@ -1,61 +1,88 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include "cpu.h"
-#include "clock.h"
-#include "memory.h"
-#include "imemory.h"
-#include "cache.h"
-#include "iodev.h"
+#include <limits.h>
+#include <unistd.h>
+#include "machine.h"
+#include "batch.h"
+#include "ensemble.h"
 
+// Read script paths, one per line, from standard input
+static char **readScriptNames(unsigned *count) {
+  char name[PATH_MAX + 1]; // The path being read
+  char **names = NULL; // The paths read
+  unsigned cap = 0; // Room in names
 
+  *count = 0;
+  while (NULL != fgets(name, sizeof(name), stdin)) {
+    name[strcspn(name, "\r\n")] = '\0';
+    if ('\0' == name[0]) {
+      continue;
+    }
+    // Grow the list when it is full
+    if (*count == cap) {
+      cap = cap ? cap * 2 : 64;
+      names = realloc(names, cap * sizeof(char *));
+    }
+    names[(*count)++] = strdup(name);
+  }
+  return names;
+}
+
+// Run one script:
+//     emul <script>
+// or run many, each on its own machine, on a pool of threads:
+//     emul -j <threads> <script>...
+// writing each script's output to the script's path with ".out" added,
+// or run many as an ensemble on one thread, with the machines' cpus run
+// together in vector lanes:
+//     emul -e <script>...
+// With no scripts after the thread count or -e, their paths are read from
+// standard input. A thread count of 0 uses one thread per processor.
 int main(int argc, char *argv[]) {
-  
-  char device[11]; // The device being called (cpu, clock, or memory)
+
   static FILE *infile;
-  
 
-  // Open the file
-  infile = fopen(argv[1], "r");
-  
-  // Read the whole file
-  while (1 == fscanf(infile, "%10s", device)) {
-    
-    // Handles the clock
-    if (0 == strcmp(device, "clock")) {
-      parseClock(infile);
-    }
-    // Handles the memory
-    else if (0 == strcmp(device, "memory")) {
-      parseMemory(infile);
+  // Batch mode
+  if (argc >= 3 && 0 == strcmp(argv[1], "-j")) {
+    unsigned threads = atoi(argv[2]); // Threads in the pool
+    char **scripts = argv + 3; // The scripts to run
+    unsigned count = argc - 3; // The number of scripts
+
+    if (0 == threads) {
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
     }
-    // Handles the cpu
-    else if (0 == strcmp(device, "cpu")) {
-      parseCpu(infile);
+    if (0 == count) {
+      scripts = readScriptNames(&count);
     }
 
-    // Handles the imemory
-    else if (0 == strcmp( device, "imemory")) {
-      parseIMemory(infile);
-    }
+    return (0 == batchRun(scripts, count, threads)) ? 0 : 1;
+  }
 
-    // Handles the cache
-    else if (0 == strcmp( device, "cache")) {
-      parseCache(infile);
-    }
+  // Ensemble mode
+  if (argc >= 2 && 0 == strcmp(argv[1], "-e")) {
+    char **scripts = argv + 2; // The scripts to run
+    unsigned count = argc - 2; // The number of scripts
 
-    // Handles the iodevice
-    else if (0 == strcmp( device, "iodev")) {
-      parseIODevice(infile);
+    if (0 == count) {
+      scripts = readScriptNames(&count);
     }
 
+    return (0 == ensembleRun(scripts, count)) ? 0 : 1;
   }
 
+  // Open the file
+  infile = fopen(argv[1], "r");
+
+  // Read the whole file on a machine printing to the screen
+  struct machine *m = machineCreate(stdout);
+  machineRunScript(m, infile);
+
   // Close the file
   fclose(infile);
 
-  // Free the memory and imemory
-  memClean();
-  iMemClean();
+  // Free the machine's memory, imemory and the cpu's translated code
+  machineDestroy(m);
 
    return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "cpu.h"
+#include "clock.h"
+#include "memory.h"
+#include "imemory.h"
+#include "cache.h"
+#include "iodev.h"
+
+// A snapshot file starts with the magic, the format version and the
+// length of the whole file, followed by each device's state in the order
+// clock, cpu, memory, imemory, cache, io device. Values are in the host's
+// byte order.
+static const char snapMagic[8] = {'E', 'M', 'U', 'L', 'S', 'N', 'A', 'P'};
+#define snapVersion 14
+#define snapHeaderSize 20
+#define maxSnapFields 32
+
+// Write bytes to a snapshot
+void snapWrite(FILE *f, const void *data, size_t size) {
+  fwrite(data, 1, size, f);
+}
+
+// Get the next bytes of a snapshot where they are mapped, NULL if the file ends first
+const void *snapReadInPlace(struct snapReader *r, size_t size) {
+  const uint8_t *data = r->pos; // The bytes read
+
+  if (r->bad || size > (size_t)(r->end - r->pos)) {
+    r->bad = true;
+    return NULL;
+  }
+  r->pos += size;
+  return data;
+}
+
+// Read bytes from a snapshot, leaving data untouched if the file ends first
+void snapRead(struct snapReader *r, void *data, size_t size) {
+  const void *src = snapReadInPlace(r, size); // Where the bytes are mapped
+  if (NULL != src) {
+    memcpy(data, src, size);
+  }
+}
+
+// List the fields of every device that pointers between devices point into
+static unsigned snapFields(struct machine *m, struct snapField *fields) {
+  unsigned n = 0; // Fields listed
+  n += cpuSnapFields(m, fields + n);
+  n += cacheSnapFields(m, fields + n);
+  n += iodevSnapFields(m, fields + n);
+  return n;
+}
+
+// Write a pointer as the field it points into and its offset in the field,
+// so it can be wired up again in another process
+void snapWritePointer(struct machine *m, FILE *f, const void *ptr) {
+  struct snapField fields[maxSnapFields]; // Fields that can be pointed into
+  unsigned n = snapFields(m, fields); // The number of fields
+  uint32_t field = 0; // One more than the index of the field, 0 for NULL
+  uint32_t offset = 0; // The offset in the field
+
+  for (unsigned i = 0; NULL != ptr && i < n; i++) {
+    uintptr_t base = (uintptr_t)fields[i].base;
+    if ((uintptr_t)ptr >= base && (uintptr_t)ptr < base + fields[i].size) {
+      field = i + 1;
+      offset = (uintptr_t)ptr - base;
+      break;
+    }
+  }
+  snapWrite(f, &field, sizeof(field));
+  snapWrite(f, &offset, sizeof(offset));
+}
+
+// Read a pointer written by snapWritePointer
+void *snapReadPointer(struct machine *m, struct snapReader *r) {
+  struct snapField fields[maxSnapFields]; // Fields that can be pointed into
+  unsigned n = snapFields(m, fields); // The number of fields
+  uint32_t field = 0; // One more than the index of the field, 0 for NULL
+  uint32_t offset = 0; // The offset in the field
+
+  snapRead(r, &field, sizeof(field));
+  snapRead(r, &offset, sizeof(offset));
+  if (0 == field) {
+    return NULL;
+  }
+  if (field > n || offset >= fields[field - 1].size) {
+    r->bad = true;
+    return NULL;
+  }
+  return (uint8_t *)fields[field - 1].base + offset;
+}
+
+// Save the state of every device to a file
+static void machineSave(struct machine *m, const char *path) {
+  FILE *f = fopen(path, "wb"); // The snapshot file
+  uint32_t version = snapVersion; // The format of the file
+  uint64_t length; // The length of the whole file
+
+  if (NULL == f) {
+    fprintf(m->out, "Cannot create %s\n\n", path);
+    return;
+  }
+
+  // The length is filled in once the devices are written
+  snapWrite(f, snapMagic, sizeof(snapMagic));
+  snapWrite(f, &version, sizeof(version));
+  length = 0;
+  snapWrite(f, &length, sizeof(length));
+
+  clockSave(m, f);
+  cpuSave(m, f);
+  memSave(m, f);
+  iMemSave(m, f);
+  cacheSave(m, f);
+  iodevSave(m, f);
+
+  length = ftell(f);
+  fseek(f, sizeof(snapMagic) + sizeof(version), SEEK_SET);
+  snapWrite(f, &length, sizeof(length));
+  fclose(f);
+}
+
+// Set the state of every device from a file written by machineSave. The
+// file is mapped rather than read, so memory and imemory are copied
+// straight out of it.
+static void machineRestore(struct machine *m, const char *path) {
+  int fd = open(path, O_RDONLY); // The snapshot file
+  struct stat st; // The file's size
+  const uint8_t *map; // The file mapped into memory
+  struct snapReader r; // Reads the mapped file
+  uint32_t version = 0; // The format of the file
+  uint64_t length = 0; // The length the file was written with
+
+  if (fd < 0 || 0 != fstat(fd, &st)) {
+    fprintf(m->out, "Cannot open %s\n\n", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+
+  map = (st.st_size >= snapHeaderSize)
+            ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+            : MAP_FAILED;
+  close(fd);
+
+  // Check the header before changing any device
+  if (MAP_FAILED != map) {
+    memcpy(&version, map + sizeof(snapMagic), sizeof(version));
+    memcpy(&length, map + sizeof(snapMagic) + sizeof(version), sizeof(length));
+  }
+  if (MAP_FAILED == map || 0 != memcmp(map, snapMagic, sizeof(snapMagic)) ||
+      snapVersion != version || length != (uint64_t)st.st_size) {
+    fprintf(m->out, "%s is not a machine snapshot\n\n", path);
+    if (MAP_FAILED != map) {
+      munmap((void *)map, st.st_size);
+    }
+    return;
+  }
+
+  r.pos = map + snapHeaderSize;
+  r.end = map + st.st_size;
+  r.bad = false;
+
+  clockRestore(m, &r);
+  cpuRestore(m, &r);
+  memRestore(m, &r);
+  iMemRestore(m, &r);
+  cacheRestore(m, &r);
+  iodevRestore(m, &r);
+
+  if (r.bad) {
+    fprintf(m->out, "%s is damaged, the machine is only partly restored\n\n", path);
+  }
+
+  munmap((void *)map, st.st_size);
+}
+
+// Read machine commands from the file and call the functions
+void parseMachine(struct machine *m, FILE *infile) {
+
+  char cmd[11]; // The command to do
+  char path[NAME_MAX + PATH_MAX + 1]; // The snapshot file's path
+
+  // Get the command to execute
+  fscanf(infile, "%10s", cmd);
+
+  // Calls the save function
+  if (0 == strcmp(cmd, "save")) {
+    fscanf(infile, "%1000s", path);
+    machineSave(m, path);
+  }
+  // Calls the restore function
+  else if (0 == strcmp(cmd, "restore")) {
+    fscanf(infile, "%1000s", path);
+    machineRestore(m, path);
+  }
+}
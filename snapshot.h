@@ -0,0 +1,30 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "machine.h"
+
+// A field of a device that other devices are handed pointers into, such
+// as the byte and done flag a memory fetch answers into
+struct snapField {
+  void *base;  // The start of the field
+  size_t size; // The size of the field in bytes
+};
+
+// A snapshot file being read where it is mapped into memory
+struct snapReader {
+  const uint8_t *pos; // The next byte to read
+  const uint8_t *end; // Just past the last byte of the file
+  bool bad;           // Set when a read runs past the end of the file
+};
+
+void parseMachine(struct machine *m, FILE *infile);
+void snapWrite(FILE *f, const void *data, size_t size);
+void snapRead(struct snapReader *r, void *data, size_t size);
+const void *snapReadInPlace(struct snapReader *r, size_t size);
+void snapWritePointer(struct machine *m, FILE *f, const void *ptr);
+void *snapReadPointer(struct machine *m, struct snapReader *r);
+
+#endif
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+// Translates an Entropy instruction file, in the format "imemory set"
+// reads, into C that runs the program natively. The output can be loaded
+// with "imemory set <base> native <file>.so".
+//
+// Usage: entropy2c [-b base] <instruction file> <output.c | output.so>
+//
+// When the output name ends in .so the C is compiled with cc.
+
+#define maxWords 256 // The cpu's pc only reaches 256 words
+
+enum cpu_instr_T { ADD = 0, ADDI = 1, MUL = 2, INV = 3, BRANCH = 4, LOAD = 5, STORE = 6, HALTINSTR = 7};
+enum cpu_branch_T { BEQ = 0, BNEQ = 1, BLT = 2};
+
+static const char *regNames[8] = { "ra", "rb", "rc", "rd", "re", "rf", "rg", "rh" };
+
+// Write the code that leaves the program at pc
+static void emitLeave(FILE *out, unsigned pc) {
+  fprintf(out, "{ pc = 0x%02X; goto out; }", pc & 0xFF);
+}
+
+// Write the C for the instruction at pc
+static void emitInstr(FILE *out, unsigned word, unsigned pc, unsigned base, unsigned count) {
+  unsigned code = (word >> 17) & 0x7;
+  unsigned dest = (word >> 14) & 0x7;
+  unsigned src = (word >> 11) & 0x7;
+  unsigned trgt = (word >> 8) & 0x7;
+  unsigned imm = word & 0xFF;
+
+  fprintf(out, "L%02X: /* %05X */\n", pc, word);
+
+  // Loads, stores, halts and unknown branches go back to the emulator
+  if (LOAD == code || STORE == code || HALTINSTR == code ||
+      (BRANCH == code && dest > BLT)) {
+    fprintf(out, "  ");
+    emitLeave(out, pc);
+    fprintf(out, "\n");
+    return;
+  }
+
+  if (BRANCH == code) {
+    const char *compare = (BEQ == dest) ? "==" : (BNEQ == dest) ? "!=" : "<";
+
+    // A taken branch takes two ticks
+    fprintf(out, "  if (%s %s %s) {\n", regNames[src], compare, regNames[trgt]);
+    fprintf(out, "    if (ticks + 2 > maxTicks) ");
+    emitLeave(out, pc);
+    fprintf(out, "\n    ticks += 2; count++;\n    ");
+    if (imm >= base && imm < base + count) {
+      fprintf(out, "goto L%02X;\n", imm);
+    }
+    else {
+      emitLeave(out, imm);
+      fprintf(out, "\n");
+    }
+    fprintf(out, "  }\n");
+
+    // One that is not taken takes one
+    fprintf(out, "  if (ticks + 1 > maxTicks) ");
+    emitLeave(out, pc);
+    fprintf(out, "\n  ticks += 1; count++;\n");
+    return;
+  }
+
+  // The mul instruction takes two ticks, the others one
+  fprintf(out, "  if (ticks + %d > maxTicks) ", MUL == code ? 2 : 1);
+  emitLeave(out, pc);
+  fprintf(out, "\n");
+  if (ADD == code) {
+    fprintf(out, "  %s = %s + %s;\n", regNames[dest], regNames[src], regNames[trgt]);
+  }
+  else if (ADDI == code) {
+    fprintf(out, "  %s = %s + 0x%02X;\n", regNames[dest], regNames[src], imm);
+  }
+  else if (MUL == code) {
+    fprintf(out, "  %s = (%s & 0x0F) * (%s >> 4);\n", regNames[dest], regNames[src], regNames[src]);
+  }
+  else if (INV == code) {
+    fprintf(out, "  %s = ~%s;\n", regNames[dest], regNames[src]);
+  }
+  fprintf(out, "  ticks += %d; count++;\n", MUL == code ? 2 : 1);
+}
+
+// Write the translation unit for the program
+static void emitProgram(FILE *out, const char *inName, unsigned *words,
+                        unsigned count, unsigned base) {
+  fprintf(out, "/* Translated from %s by entropy2c */\n", inName);
+  fprintf(out, "#include <stdint.h>\n\n");
+  fprintf(out, "const unsigned entropyAbiVersion = 1;\n");
+  fprintf(out, "const unsigned entropyBase = 0x%02X;\n", base);
+  fprintf(out, "const unsigned entropyWordCount = %u;\n", count);
+
+  // The words themselves, so imemory can hold the program too
+  fprintf(out, "const unsigned entropyWords[%u] = {", count ? count : 1);
+  for (unsigned i = 0; i < count; i++) {
+    fprintf(out, "%s0x%05X", (0 == i) ? "\n  " : (i % 8) ? ", " : ",\n  ", words[i]);
+  }
+  fprintf(out, "\n};\n\n");
+
+  // Runs whole instructions from *pcPtr while they fit in maxTicks and
+  // returns the ticks used, charging what the emulator's cpu would
+  fprintf(out, "uint64_t entropyRun(uint8_t *regs, unsigned *pcPtr, uint64_t maxTicks,\n");
+  fprintf(out, "                    uint64_t *instructions) {\n");
+  for (int i = 0; i < 8; i++) {
+    fprintf(out, "  uint8_t %s = regs[%d];\n", regNames[i], i);
+  }
+  fprintf(out, "  uint64_t ticks = 0;\n  uint64_t count = 0;\n");
+  fprintf(out, "  unsigned pc = *pcPtr;\n\n");
+
+  // Jump to the instruction at pc
+  fprintf(out, "  switch (pc) {\n");
+  for (unsigned i = 0; i < count; i++) {
+    fprintf(out, "  case 0x%02X: goto L%02X;\n", base + i, base + i);
+  }
+  fprintf(out, "  default: goto out;\n  }\n\n");
+
+  for (unsigned i = 0; i < count; i++) {
+    emitInstr(out, words[i], base + i, base, count);
+  }
+  fprintf(out, "  pc = 0x%02X;\n\n", (base + count) & 0xFF);
+
+  fprintf(out, "out:\n");
+  for (int i = 0; i < 8; i++) {
+    fprintf(out, "  regs[%d] = %s;\n", i, regNames[i]);
+  }
+  fprintf(out, "  *pcPtr = pc;\n  *instructions += count;\n  return ticks;\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned base = 0; // The address the program is set at
+  int arg = 1; // The next argument to read
+
+  // Get the base address
+  if (argc > 2 && 0 == strcmp(argv[1], "-b")) {
+    sscanf(argv[2], "%x", &base);
+    arg = 3;
+  }
+
+  if (argc - arg != 2 || base >= maxWords) {
+    fprintf(stderr, "Usage: %s [-b base] <instruction file> <output.c | output.so>\n", argv[0]);
+    return 1;
+  }
+  const char *inName = argv[arg];
+  const char *outName = argv[arg + 1];
+
+  // Read the words the same way imemory does
+  FILE *inFile = fopen(inName, "r");
+  if (NULL == inFile) {
+    fprintf(stderr, "Cannot open %s\n", inName);
+    return 1;
+  }
+  unsigned words[maxWords]; // The program
+  unsigned count = 0; // Words in the program
+  unsigned inWord; // The input word
+  while (count < maxWords - base && 1 == fscanf(inFile, "%x", &inWord)) {
+    words[count++] = inWord;
+  }
+  fclose(inFile);
+
+  // Write C, straight to the output or to a file to compile
+  size_t outLen = strlen(outName);
+  int shared = outLen > 3 && 0 == strcmp(outName + outLen - 3, ".so");
+  char cName[PATH_MAX]; // The C file to write
+  snprintf(cName, sizeof(cName), shared ? "%s.c" : "%s", outName);
+
+  FILE *outFile = fopen(cName, "w");
+  if (NULL == outFile) {
+    fprintf(stderr, "Cannot write %s\n", cName);
+    return 1;
+  }
+  emitProgram(outFile, inName, words, count, base);
+  fclose(outFile);
+
+  if (shared) {
+    char command[3 * PATH_MAX]; // The compile command
+    snprintf(command, sizeof(command), "cc -O2 -shared -fPIC -o '%s' '%s'", outName, cName);
+    int status = system(command);
+    remove(cName);
+    if (0 != status) {
+      fprintf(stderr, "Compiling %s failed\n", cName);
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include "../image.h"
+
+// Converts a text file of hex values into a binary image the emulator maps
+// in one go: an instruction file, in the format "imemory set" reads, into a
+// program image for "imemory load <file>", or with -d a file of data bytes,
+// in the format "memory set" takes them, into a data image for
+// "memory load <address> <file>".
+//
+// Usage: entropy2img [-b base] <instruction file> <output image>
+//        entropy2img -d <data file> <output image>
+
+int main(int argc, char *argv[]) {
+
+  unsigned base = 0; // The address the program is set at
+  int data = 0; // Set when converting data rather than a program
+  int arg = 1; // The next argument to read
+
+  // Get the base address or the data flag
+  if (argc > 2 && 0 == strcmp(argv[1], "-b")) {
+    sscanf(argv[2], "%x", &base);
+    arg = 3;
+  }
+  else if (argc > 1 && 0 == strcmp(argv[1], "-d")) {
+    data = 1;
+    arg = 2;
+  }
+
+  if (argc - arg != 2) {
+    fprintf(stderr, "Usage: %s [-b base] <instruction file> <output image>\n", argv[0]);
+    fprintf(stderr, "       %s -d <data file> <output image>\n", argv[0]);
+    return 1;
+  }
+  const char *inName = argv[arg];
+  const char *outName = argv[arg + 1];
+
+  FILE *inFile = fopen(inName, "r");
+  if (NULL == inFile) {
+    fprintf(stderr, "Cannot open %s\n", inName);
+    return 1;
+  }
+  FILE *outFile = fopen(outName, "wb");
+  if (NULL == outFile) {
+    fprintf(stderr, "Cannot write %s\n", outName);
+    fclose(inFile);
+    return 1;
+  }
+
+  // The count is filled in once the contents are written
+  struct imageHeader header; // The image's header
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, data ? imageDataMagic : imageProgramMagic, sizeof(header.magic));
+  header.version = imageVersion;
+  header.address = data ? 0 : base;
+  fwrite(&header, sizeof(header), 1, outFile);
+
+  // Read the values the same way imemory and memory do
+  unsigned inValue; // The input word or byte
+  while (1 == fscanf(inFile, "%x", &inValue)) {
+    if (data) {
+      uint8_t byte = inValue;
+      fwrite(&byte, 1, 1, outFile);
+    }
+    else {
+      uint32_t word = htole32(inValue);
+      fwrite(&word, sizeof(word), 1, outFile);
+    }
+    header.count++;
+  }
+  fclose(inFile);
+
+  // The header is little endian like the words
+  header.version = htole32(header.version);
+  header.address = htole32(header.address);
+  header.count = htole32(header.count);
+  rewind(outFile);
+  fwrite(&header, sizeof(header), 1, outFile);
+  if (0 != fclose(outFile)) {
+    fprintf(stderr, "Cannot write %s\n", outName);
+    return 1;
+  }
+
+  return 0;
+}